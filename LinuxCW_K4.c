@@ -1,9 +1,13 @@
 /*
  *  LinuxCW K4 morse code trainer v1.19x.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include <sched.h>
 #include <unistd.h>
 #include <signal.h>
@@ -12,20 +16,121 @@
 #include <getopt.h>
 #include <alsa/asoundlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <math.h>
 #include <linux/input.h>
+#include <linux/uinput.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define INPUT_NODISP "stty -echo"
 #define INPUT_NORMAL "stty echo"
 #define INPUT_KEYBOARD "/dev/input/event"
 
-int EVENTnum = 3, usec_DI = 80000, usec_DA = 250000, usec_SGap = 50000, usec_BGap = 320000;
+int usec_DI = 80000, usec_DA = 250000, usec_SGap = 50000, usec_BGap = 320000;
 int val_dida = 120000, val_char = 125000, val_space = 480000;
 
-const char* const TriMorse = "?ET?IA?NM????SU?RW????DK?GO?????????????HV?F?????L??PJ?????????????BX?CY????ZQ";
-const char* const PntaCode = "09?8???7?????/?61???????2???3?45";
-const char* const HexaCode = "????????????,?????()!;???????????'???@????.???????_????????????\n\0";
+/*
+ *   Morse codebook
+ *
+ *   A code is packed as a leading 1 and then one bit per element, first
+ *   element highest, dah = 1: "-.-" is 0b1101.  The compiler packs the
+ *   dot/dash strings below into the encode and decode tables, so every
+ *   lookup is a single index whatever the code length.
+ */
+#define CW_MAXLEN 9
+#define CW_BIT(s, i) (sizeof(s) > (i) + 1 ? (s[(i) < sizeof(s) ? (i) : 0] == '-') << (sizeof(s) - 2 - (i)) : 0)
+#define CW_PACK(s) ((1 << (sizeof(s) - 1)) | CW_BIT(s, 0) | CW_BIT(s, 1) | CW_BIT(s, 2) | \
+                    CW_BIT(s, 3) | CW_BIT(s, 4) | CW_BIT(s, 5) | CW_BIT(s, 6) | CW_BIT(s, 7) | CW_BIT(s, 8))
+
+/* X(key, text, code): key is the character, or the code point for Cyrillic */
+#define CW_LATIN(X) \
+    X('A', "A", ".-") X('B', "B", "-...") X('C', "C", "-.-.") X('D', "D", "-..") \
+    X('E', "E", ".") X('F', "F", "..-.") X('G', "G", "--.") X('H', "H", "....") \
+    X('I', "I", "..") X('J', "J", ".---") X('K', "K", "-.-") X('L', "L", ".-..") \
+    X('M', "M", "--") X('N', "N", "-.") X('O', "O", "---") X('P', "P", ".--.") \
+    X('Q', "Q", "--.-") X('R', "R", ".-.") X('S', "S", "...") X('T', "T", "-") \
+    X('U', "U", "..-") X('V', "V", "...-") X('W', "W", ".--") X('X', "X", "-..-") \
+    X('Y', "Y", "-.--") X('Z', "Z", "--..")
+#define CW_CYRILLIC(X) \
+    X(0x410, "А", ".-") X(0x411, "Б", "-...") X(0x412, "В", ".--") X(0x413, "Г", "--.") \
+    X(0x414, "Д", "-..") X(0x415, "Е", ".") X(0x416, "Ж", "...-") X(0x417, "З", "--..") \
+    X(0x418, "И", "..") X(0x419, "Й", ".---") X(0x41a, "К", "-.-") X(0x41b, "Л", ".-..") \
+    X(0x41c, "М", "--") X(0x41d, "Н", "-.") X(0x41e, "О", "---") X(0x41f, "П", ".--.") \
+    X(0x420, "Р", ".-.") X(0x421, "С", "...") X(0x422, "Т", "-") X(0x423, "У", "..-") \
+    X(0x424, "Ф", "..-.") X(0x425, "Х", "....") X(0x426, "Ц", "-.-.") X(0x427, "Ч", "---.") \
+    X(0x428, "Ш", "----") X(0x429, "Щ", "--.-") X(0x42a, "Ъ", "--.--") X(0x42b, "Ы", "-.--") \
+    X(0x42c, "Ь", "-..-") X(0x42d, "Э", "..-..") X(0x42e, "Ю", "..--") X(0x42f, "Я", ".-.-")
+#define CW_COMMON(X) \
+    X('0', "0", "-----") X('1', "1", ".----") X('2', "2", "..---") X('3', "3", "...--") \
+    X('4', "4", "....-") X('5', "5", ".....") X('6', "6", "-....") X('7', "7", "--...") \
+    X('8', "8", "---..") X('9', "9", "----.") X('.', ".", ".-.-.-") X(',', ",", "--..--") \
+    X('?', "?", "..--..") X('/', "/", "-..-.") X('!', "!", "-.-.--") X(';', ";", "-.-.-.") \
+    X('\'', "'", ".----.") X('@', "@", ".--.-.") X('_', "_", "..--.-") X('(', "(", "-.--.") \
+    X(')', ")", "-.--.-") X('=', "=", "-...-") X('+', "+", ".-.-.") X('-', "-", "-....-") \
+    X(':', ":", "---...") X('"', "\"", ".-..-.") X('&', "&", ".-...") X('$', "$", "...-..-")
+/* prosigns, written <XX> in text; the aliases share their code with punctuation */
+#define CW_PROSIGNS(X) X(0, "<SK>", "...-.-") X(0, "<SOS>", "...---...")
+#define CW_ALIASES(X) X(0, "<AR>", ".-.-.") X(0, "<BT>", "-...-") X(0, "<KN>", "-.--.") \
+    X(0, "<AS>", ".-...") X(0, "<HH>", "........")
+
+#define CW_ASCII_ENTRY(k, t, c) [k] = CW_PACK(c),
+#define CW_CYRILLIC_ENTRY(k, t, c) [(k) - 0x410] = CW_PACK(c),
+#define CW_DECODE_ENTRY(k, t, c) [CW_PACK(c)] = t,
+#define CW_SYMBOL_ENTRY(k, t, c) { t, CW_PACK(c) },
+
+struct cw_symbol {
+    const char *text;
+    unsigned short code;
+};
+static const unsigned short cw_ascii[128] = { CW_LATIN(CW_ASCII_ENTRY) CW_COMMON(CW_ASCII_ENTRY) };
+static const unsigned short cw_cyrillic[32] = { CW_CYRILLIC(CW_CYRILLIC_ENTRY) };
+static const struct cw_symbol cw_prosigns[] = { CW_PROSIGNS(CW_SYMBOL_ENTRY) CW_ALIASES(CW_SYMBOL_ENTRY) };
+static const char *const cw_decode_latin[2 << CW_MAXLEN] = {
+    CW_LATIN(CW_DECODE_ENTRY) CW_COMMON(CW_DECODE_ENTRY) CW_PROSIGNS(CW_DECODE_ENTRY)
+};
+static const char *const cw_decode_cyrillic[2 << CW_MAXLEN] = {
+    CW_CYRILLIC(CW_DECODE_ENTRY) CW_COMMON(CW_DECODE_ENTRY) CW_PROSIGNS(CW_DECODE_ENTRY)
+};
+static const char *const *cw_decode = cw_decode_latin;
+
+/* code for a Unicode code point, 0 if it has none */
+static int cw_encode(unsigned int cp)
+{
+    if (cp < 128)
+        return cw_ascii[cp >= 'a' && cp <= 'z' ? cp - 'a' + 'A' : cp];
+    if (cp == 0x401 || cp == 0x451)         /* YO is keyed as YE */
+        cp = 0x415;
+    if (cp >= 0x430 && cp < 0x450)
+        cp -= 0x20;
+    if (cp >= 0x410 && cp < 0x430)
+        return cw_cyrillic[cp - 0x410];
+    return 0;
+}
+
+static int cw_encode_prosign(const char *name)
+{
+    int i;
+    for (i = 0; i < sizeof(cw_prosigns) / sizeof(cw_prosigns[0]); i++)
+        if (!strcmp(name, cw_prosigns[i].text))
+            return cw_prosigns[i].code;
+    return 0;
+}
+
+/* eight or more dits is the error sign */
+static int cw_is_error(int code, int len)
+{
+    return len >= 8 && !(code & (code - 1));
+}
 
 static char *device = "default";         /* playback device */
 static snd_pcm_format_t format = SND_PCM_FORMAT_S16;    /* sample format */
@@ -39,38 +144,241 @@ static int period_event = 0;                /* produce poll event after each per
 volatile int OnWav = 0;
 volatile int m_Interrupt = 0;
 static int KeyEventAccess = 0;
-static int TriNum = 0, BinNum = 0, WordLen = 0;
+static int key_wake_fd = -1;        /* eventfd, signalled on key down and interrupt */
+static int decode_wake_fd = -1;     /* eventfd, signalled on key events for the decoder */
+static int echo_wake_fd = -1;       /* eventfd, signalled when the audio thread lets echoes out */
 static snd_pcm_sframes_t buffer_size;
 static snd_pcm_sframes_t period_size;
 static snd_output_t *output = NULL;
-struct timeval keyUp_time, keyDown_time, current_time;
-pthread_mutex_t mutex;
 void * ReadFile_AK();
 char filename[64];
 
+static double mono_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ *   Practice text generator
+ *
+ *   Groups of random symbols from a charset, drawn from xoshiro256**.
+ *   Text is produced in chunks of GEN_CHUNK groups and chunk k always
+ *   uses the stream seeded from (seed, k), so a seed reproduces the same
+ *   text whether it is played, or exported by any number of threads.
+ */
+#define GEN_CHUNK 65536         /* groups per independent stream */
+#define GEN_MAXSYM 256
+
+struct rng {
+    uint64_t s[4];
+};
+
+struct charset {
+    const char *sym[GEN_MAXSYM];
+    unsigned char len[GEN_MAXSYM];
+    int count;
+    int maxlen;
+};
+
+static uint64_t gen_seed;
+static struct charset gen_charset;
+static char *practice_text = NULL;  /* generated text played instead of a file */
+static size_t practice_len = 0;
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void rng_seed(struct rng *r, uint64_t seed, uint64_t stream)
+{
+    uint64_t x = seed ^ splitmix64(&stream);
+    int i;
+    for (i = 0; i < 4; i++)
+        r->s[i] = splitmix64(&x);
+}
+
+static inline uint64_t rng_next(struct rng *r)
+{
+    uint64_t *s = r->s, result = ((s[1] * 5) << 7 | (s[1] * 5) >> 57) * 9, t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = s[3] << 45 | s[3] >> 19;
+    return result;
+}
+
+/* split a set name or a literal list of UTF-8 characters and <prosigns> into symbols */
+static int charset_parse(struct charset *cs, const char *set)
+{
+    static const struct { const char *name, *chars; } named[] = {
+        { "default", ",.0123456789?ABCDEFGHIJKLMNOPQRSTUVWXYZ" },
+        { "letters", "ABCDEFGHIJKLMNOPQRSTUVWXYZ" },
+        { "digits", "0123456789" },
+        { "alnum", "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789" },
+        { "punct", ".,?/!;'@_()=+-:\"&$" },
+        { "prosigns", "<AR><SK><BT><KN><AS>" },
+        { "cyrillic", "АБВГДЕЖЗИЙКЛМНОПРСТУФХЦЧШЩЪЫЬЭЮЯ" },
+    };
+    const char *p, *end;
+    int i;
+    for (i = 0; i < sizeof(named) / sizeof(named[0]); i++)
+        if (!strcmp(set, named[i].name))
+            set = named[i].chars;
+    cs->count = cs->maxlen = 0;
+    for (p = set; *p && cs->count < GEN_MAXSYM; p = end) {
+        end = p + 1;
+        if (*p == '<' && strchr(p, '>'))
+            end = strchr(p, '>') + 1;
+        else
+            while ((*end & 0xc0) == 0x80)
+                end++;
+        cs->sym[cs->count] = p;
+        cs->len[cs->count] = end - p;
+        cs->maxlen = end - p > cs->maxlen ? end - p : cs->maxlen;
+        cs->count++;
+    }
+    return cs->count ? 0 : -1;
+}
+
+/*
+ *   Write groups [first, first + count) of a text with inblock symbols
+ *   per group and blocks groups per line, returns the bytes written
+ */
+static size_t gen_groups(const struct charset *cs, uint64_t first, uint64_t count,
+             int inblock, int blocks, char *out)
+{
+    struct rng r;
+    char *p = out;
+    uint64_t g;
+    int i, k;
+    rng_seed(&r, gen_seed, first / GEN_CHUNK);
+    for (g = first; g < first + count; g++) {
+        if (g % GEN_CHUNK == 0)
+            rng_seed(&r, gen_seed, g / GEN_CHUNK);
+        for (i = 0; i < inblock; i++) {
+            uint64_t x = rng_next(&r);
+            k = (uint32_t)(x >> 32) * (uint64_t)cs->count >> 32;
+            memcpy(p, cs->sym[k], cs->len[k]);
+            p += cs->len[k];
+        }
+        *p++ = ' ';
+        if ((g + 1) % blocks == 0)
+            *p++ = '\n';
+    }
+    return p - out;
+}
+
+static size_t gen_bytes(const struct charset *cs, uint64_t count, int inblock)
+{
+    return count * (inblock * cs->maxlen + 2);
+}
+
+/* practice text for the player, kept in memory */
 int generate_cwtest(int lines_ct, int blocks_ct, int inblock_ct)
 {
-    FILE* fp;
-    char CW_char[39]={44,46,48,49,50,51,52,53,54,55,56,57,63,65,66,67,68,69,70,71,72,73,74,75,76,77,78,79,80,81,82,83,84,85,86,87,88,89,90};
-    srand(time(NULL));
-    if((fp=fopen(".CWtest","w"))==NULL){return -1;}
-    for(int pfline=0;pfline<lines_ct;pfline++)
-    {
-        for(int pfblock=0;pfblock<blocks_ct;pfblock++)
-        {
-            for(int pf=0;pf<inblock_ct;pf++)
-            {
-                fputc(CW_char[rand()%39],fp);
-            }fputc(' ',fp);
-        }fputc('\n',fp);
+    uint64_t count = (uint64_t)lines_ct * blocks_ct;
+    free(practice_text);
+    if ((practice_text = malloc(gen_bytes(&gen_charset, count, inblock_ct) + 1)) == NULL)
+        return -1;
+    practice_len = gen_groups(&gen_charset, 0, count, inblock_ct, blocks_ct, practice_text);
+    return 0;
+}
+
+/*
+ *   Bulk export: chunks are generated in parallel and written in order
+ */
+struct gen_export {
+    FILE *fout;
+    uint64_t groups;
+    int inblock, blocks;
+    uint64_t next;          /* next chunk to generate */
+    uint64_t turn;          /* next chunk to write */
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void *gen_worker(void *arg)
+{
+    struct gen_export *ex = arg;
+    uint64_t chunks = (ex->groups + GEN_CHUNK - 1) / GEN_CHUNK, k;
+    char *buf = malloc(gen_bytes(&gen_charset, GEN_CHUNK, ex->inblock));
+    size_t len;
+    while (buf && (k = __atomic_fetch_add(&ex->next, 1, __ATOMIC_RELAXED)) < chunks) {
+        uint64_t first = k * GEN_CHUNK;
+        len = gen_groups(&gen_charset, first, ex->groups - first < GEN_CHUNK ? ex->groups - first : GEN_CHUNK,
+                 ex->inblock, ex->blocks, buf);
+        pthread_mutex_lock(&ex->lock);
+        while (ex->turn != k)
+            pthread_cond_wait(&ex->cond, &ex->lock);
+        ex->failed |= fwrite(buf, 1, len, ex->fout) != len;
+        ex->turn++;
+        pthread_cond_broadcast(&ex->cond);
+        pthread_mutex_unlock(&ex->lock);
     }
-    fclose(fp);
+    if (buf == NULL)
+        ex->failed = 1;
+    free(buf);
     return 0;
 }
 
-static void generate_sine(const snd_pcm_channel_area_t *areas, 
-              snd_pcm_uframes_t offset,
-              int count, double *_phase)
+static int generate_export(const char *path, uint64_t groups, int inblock, int blocks)
+{
+    struct gen_export ex = { NULL, groups, inblock, blocks, 0, 0, 0 };
+    pthread_t *workers;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN), i;
+    double t0 = mono_time();
+    ex.fout = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (ex.fout == NULL) {
+        printf("[!] Unable to write %s\n", path);
+        return -1;
+    }
+    jobs = jobs < 1 ? 1 : jobs;
+    pthread_mutex_init(&ex.lock, NULL);
+    pthread_cond_init(&ex.cond, NULL);
+    if ((workers = calloc(jobs, sizeof(pthread_t))) == NULL)
+        return -1;
+    for (i = 0; i < jobs; i++)
+        if (pthread_create(&workers[i], NULL, gen_worker, &ex) != 0)
+            break;
+    if (i == 0)
+        gen_worker(&ex);
+    while (i-- > 0)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_cond_destroy(&ex.cond);
+    pthread_mutex_destroy(&ex.lock);
+    if ((ex.fout != stdout && fclose(ex.fout)) || ex.failed) {
+        printf("[!] Failed writing %s\n", path);
+        return -1;
+    }
+    if (ex.fout != stdout)
+        printf("[-] Exported %llu groups with seed %llu in %.2f s.\n",
+               (unsigned long long)groups, (unsigned long long)gen_seed, mono_time() - t0);
+    return 0;
+}
+
+/*
+ *   Reference generator with sin() per sample, kept for --bench synth
+ */
+static void generate_sine_ref(const snd_pcm_channel_area_t *areas,
+                  snd_pcm_uframes_t offset,
+                  int count, double *_phase)
 {
     static double max_phase = 2. * M_PI;
     double phase = *_phase;
@@ -131,564 +439,7244 @@ static void generate_sine(const snd_pcm_channel_area_t *areas,
     }
     *_phase = phase;
 }
-static int set_hwparams(snd_pcm_t *handle,
-            snd_pcm_hw_params_t *params,
-            snd_pcm_access_t access)
+/*
+ *   Tone synthesis - phase accumulator oscillator with a wavetable
+ *
+ *   The 64-bit phase maps 0..2^64 onto one sine cycle; the top
+ *   SYNTH_TABLE_BITS index the table and the next 24 bits give the
+ *   linear interpolation fraction.  Against generate_sine_ref() the
+ *   output stays within 1 LSB for S16 and 1e-6 of full scale for
+ *   S32/FLOAT (see --bench synth).
+ */
+#define SYNTH_TABLE_BITS 12
+#define SYNTH_TABLE_SIZE (1 << SYNTH_TABLE_BITS)
+#define SYNTH_BLOCK 256             /* frames rendered per kernel call */
+
+typedef float v4sf __attribute__ ((vector_size (16)));
+typedef int v4si __attribute__ ((vector_size (16)));
+typedef short v4hi __attribute__ ((vector_size (8)));
+
+struct nco {
+    uint64_t phase;
+    uint64_t step;
+};
+
+typedef void (*synth_kernel_t)(const float *src, unsigned char *dst, int count);
+
+static float sine_table[SYNTH_TABLE_SIZE + 1];  /* one guard point for interpolation */
+static synth_kernel_t synth_kernel;
+static int frame_bytes;
+static int synth_bits, synth_phys_bps, synth_big_endian, synth_unsigned, synth_float;
+
+static void nco_set_freq(struct nco *osc, double tone, unsigned int sr)
 {
-    unsigned int rrate;
-    snd_pcm_uframes_t size;
-    int err, dir;
-    /* choose all parameters */
-    if ((err = snd_pcm_hw_params_any(handle, params)) < 0) {
-        printf("[!] Broken configuration for playback: no configurations available: %s\n", snd_strerror(err));
-        return err;
-    }
-    /* set hardware resampling */
-    if ((err = snd_pcm_hw_params_set_rate_resample(handle, params, resample)) < 0) {
-        printf("[!] Resampling setup failed for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    /* set the interleaved read/write format */
-    if ((err = snd_pcm_hw_params_set_access(handle, params, access)) < 0) {
-        printf("[!] Access type not available for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    /* set the sample format */
-    if ((err = snd_pcm_hw_params_set_format(handle, params, format)) < 0) {
-        printf("[!] Sample format not available for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    /* set the count of channels */
-    if ((err = snd_pcm_hw_params_set_channels(handle, params, channels)) < 0) {
-        printf("[!] Channels count (%u) not available for playbacks: %s\n", channels, snd_strerror(err));
-        return err;
-    }
-    /* set the stream rate */
-    rrate = rate;
-    if ((err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0)) < 0) {
-        printf("[!] Rate %uHz not available for playback: %s\n", rate, snd_strerror(err));
-        return err;
-    }
-    if (rrate != rate) {
-        printf("[!] Rate doesn't match (requested %uHz, get %iHz)\n", rate, err);
-        return -EINVAL;
-    }
-    /* set the buffer time */
-    if ((err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &buffer_time, &dir)) < 0) {
-        printf("[!] Unable to set buffer time %u for playback: %s\n", buffer_time, snd_strerror(err));
-        return err;
-    }
-    if ((err = snd_pcm_hw_params_get_buffer_size(params, &size)) < 0) {
-        printf("[!] Unable to get buffer size for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    buffer_size = size;
-    /* set the period time */
-    if ((err = snd_pcm_hw_params_set_period_time_near(handle, params, &period_time, &dir)) < 0) {
-        printf("[!] Unable to set period time %u for playback: %s\n", period_time, snd_strerror(err));
-        return err;
-    }
-    if ((err = snd_pcm_hw_params_get_period_size(params, &size, &dir)) < 0) {
-        printf("[!] Unable to get period size for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    period_size = size;
-    /* write the parameters to device */
-    if ((err = snd_pcm_hw_params(handle, params)) < 0) {
-        printf("[!] Unable to set hw params for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    return 0;
+    osc->step = (uint64_t)(tone / sr * 18446744073709551616.0);
 }
-static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
+
+/* render count samples in [-1, 1], count is rounded up to a multiple of 4 in dst */
+static void nco_render(struct nco *osc, float *dst, int count)
 {
-    int err;
-    /* get the current swparams */
-    if ((err = snd_pcm_sw_params_current(handle, swparams)) < 0) {
-        printf("[!] Unable to determine current swparams for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    /* start the transfer when the buffer is almost full: */
-    /* (buffer_size / avail_min) * avail_min */
-    if ((err = snd_pcm_sw_params_set_start_threshold(handle, swparams, (buffer_size / period_size) * period_size)) < 0) {
-        printf("[!] Unable to set start threshold mode for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    /* allow the transfer when at least period_size samples can be processed */
-    /* or disable this mechanism when period event is enabled (aka interrupt like style processing) */
-    if ((err = snd_pcm_sw_params_set_avail_min(handle, swparams, period_event ? buffer_size : period_size)) < 0) {
-        printf("[!] Unable to set avail min for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    /* enable period events when requested */
-    if (period_event) {
-        if ((err = snd_pcm_sw_params_set_period_event(handle, swparams, 1)) < 0) {
-            printf("[!] Unable to set period event: %s\n", snd_strerror(err));
-            return err;
+    uint64_t phase = osc->phase;
+    int i, k;
+    for (i = 0; i < count; i += 4) {
+        v4sf a, b, frac;
+        for (k = 0; k < 4; k++) {
+            unsigned int idx = phase >> (64 - SYNTH_TABLE_BITS);
+            a[k] = sine_table[idx];
+            b[k] = sine_table[idx + 1];
+            frac[k] = (float)((phase >> (40 - SYNTH_TABLE_BITS)) & 0xffffff) * (1.0f / 16777216.0f);
+            phase += osc->step;
         }
+        a += (b - a) * frac;
+        memcpy(dst + i, &a, sizeof(a));
     }
-    /* write the parameters to the playback device */
-    if ((err = snd_pcm_sw_params(handle, swparams)) < 0) {
-        printf("[!] Unable to set sw params for playback: %s\n", snd_strerror(err));
-        return err;
-    }
-    return 0;
+    osc->phase += osc->step * count;
 }
-/*
- *   Underrun and suspend recovery
- */
- 
-static int xrun_recovery(snd_pcm_t *handle, int err)
+
+static inline v4hi synth_swap16(v4hi v) { return (v << 8) | ((v >> 8) & 0xff); }
+static inline v4si synth_swap32(v4si v)
 {
-    if (err == -EPIPE) {    /* under-run */
-        err = snd_pcm_prepare(handle);
-        if (err < 0)
-            printf("[!] Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
-        return 0;
-    } else if (err == -ESTRPIPE) {
-        while ((err = snd_pcm_resume(handle)) == -EAGAIN)
-            sleep(1);   /* wait until the suspend flag is released */
-        if (err < 0) {
-            err = snd_pcm_prepare(handle);
-            if (err < 0)
-                printf("[!] Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
-        }
-        return 0;
-    }
-    return err;
+    return (v << 24) | ((v << 8) & 0xff0000) | ((v >> 8) & 0xff00) | ((v >> 24) & 0xff);
 }
+static inline v4hi synth_keep16(v4hi v) { return v; }
+static inline v4si synth_keep32(v4si v) { return v; }
+static inline v4hi synth_conv16(v4sf x) { return __builtin_convertvector(__builtin_convertvector(x * 32767.0f, v4si), v4hi); }
+static inline v4si synth_conv32(v4sf x) { return __builtin_convertvector(x * 2147483520.0f, v4si); }
+static inline v4si synth_convf(v4sf x) { return (v4si)x; }
+
 /*
- *   Transfer method - write only
+ *   One kernel per sample format, byte order and channel count (0 = any),
+ *   converting a block of float samples into interleaved frames.
  */
-static int write_loop(snd_pcm_t *handle,
-              signed short *samples,
-              snd_pcm_channel_area_t *areas)
+#define SYNTH_KERNEL(name, vtype, stype, conv, bias, swap, chn)                    \
+static void name(const float *src, unsigned char *dst, int count)                  \
+{                                                                                  \
+    int i, k, c;                                                                   \
+    for (i = 0; i < count; i += 4) {                                               \
+        v4sf x;                                                                    \
+        vtype v;                                                                   \
+        stype out[4];                                                              \
+        memcpy(&x, src + i, sizeof(x));                                            \
+        v = swap(conv(x) ^ (stype)(bias));                                         \
+        memcpy(out, &v, sizeof(out));                                              \
+        if (chn == 1 && i + 4 <= count) {                                          \
+            memcpy(dst, out, sizeof(out));                                         \
+            dst += sizeof(out);                                                    \
+            continue;                                                              \
+        }                                                                          \
+        for (k = 0; k < 4 && i + k < count; k++)                                   \
+            for (c = 0; c < (chn ? chn : (int)channels); c++, dst += sizeof(stype)) \
+                memcpy(dst, &out[k], sizeof(stype));                               \
+    }                                                                              \
+}
+
+#define SYNTH_KERNELS(fmt, vtype, stype, conv, bias, swap)                         \
+    SYNTH_KERNEL(synth_##fmt##_1, vtype, stype, conv, bias, swap, 1)               \
+    SYNTH_KERNEL(synth_##fmt##_2, vtype, stype, conv, bias, swap, 2)               \
+    SYNTH_KERNEL(synth_##fmt##_n, vtype, stype, conv, bias, swap, 0)
+
+SYNTH_KERNELS(s16, v4hi, short, synth_conv16, 0, synth_keep16)
+SYNTH_KERNELS(s16_swap, v4hi, short, synth_conv16, 0, synth_swap16)
+SYNTH_KERNELS(u16, v4hi, short, synth_conv16, 0x8000, synth_keep16)
+SYNTH_KERNELS(u16_swap, v4hi, short, synth_conv16, 0x8000, synth_swap16)
+SYNTH_KERNELS(s32, v4si, int, synth_conv32, 0, synth_keep32)
+SYNTH_KERNELS(s32_swap, v4si, int, synth_conv32, 0, synth_swap32)
+SYNTH_KERNELS(u32, v4si, int, synth_conv32, 0x80000000, synth_keep32)
+SYNTH_KERNELS(u32_swap, v4si, int, synth_conv32, 0x80000000, synth_swap32)
+SYNTH_KERNELS(float, v4si, int, synth_convf, 0, synth_keep32)
+SYNTH_KERNELS(float_swap, v4si, int, synth_convf, 0, synth_swap32)
+
+/* any other format (8/24 bit): byte by byte, as generate_sine_ref() does */
+static void synth_generic(const float *src, unsigned char *dst, int count)
 {
-    double phase = 0;
-    signed short *ptr;
-    int err, cptr;
-    while (!m_Interrupt){
-      while (OnWav){
-        generate_sine(areas, 0, period_size, &phase);
-        ptr = samples;
-        cptr = period_size;
-        while (cptr > 0) {
-            err = snd_pcm_writei(handle, ptr, cptr);
-            if (err == -EAGAIN)
-                continue;
-            if (err < 0) {
-                if (xrun_recovery(handle, err) < 0) {
-                    printf("[!] Write error: %s\n", snd_strerror(err));
-                    return -1;
-                }
-                break;  /* skip one period */
+    unsigned int maxval = (1U << (synth_bits - 1)) - 1;
+    int bps = synth_bits / 8;
+    int i, chn;
+    while (count-- > 0) {
+        int res = *src++ * maxval;
+        if (synth_unsigned)
+            res ^= 1U << (synth_bits - 1);
+        for (chn = 0; chn < channels; chn++) {
+            if (synth_big_endian) {
+                for (i = 0; i < bps; i++)
+                    *(dst + synth_phys_bps - 1 - i) = (res >> i * 8) & 0xff;
+            } else {
+                for (i = 0; i < bps; i++)
+                    *(dst + i) = (res >> i * 8) & 0xff;
             }
-            ptr += err * channels;
-            cptr -= err;
+            dst += synth_phys_bps;
         }
-      }
-    }printf("\n=============================\n");
-    return 0;
+    }
 }
 
-static int write_from_file(snd_pcm_t *handle,
-              signed short *samples,
-              snd_pcm_channel_area_t *areas)
+static void sine_table_init(void)
 {
-    int rf;
-    pthread_t RF_pid;
-    OnWav = 0;m_Interrupt = 0;
-    if((rf = pthread_create(&RF_pid, NULL, ReadFile_AK, NULL))<0){
-        printf("[!] Fail to create AutoKey thread.\n");
-    }
-    write_loop(handle,samples,areas);
-    pthread_join(RF_pid,NULL);printf("[-] AutoKey closed.\n");
-    OnWav = 0;m_Interrupt = 0;
-    return 0;
+    static int table_ready = 0;
+    int i;
+    if (table_ready)
+        return;
+    for (i = 0; i <= SYNTH_TABLE_SIZE; i++)
+        sine_table[i] = sin(2. * M_PI * i / SYNTH_TABLE_SIZE);
+    table_ready = 1;
 }
 
-struct transfer_method {
-    const char *name;
-    snd_pcm_access_t access;
-    int (*transfer_loop)(snd_pcm_t *handle,
-                 signed short *samples,
-                 snd_pcm_channel_area_t *areas);
-};
-static struct transfer_method transfer_methods[] = {
-    { "write", SND_PCM_ACCESS_RW_INTERLEAVED, write_loop },
-    { "write", SND_PCM_ACCESS_RW_INTERLEAVED, write_from_file },
-    { NULL, SND_PCM_ACCESS_RW_INTERLEAVED, NULL }
-};
-
-int PressKey(int usec)
+/*
+ *   Pick the kernel for the negotiated format, called once after set_hwparams()
+ */
+static void synth_select(void)
 {
-   OnWav=1;usleep(usec);OnWav=0;
-   return 0;
+    static synth_kernel_t const kernels[][3] = {
+        { synth_s16_1, synth_s16_2, synth_s16_n },
+        { synth_s16_swap_1, synth_s16_swap_2, synth_s16_swap_n },
+        { synth_u16_1, synth_u16_2, synth_u16_n },
+        { synth_u16_swap_1, synth_u16_swap_2, synth_u16_swap_n },
+        { synth_s32_1, synth_s32_2, synth_s32_n },
+        { synth_s32_swap_1, synth_s32_swap_2, synth_s32_swap_n },
+        { synth_u32_1, synth_u32_2, synth_u32_n },
+        { synth_u32_swap_1, synth_u32_swap_2, synth_u32_swap_n },
+        { synth_float_1, synth_float_2, synth_float_n },
+        { synth_float_swap_1, synth_float_swap_2, synth_float_swap_n },
+    };
+    int swap, row;
+    sine_table_init();
+    synth_bits = snd_pcm_format_width(format);
+    synth_phys_bps = snd_pcm_format_physical_width(format) / 8;
+    synth_big_endian = snd_pcm_format_big_endian(format) == 1;
+    synth_unsigned = snd_pcm_format_unsigned(format) == 1;
+    synth_float = (format == SND_PCM_FORMAT_FLOAT_LE ||
+            format == SND_PCM_FORMAT_FLOAT_BE);
+    frame_bytes = synth_phys_bps * channels;
+    swap = synth_big_endian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+    if (synth_float)
+        row = 8;
+    else if (synth_bits == 16 && synth_phys_bps == 2)
+        row = synth_unsigned ? 2 : 0;
+    else if (synth_bits == 32 && synth_phys_bps == 4)
+        row = synth_unsigned ? 6 : 4;
+    else {
+        synth_kernel = synth_generic;
+        return;
+    }
+    synth_kernel = kernels[row + swap][channels == 1 ? 0 : channels == 2 ? 1 : 2];
 }
 
-void * ReadFile_AK()
-{
-    FILE *fin;
-    char letter;
-    if((fin=fopen(filename,"r"))==NULL){
-        printf("Unable to read file.\n");return 0;
-    }
-    while((letter=fgetc(fin))!=EOF){
-      if(m_Interrupt){break;}
-      switch(letter){
-      case 'A':
-      case 'a':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('A');usleep(usec_BGap);
-        break;
-      case 'B':
-      case 'b':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('B');usleep(usec_BGap);
-        break;
-      case 'C':
-      case 'c':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('C');usleep(usec_BGap);
-        break;
-      case 'D':
-      case 'd':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('D');usleep(usec_BGap);
-        break;
-      case 'E':
-      case 'e':
-        PressKey(usec_DI);
-        putchar('E');usleep(usec_BGap);
-        break;
-      case 'F':
-      case 'f':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('F');usleep(usec_BGap);
-        break;
-      case 'G':
-      case 'g':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('G');usleep(usec_BGap);
-        break;
-      case 'H':
-      case 'h':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('H');usleep(usec_BGap);
-        break;
-      case 'I':
-      case 'i':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('I');usleep(usec_BGap);
-        break;
-      case 'J':
-      case 'j':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('J');usleep(usec_BGap);
-        break;
-      case 'K':
-      case 'k':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('K');usleep(usec_BGap);
-        break;
-      case 'L':
-      case 'l':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('L');usleep(usec_BGap);
-        break;
-      case 'M':
-      case 'm':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('M');usleep(usec_BGap);
-        break;
-      case 'N':
-      case 'n':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('N');usleep(usec_BGap);
-        break;
-      case 'O':
-      case 'o':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('O');usleep(usec_BGap);
-        break;
-      case 'P':
-      case 'p':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('P');usleep(usec_BGap);
-        break;
-      case 'Q':
-      case 'q':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('Q');usleep(usec_BGap);
-        break;
-      case 'R':
-      case 'r':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('R');usleep(usec_BGap);
-        break;
-      case 'S':
-      case 's':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('S');usleep(usec_BGap);
-        break;
-      case 'T':
-      case 't':
-        PressKey(usec_DA);
-        putchar('T');usleep(usec_BGap);
-        break;
-      case 'U':
-      case 'u':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('U');usleep(usec_BGap);
-        break;
-      case 'V':
-      case 'v':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('V');usleep(usec_BGap);
-        break;
-      case 'W':
-      case 'w':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('W');usleep(usec_BGap);
-        break;
-      case 'X':
-      case 'x':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('X');usleep(usec_BGap);
-        break;
-      case 'Y':
-      case 'y':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar('Y');usleep(usec_BGap);
-        break;
-      case 'Z':
-      case 'z':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar('Z');usleep(usec_BGap);
-        break;
-      case '0':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '1':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '2':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '3':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '4':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '5':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '6':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '7':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '8':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '9':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case '/':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);
-        putchar(letter);usleep(usec_BGap);
-        break;
-      case ',':
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);
-        PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);
-        putchar(letter);usleep(usec_BGap);
+/*
+ *   Fill count interleaved frames of the tone at dst
+ */
+static void synth_tone(struct nco *osc, unsigned char *dst, int count)
+{
+    float buf[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    while (count > 0) {
+        int n = count < SYNTH_BLOCK ? count : SYNTH_BLOCK;
+        nco_render(osc, buf, n);
+        synth_kernel(buf, dst, n);
+        dst += n * frame_bytes;
+        count -= n;
+    }
+}
+
+/*
+ *   Fill count interleaved frames of the tone starting at offset
+ */
+static void generate_sine(const snd_pcm_channel_area_t *areas,
+              snd_pcm_uframes_t offset,
+              int count, struct nco *osc)
+{
+    synth_tone(osc, ((unsigned char *)areas[0].addr) + (areas[0].first / 8) + offset * frame_bytes, count);
+}
+
+/*
+ *   Metrics (--stats, --metrics)
+ *
+ *   A thread that takes part counts into a slot of its own with plain
+ *   increments through stats_self, so the hot paths pay neither atomics
+ *   nor shared cache lines, and nothing at all while metrics are off.
+ *   Readers take the counters as they are, a count behind at worst.
+ *   Times go into histograms of log2 microseconds: how long a period
+ *   took to go out, and how far each keyed mark was from the element the
+ *   decoder expected (its learned centre with --adaptive, else -w). A run
+ *   of the same thread name adds to the slot of the one before.
+ */
+#define STATS_SLOTS 16
+#define STATS_BUCKETS 20            /* under 1, 2, 4 ... 2^18 usec, and the rest */
+#define STATS_REFRESH_MS 1000       /* --metrics file rewritten this often */
+
+enum { HIST_PERIOD, HIST_ELEMENT, HIST_COUNT };
+
+struct stats_slot {
+    const char *name;
+    int live;
+    clockid_t cpu_clock;
+    double cpu, cpu_base;   /* CPU of earlier runs, the clock as this one began */
+    uint64_t periods, xruns, suspends;
+    uint64_t spans, chars, dropped;
+    unsigned int key_depth, timeline_depth;     /* most queued */
+    uint64_t hist[HIST_COUNT][STATS_BUCKETS];
+    uint64_t hist_sum[HIST_COUNT];              /* usec */
+} __attribute__ ((aligned (64)));
+
+static struct stats_slot stats_slot[STATS_SLOTS];
+static int stats_slots;
+static __thread struct stats_slot *stats_self;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stats_summary = 0;       /* --stats */
+static const char *stats_path = NULL;   /* --metrics */
+static double stats_t0;
+static volatile int stats_quit;
+static pthread_t stats_pid;
+
+#define STATS_ADD(field, n) do { if (stats_self) stats_self->field += (n); } while (0)
+#define STATS_MAX(field, v) do { if (stats_self && (v) > stats_self->field) stats_self->field = (v); } while (0)
+
+static int64_t stats_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void stats_hist(int h, int64_t usec)
+{
+    int b;
+    if (!stats_self)
+        return;
+    usec = usec < 0 ? -usec : usec;
+    b = usec ? 64 - __builtin_clzll(usec) : 0;
+    stats_self->hist[h][b < STATS_BUCKETS ? b : STATS_BUCKETS - 1]++;
+    stats_self->hist_sum[h] += usec;
+}
+
+static double stats_clock(clockid_t clk)
+{
+    struct timespec ts;
+    if (clock_gettime(clk, &ts) < 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* count the calling thread as [name] until stats_leave() */
+static void stats_enter(const char *name)
+{
+    struct stats_slot *s = NULL;
+    int i;
+    if (!stats_summary && !stats_path)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < stats_slots && !s; i++) {
+        if (!stats_slot[i].live && !strcmp(stats_slot[i].name, name))
+            s = &stats_slot[i];
+    }
+    if (!s && stats_slots < STATS_SLOTS) {
+        s = &stats_slot[stats_slots++];
+        s->name = name;
+    }
+    if (s && pthread_getcpuclockid(pthread_self(), &s->cpu_clock) == 0) {
+        s->cpu_base = stats_clock(s->cpu_clock);
+        s->live = 1;
+        stats_self = s;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_leave(void)
+{
+    if (!stats_self)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    stats_self->cpu += stats_clock(stats_self->cpu_clock) - stats_self->cpu_base;
+    stats_self->live = 0;
+    pthread_mutex_unlock(&stats_lock);
+    stats_self = NULL;
+}
+
+/* CPU seconds of a slot so far, with stats_lock held */
+static double stats_cpu(const struct stats_slot *s)
+{
+    return s->cpu + (s->live ? stats_clock(s->cpu_clock) - s->cpu_base : 0);
+}
+
+/* upper bound of the bucket holding quantile q, usec; -1 past the last bound, 0 if empty */
+static int64_t stats_quantile(const uint64_t *hist, double q)
+{
+    uint64_t total = 0, run = 0;
+    int b;
+    for (b = 0; b < STATS_BUCKETS; b++)
+        total += hist[b];
+    if (!total)
+        return 0;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        run += hist[b];
+        if (run >= q * total)
+            break;
+    }
+    return b < STATS_BUCKETS - 1 ? 1LL << b : -1;
+}
+
+static const char *stats_bound(char *buf, int64_t usec)
+{
+    if (usec < 0)
+        sprintf(buf, "> %.0f ms", (double)(1 << (STATS_BUCKETS - 2)) / 1000);
+    else if (usec < 1000)
+        sprintf(buf, "< %d us", (int)usec);
+    else
+        sprintf(buf, "< %.1f ms", usec / 1000.0);
+    return buf;
+}
+
+static void stats_counter(FILE *f, const char *name, const char *help, size_t offset)
+{
+    int i;
+    fprintf(f, "# HELP linuxcw_%s %s\n# TYPE linuxcw_%s counter\n", name, help, name);
+    for (i = 0; i < stats_slots; i++)
+        fprintf(f, "linuxcw_%s{thread=\"%s\"} %llu\n", name, stats_slot[i].name,
+            (unsigned long long)*(uint64_t *)((char *)&stats_slot[i] + offset));
+}
+
+static void stats_histogram(FILE *f, const char *name, const char *help, int h)
+{
+    uint64_t run;
+    int i, b;
+    fprintf(f, "# HELP linuxcw_%s %s\n# TYPE linuxcw_%s histogram\n", name, help, name);
+    for (i = 0; i < stats_slots; i++) {
+        for (b = run = 0; b < STATS_BUCKETS; b++) {
+            run += stats_slot[i].hist[h][b];
+            if (b < STATS_BUCKETS - 1)
+                fprintf(f, "linuxcw_%s_bucket{thread=\"%s\",le=\"%g\"} %llu\n", name, stats_slot[i].name,
+                    (double)(1 << b) * 1e-6, (unsigned long long)run);
+        }
+        fprintf(f, "linuxcw_%s_bucket{thread=\"%s\",le=\"+Inf\"} %llu\n", name, stats_slot[i].name, (unsigned long long)run);
+        fprintf(f, "linuxcw_%s_sum{thread=\"%s\"} %g\n", name, stats_slot[i].name, stats_slot[i].hist_sum[h] * 1e-6);
+        fprintf(f, "linuxcw_%s_count{thread=\"%s\"} %llu\n", name, stats_slot[i].name, (unsigned long long)run);
+    }
+}
+
+/* the metrics in Prometheus text format, replacing path in one rename */
+static int stats_write(const char *path)
+{
+    char tmp[4096];
+    FILE *f;
+    int i;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((f = fopen(tmp, "w")) == NULL)
+        return -1;
+    pthread_mutex_lock(&stats_lock);
+    fprintf(f, "# HELP linuxcw_uptime_seconds Time since the metrics started.\n# TYPE linuxcw_uptime_seconds gauge\n");
+    fprintf(f, "linuxcw_uptime_seconds %.3f\n", mono_time() - stats_t0);
+    fprintf(f, "# HELP linuxcw_thread_cpu_seconds_total CPU time of each thread.\n# TYPE linuxcw_thread_cpu_seconds_total counter\n");
+    for (i = 0; i < stats_slots; i++)
+        fprintf(f, "linuxcw_thread_cpu_seconds_total{thread=\"%s\"} %.6f\n", stats_slot[i].name, stats_cpu(&stats_slot[i]));
+    stats_counter(f, "periods_total", "Periods played.", offsetof(struct stats_slot, periods));
+    stats_counter(f, "xruns_total", "Playback underruns.", offsetof(struct stats_slot, xruns));
+    stats_counter(f, "suspends_total", "Playback suspends.", offsetof(struct stats_slot, suspends));
+    stats_counter(f, "key_spans_total", "Mark and space spans decoded.", offsetof(struct stats_slot, spans));
+    stats_counter(f, "decoded_chars_total", "Characters decoded.", offsetof(struct stats_slot, chars));
+    stats_counter(f, "key_events_dropped_total", "Key spans lost to a full ring.", offsetof(struct stats_slot, dropped));
+    fprintf(f, "# HELP linuxcw_queue_depth_max Most entries queued.\n# TYPE linuxcw_queue_depth_max gauge\n");
+    for (i = 0; i < stats_slots; i++) {
+        fprintf(f, "linuxcw_queue_depth_max{thread=\"%s\",queue=\"key_ring\"} %u\n", stats_slot[i].name, stats_slot[i].key_depth);
+        fprintf(f, "linuxcw_queue_depth_max{thread=\"%s\",queue=\"timeline\"} %u\n", stats_slot[i].name, stats_slot[i].timeline_depth);
+    }
+    stats_histogram(f, "period_seconds", "Time to render and queue one period.", HIST_PERIOD);
+    stats_histogram(f, "element_error_seconds", "Keyed mark against the expected element.", HIST_ELEMENT);
+    pthread_mutex_unlock(&stats_lock);
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void stats_report(void)
+{
+    const struct stats_slot *s;
+    double t = mono_time() - stats_t0;
+    char p50[32], p99[32];
+    int i;
+    printf("\n[-] Statistics over %.1f s:\n", t);
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < stats_slots; i++) {
+        s = &stats_slot[i];
+        printf("    %-8s %.2f s CPU", s->name, stats_cpu(s));
+        if (s->periods)
+            printf(", %llu periods, p50 %s, p99 %s", (unsigned long long)s->periods,
+                   stats_bound(p50, stats_quantile(s->hist[HIST_PERIOD], 0.5)),
+                   stats_bound(p99, stats_quantile(s->hist[HIST_PERIOD], 0.99)));
+        if (s->xruns || s->suspends)
+            printf(", %llu xruns, %llu suspends", (unsigned long long)s->xruns, (unsigned long long)s->suspends);
+        if (s->spans)
+            printf(", %llu spans (%.1f/s), %llu characters", (unsigned long long)s->spans, s->spans / t,
+                   (unsigned long long)s->chars);
+        if (s->hist_sum[HIST_ELEMENT])
+            printf(", element error p50 %s, p99 %s",
+                   stats_bound(p50, stats_quantile(s->hist[HIST_ELEMENT], 0.5)),
+                   stats_bound(p99, stats_quantile(s->hist[HIST_ELEMENT], 0.99)));
+        if (s->key_depth || s->timeline_depth)
+            printf(", queued up to %u", s->key_depth > s->timeline_depth ? s->key_depth : s->timeline_depth);
+        if (s->dropped)
+            printf(", %llu dropped", (unsigned long long)s->dropped);
+        printf(".\n");
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void *stats_daemon(void *arg)
+{
+    int ms;
+    while (!stats_quit) {
+        if (stats_write(stats_path) < 0) {
+            printf("[!] Unable to write metrics to %s: %s\n", stats_path, strerror(errno));
+            break;
+        }
+        for (ms = 0; ms < STATS_REFRESH_MS && !stats_quit; ms += 100)
+            usleep(100000);
+    }
+    return 0;
+}
+
+static void stats_finish(void)
+{
+    stats_quit = 1;
+    if (stats_path) {
+        pthread_join(stats_pid, NULL);
+        stats_write(stats_path);
+    }
+    if (stats_summary)
+        stats_report();
+}
+
+static void stats_start(void)
+{
+    stats_t0 = mono_time();
+    if (stats_path && pthread_create(&stats_pid, NULL, stats_daemon, NULL) != 0) {
+        printf("[!] Fail to create metrics thread.\n");
+        stats_path = NULL;
+    }
+    atexit(stats_finish);
+}
+
+/*
+ *   Live settings - speed, spacing, tone and volume changed mid-session
+ *
+ *   The hotkeys and --control only write live_conf, one at a time under
+ *   live_lock, with live_seq odd while they do.  The audio thread copies
+ *   it with live_poll() when live_seq moved, and simply tries again a
+ *   period later if it caught a write half way, so it never waits on the
+ *   writer.  Anything that costs time or memory, like rendering the
+ *   element cache at the new speed, is done by the writer beforehand.
+ */
+struct live_conf {
+    int wpm;
+    int spacing;            /* word gaps at this speed (-s), 0 at wpm */
+    int volume;             /* percent */
+    double freq;
+};
+
+static struct live_conf live_conf = { 15, 0, 100, 750 };
+static unsigned int live_seq;
+
+/* copy live_conf to conf if it changed since *seen, 1 if it did */
+static int live_poll(unsigned int *seen, struct live_conf *conf)
+{
+    unsigned int seq = __atomic_load_n(&live_seq, __ATOMIC_ACQUIRE);
+    if (seq == *seen || seq & 1)
+        return 0;
+    *conf = live_conf;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&live_seq, __ATOMIC_RELAXED) != seq)
+        return 0;
+    *seen = seq;
+    return 1;
+}
+
+/*
+ *   Element cache - dit, dah and gaps pre-rendered as PCM
+ *
+ *   Marks get a raised-cosine rise and fall of RAMP_USEC so the keying
+ *   is click free.  The cache is keyed on the element lengths (-w, -s),
+ *   freq, volume, rate and format, and only rebuilt when one of them
+ *   changes.
+ */
+#define RAMP_USEC 5000
+
+enum { ELEM_DIT, ELEM_DAH, ELEM_SGAP, ELEM_BGAP, ELEM_COUNT };
+
+struct elem_cache {
+    int usec[ELEM_COUNT];
+    double freq;
+    int volume;             /* percent */
+    unsigned int rate;
+    unsigned int channels;
+    snd_pcm_format_t format;
+    unsigned char *pcm[ELEM_COUNT];
+    snd_pcm_uframes_t frames[ELEM_COUNT];
+};
+static struct elem_cache elem_cache;
+/*
+ * The live player starts each element from elem_live, which a settings
+ * change replaces with a cache of its own.  elem_playing[] are the
+ * player's hazard pointers: the cache of the element it is in and the
+ * one it is taking up, which the writer must not free.
+ */
+static struct elem_cache *elem_live = &elem_cache;
+static const struct elem_cache *elem_playing[2];
+
+static int elem_render(struct elem_cache *cache, int elem)
+{
+    float buf[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    snd_pcm_uframes_t frames = (unsigned long long)cache->usec[elem] * cache->rate / 1000000;
+    snd_pcm_uframes_t ramp = (unsigned long long)RAMP_USEC * cache->rate / 1000000, i;
+    float gain = cache->volume / 100.0f;
+    struct nco osc = { 0, 0 };
+    unsigned char *dst;
+    int n, k;
+    free(cache->pcm[elem]);
+    if ((cache->pcm[elem] = malloc(frames * frame_bytes + 1)) == NULL)
+        return -1;
+    cache->frames[elem] = frames;
+    if (elem == ELEM_SGAP || elem == ELEM_BGAP) {
+        snd_pcm_format_set_silence(format, cache->pcm[elem], frames * channels);
+        return 0;
+    }
+    ramp = ramp > frames / 2 ? frames / 2 : ramp;
+    nco_set_freq(&osc, cache->freq, cache->rate);
+    osc.phase = osc.step / 2;   /* no zero sample at either end of the mark */
+    for (i = 0, dst = cache->pcm[elem]; i < frames; i += n, dst += n * frame_bytes) {
+        n = frames - i < SYNTH_BLOCK ? frames - i : SYNTH_BLOCK;
+        nco_render(&osc, buf, n);
+        for (k = 0; k < n; k++) {
+            snd_pcm_uframes_t edge = i + k < frames - 1 - (i + k) ? i + k : frames - 1 - (i + k);
+            if (edge < ramp)
+                buf[k] *= gain * (0.5 - 0.5 * cos(M_PI * (edge + 0.5) / ramp));
+            else
+                buf[k] *= gain;
+        }
+        synth_kernel(buf, dst, n);
+    }
+    return 0;
+}
+
+/* bring the cache in line with the current settings, 0 if nothing to do */
+static int elem_cache_update(struct elem_cache *cache)
+{
+    int usec[ELEM_COUNT] = { usec_DI, usec_DA, usec_SGap, usec_BGap };
+    int elem, changed;
+    changed = cache->freq != freq || cache->volume != live_conf.volume || cache->rate != rate ||
+            cache->format != format || cache->channels != channels;
+    for (elem = 0; elem < ELEM_COUNT; elem++) {
+        if (!changed && cache->usec[elem] == usec[elem] && cache->pcm[elem])
+            continue;
+        cache->usec[elem] = usec[elem];
+        cache->freq = freq;
+        cache->volume = live_conf.volume;
+        cache->rate = rate;
+        cache->format = format;
+        cache->channels = channels;
+        if (elem_render(cache, elem) < 0) {
+            printf("[!] No enough memory. Error code: elem_cache\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *   Timeline - keyed text as a queue of elements measured in sample frames
+ *
+ *   ReadFile_AK() is the only producer and the audio thread the only
+ *   consumer, so head and tail each have a single writer.  Element
+ *   lengths come from the cache, i.e. the -w/-s settings rounded to
+ *   whole frames, and the audio thread plays them back to back.  The
+ *   player measures each element in the cache it is given as the
+ *   element starts, so queued text follows a change of speed.
+ */
+#define TIMELINE_SIZE 256   /* events, power of two */
+
+struct cw_event {
+    unsigned int frames;
+    unsigned char elem;
+    char echo[11];          /* printed when the event starts, or empty */
+};
+
+struct timeline {
+    struct cw_event ev[TIMELINE_SIZE];
+    unsigned int head, tail;
+    volatile int done;      /* producer reached the end of its text */
+};
+static struct timeline timeline;
+
+struct player {
+    struct cw_event cur;
+    snd_pcm_uframes_t pos;  /* frames of cur already rendered */
+    int echo;
+    const struct elem_cache *cache;     /* cur is played from this one */
+    uint64_t clock;         /* frames rendered since the player started */
+};
+
+static void timeline_reset(struct timeline *tl)
+{
+    tl->head = tl->tail = 0;
+    tl->done = 0;
+}
+
+static int timeline_count(struct timeline *tl)
+{
+    return __atomic_load_n(&tl->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tl->tail, __ATOMIC_ACQUIRE);
+}
+
+/* queue one element, waits while the timeline is full, -1 if interrupted */
+static int timeline_push(struct timeline *tl, int elem, const char *echo)
+{
+    struct cw_event *ev;
+    while (timeline_count(tl) == TIMELINE_SIZE) {
+        if (m_Interrupt)
+            return -1;
+        usleep(period_time);
+    }
+    ev = &tl->ev[tl->head % TIMELINE_SIZE];
+    ev->frames = elem_cache.frames[elem];
+    ev->elem = elem;
+    ev->echo[0] = 0;
+    if (echo)
+        strncat(ev->echo, echo, sizeof(ev->echo) - 1);
+    __atomic_store_n(&tl->head, tl->head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int timeline_pop(struct timeline *tl, struct cw_event *ev)
+{
+    unsigned int queued = __atomic_load_n(&tl->head, __ATOMIC_ACQUIRE) - tl->tail;
+    if (queued == 0)
+        return -1;
+    STATS_MAX(timeline_depth, queued);
+    *ev = tl->ev[tl->tail % TIMELINE_SIZE];
+    __atomic_store_n(&tl->tail, tl->tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* frames left to play, counting the rest of the player's current event */
+static snd_pcm_uframes_t timeline_frames(struct timeline *tl, struct player *pl)
+{
+    snd_pcm_uframes_t frames = pl->cur.frames - pl->pos;
+    unsigned int i;
+    for (i = tl->tail; i != __atomic_load_n(&tl->head, __ATOMIC_ACQUIRE); i++)
+        frames += tl->ev[i % TIMELINE_SIZE].frames;
+    return frames;
+}
+
+/*
+ *   Echo - the played text shown as it leaves the speaker
+ *
+ *   The player queues each echo with the frame it starts on, and the
+ *   audio thread lets out everything the device has played by then,
+ *   rendered frames less snd_pcm_delay(), once a period.  It only moves
+ *   the text into echo_ring: EchoDaemon() does the writing, so a slow
+ *   terminal or pipe never holds up the sound.  --echo hide keeps the
+ *   text back until the end for copy practice, in a buffer allocated
+ *   before playback and grown by EchoDaemon(); --echo SECONDS shows it
+ *   that far behind the sound.  A queue full of echoes lets the oldest
+ *   out early, and only drops one when EchoDaemon() is that far behind.
+ */
+#define ECHO_QUEUE 1024     /* echoes, power of two */
+#define ECHO_RING 65536     /* bytes of released text, power of two */
+#define ECHO_HIDDEN 65536   /* bytes of hidden text before EchoDaemon grows it */
+#define ECHO_HIDE -1.0      /* echo_lag: all at the end */
+
+struct echo_queue {
+    struct {
+        uint64_t at;        /* player clock the echo is due at */
+        char text[11];
+    } ev[ECHO_QUEUE];
+    unsigned int head, tail;
+    unsigned int dropped;   /* echoes EchoDaemon() had no room for */
+};
+
+/* text from the audio thread to EchoDaemon() */
+struct echo_ring {
+    char buf[ECHO_RING];
+    unsigned int head, tail;
+    int eof;                /* playback is over, head is final */
+};
+static struct echo_queue echo_queue;
+static struct echo_ring echo_ring;
+static double echo_lag = 0;     /* --echo, seconds behind the sound */
+static char *echo_hidden = NULL;    /* --echo hide: the text kept back */
+static size_t echo_hidden_len = 0, echo_hidden_size = 0;
+
+static void echo_wake(void)
+{
+    uint64_t one = 1;
+    if (echo_wake_fd >= 0 && write(echo_wake_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+/* move the echoes due at clock played to echo_ring while it has room, 1 if any went */
+static int echo_release(struct echo_queue *q, uint64_t played)
+{
+    struct echo_ring *r = &echo_ring;
+    unsigned int head = r->head, start = head, room, i;
+    size_t len;
+    room = ECHO_RING - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    while (q->tail != q->head && q->ev[q->tail % ECHO_QUEUE].at <= played) {
+        len = strlen(q->ev[q->tail % ECHO_QUEUE].text);
+        if (len > room)
+            break;      /* EchoDaemon is behind, the rest waits for the next period */
+        for (i = 0; i < len; i++)
+            r->buf[(head + i) % ECHO_RING] = q->ev[q->tail % ECHO_QUEUE].text[i];
+        head += len;
+        room -= len;
+        q->tail++;
+    }
+    if (head == start)
+        return 0;
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    echo_wake();
+    return 1;
+}
+
+static void echo_put(struct echo_queue *q, uint64_t at, const char *text)
+{
+    if (q->head - q->tail == ECHO_QUEUE) {
+        echo_release(q, q->ev[q->tail % ECHO_QUEUE].at);
+        if (q->head - q->tail == ECHO_QUEUE) {
+            q->tail++;
+            q->dropped++;
+        }
+    }
+    q->ev[q->head % ECHO_QUEUE].at = at + (uint64_t)(echo_lag > 0 ? echo_lag * rate : 0);
+    strcpy(q->ev[q->head % ECHO_QUEUE].text, text);
+    q->head++;
+}
+
+/* let out what the device has played, 1 while echoes are still due */
+static int echo_sync(struct echo_queue *q, snd_pcm_t *handle, uint64_t clock)
+{
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(handle, &delay) < 0 || delay < 0)
+        delay = 0;      /* stopped or in an xrun: nothing is queued */
+    echo_release(q, clock - ((uint64_t)delay < clock ? (uint64_t)delay : clock));
+    return q->tail != q->head;
+}
+
+/* playback is over: hand EchoDaemon the rest, waiting for room if it must */
+static void echo_finish(struct echo_queue *q)
+{
+    while (q->tail != q->head)
+        if (!echo_release(q, ~0ULL))
+            usleep(period_time);
+    __atomic_store_n(&echo_ring.eof, 1, __ATOMIC_RELEASE);
+    echo_wake();
+}
+
+/* write or, with --echo hide, keep back len bytes of echo */
+static void echo_out(const char *text, size_t len)
+{
+    char *grown;
+    if (echo_lag < 0 && echo_hidden) {
+        if (echo_hidden_len + len > echo_hidden_size) {
+            if ((grown = realloc(echo_hidden, echo_hidden_size * 2 + len)) == NULL) {
+                printf("[!] No enough memory. Error code: echo, the text is shown from here on\n");
+                fwrite(echo_hidden, 1, echo_hidden_len, stdout);
+                free(echo_hidden);
+                echo_hidden = NULL;
+                echo_hidden_len = echo_hidden_size = 0;
+                fwrite(text, 1, len, stdout);
+                return;
+            }
+            echo_hidden = grown;
+            echo_hidden_size = echo_hidden_size * 2 + len;
+        }
+        memcpy(echo_hidden + echo_hidden_len, text, len);
+        echo_hidden_len += len;
+        return;
+    }
+    fwrite(text, 1, len, stdout);
+}
+
+/* the writer of the echoes, until the audio thread ends them */
+void * EchoDaemon()
+{
+    struct echo_ring *r = &echo_ring;
+    struct pollfd pfd = { echo_wake_fd, POLLIN, 0 };
+    unsigned int tail, head, n;
+    uint64_t wakes;
+    int eof;
+    for (;;) {
+        eof = __atomic_load_n(&r->eof, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (tail = r->tail; tail != head; tail += n) {
+            n = ECHO_RING - tail % ECHO_RING;
+            n = head - tail < n ? head - tail : n;
+            echo_out(r->buf + tail % ECHO_RING, n);
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        if (eof)
+            break;
+        if (echo_wake_fd < 0)
+            usleep(period_time);
+        else if (poll(&pfd, 1, -1) > 0 && read(echo_wake_fd, &wakes, sizeof(wakes)) < 0)
+            continue;
+    }
+    if (echo_hidden_len)
+        fwrite(echo_hidden, 1, echo_hidden_len, stdout);
+    echo_hidden_len = 0;
+    if (echo_queue.dropped)
+        printf("\n[!] %u echoes dropped, the terminal was not keeping up.\n", echo_queue.dropped);
+    return 0;
+}
+
+/* render frames of the timeline into dst, 1 once it is done and fully played */
+static int player_fill(struct player *pl, struct timeline *tl,
+               const struct elem_cache *cache, unsigned char *dst,
+               snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t n;
+    while (frames > 0) {
+        if (pl->pos == pl->cur.frames) {
+            int done = tl->done;
+            if (timeline_pop(tl, &pl->cur) < 0) {
+                /* producer is late or finished: pad with silence */
+                snd_pcm_format_set_silence(format, dst, frames * channels);
+                pl->clock += frames;
+                return done;
+            }
+            pl->pos = 0;
+            pl->cache = cache;
+            pl->cur.frames = cache->frames[pl->cur.elem];
+            if (pl->echo && pl->cur.echo[0])
+                echo_put(&echo_queue, pl->clock, pl->cur.echo);
+        }
+        n = pl->cur.frames - pl->pos;
+        n = n < frames ? n : frames;
+        memcpy(dst, pl->cache->pcm[pl->cur.elem] + pl->pos * frame_bytes, n * frame_bytes);
+        pl->pos += n;
+        pl->clock += n;
+        dst += n * frame_bytes;
+        frames -= n;
+    }
+    return 0;
+}
+
+static int set_hwparams(snd_pcm_t *handle,
+            snd_pcm_hw_params_t *params,
+            snd_pcm_access_t access)
+{
+    unsigned int rrate;
+    snd_pcm_uframes_t size;
+    int err, dir;
+    /* choose all parameters */
+    if ((err = snd_pcm_hw_params_any(handle, params)) < 0) {
+        printf("[!] Broken configuration for playback: no configurations available: %s\n", snd_strerror(err));
+        return err;
+    }
+    /* set hardware resampling */
+    if ((err = snd_pcm_hw_params_set_rate_resample(handle, params, resample)) < 0) {
+        printf("[!] Resampling setup failed for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    /* set the interleaved read/write format */
+    if ((err = snd_pcm_hw_params_set_access(handle, params, access)) < 0) {
+        printf("[!] Access type not available for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    /* set the sample format */
+    if ((err = snd_pcm_hw_params_set_format(handle, params, format)) < 0) {
+        printf("[!] Sample format not available for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    /* set the count of channels */
+    if ((err = snd_pcm_hw_params_set_channels(handle, params, channels)) < 0) {
+        printf("[!] Channels count (%u) not available for playbacks: %s\n", channels, snd_strerror(err));
+        return err;
+    }
+    /* set the stream rate */
+    rrate = rate;
+    if ((err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0)) < 0) {
+        printf("[!] Rate %uHz not available for playback: %s\n", rate, snd_strerror(err));
+        return err;
+    }
+    if (rrate != rate) {
+        printf("[!] Rate doesn't match (requested %uHz, get %iHz)\n", rate, err);
+        return -EINVAL;
+    }
+    /* set the buffer time */
+    if ((err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &buffer_time, &dir)) < 0) {
+        printf("[!] Unable to set buffer time %u for playback: %s\n", buffer_time, snd_strerror(err));
+        return err;
+    }
+    if ((err = snd_pcm_hw_params_get_buffer_size(params, &size)) < 0) {
+        printf("[!] Unable to get buffer size for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    buffer_size = size;
+    /* set the period time */
+    if ((err = snd_pcm_hw_params_set_period_time_near(handle, params, &period_time, &dir)) < 0) {
+        printf("[!] Unable to set period time %u for playback: %s\n", period_time, snd_strerror(err));
+        return err;
+    }
+    if ((err = snd_pcm_hw_params_get_period_size(params, &size, &dir)) < 0) {
+        printf("[!] Unable to get period size for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    period_size = size;
+    /* write the parameters to device */
+    if ((err = snd_pcm_hw_params(handle, params)) < 0) {
+        printf("[!] Unable to set hw params for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    return 0;
+}
+static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
+{
+    int err;
+    /* get the current swparams */
+    if ((err = snd_pcm_sw_params_current(handle, swparams)) < 0) {
+        printf("[!] Unable to determine current swparams for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    /* start the transfer when the buffer is almost full: */
+    /* (buffer_size / avail_min) * avail_min */
+    if ((err = snd_pcm_sw_params_set_start_threshold(handle, swparams, (buffer_size / period_size) * period_size)) < 0) {
+        printf("[!] Unable to set start threshold mode for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    /* allow the transfer when at least period_size samples can be processed */
+    /* or disable this mechanism when period event is enabled (aka interrupt like style processing) */
+    if ((err = snd_pcm_sw_params_set_avail_min(handle, swparams, period_event ? buffer_size : period_size)) < 0) {
+        printf("[!] Unable to set avail min for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    /* enable period events when requested */
+    if (period_event) {
+        if ((err = snd_pcm_sw_params_set_period_event(handle, swparams, 1)) < 0) {
+            printf("[!] Unable to set period event: %s\n", snd_strerror(err));
+            return err;
+        }
+    }
+    /* write the parameters to the playback device */
+    if ((err = snd_pcm_sw_params(handle, swparams)) < 0) {
+        printf("[!] Unable to set sw params for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    return 0;
+}
+/*
+ *   Underrun and suspend recovery
+ */
+ 
+static unsigned int xrun_count, suspend_count;  /* playback, since SoundDaemon_mod() opened it */
+
+static int xrun_recovery(snd_pcm_t *handle, int err)
+{
+    if ((err == -EPIPE || err == -ESTRPIPE) && snd_pcm_stream(handle) == SND_PCM_STREAM_PLAYBACK) {
+        __atomic_add_fetch(err == -EPIPE ? &xrun_count : &suspend_count, 1, __ATOMIC_RELAXED);
+        if (stats_self)
+            (*(err == -EPIPE ? &stats_self->xruns : &stats_self->suspends))++;
+    }
+    if (err == -EPIPE) {    /* under-run */
+        err = snd_pcm_prepare(handle);
+        if (err < 0)
+            printf("[!] Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
+        return 0;
+    } else if (err == -ESTRPIPE) {
+        while ((err = snd_pcm_resume(handle)) == -EAGAIN)
+            sleep(1);   /* wait until the suspend flag is released */
+        if (err < 0) {
+            err = snd_pcm_prepare(handle);
+            if (err < 0)
+                printf("[!] Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
+        }
+        return 0;
+    }
+    return err;
+}
+/*
+ *   Write one period to the device, 0 when written or skipped after an xrun
+ */
+static int write_period(snd_pcm_t *handle, unsigned char *ptr)
+{
+    int err, cptr = period_size;
+    while (cptr > 0) {
+        err = snd_pcm_writei(handle, ptr, cptr);
+        if (err == -EAGAIN) {
+            snd_pcm_wait(handle, 1000);
+            continue;
+        }
+        if (err < 0) {
+            if (xrun_recovery(handle, err) < 0) {
+                printf("[!] Write error: %s\n", snd_strerror(err));
+                return -1;
+            }
+            break;  /* skip one period */
+        }
+        ptr += err * frame_bytes;
+        cptr -= err;
+    }
+    return 0;
+}
+/*
+ *   Wake the audio thread out of its idle wait
+ */
+static void key_wake(void)
+{
+    uint64_t one = 1;
+    if (key_wake_fd >= 0 && write(key_wake_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+static void decode_wake(void)
+{
+    uint64_t one = 1;
+    if (decode_wake_fd >= 0 && write(decode_wake_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+/*
+ *   Real-time mode (--rt, --cpu)
+ *
+ *   The audio and key threads move to SCHED_FIFO at priorities of their
+ *   own and, when asked, onto a chosen core; the audio thread locks the
+ *   process in memory before its first period, so a page fault can't
+ *   stall it. Whatever the system refuses is reported and the thread
+ *   carries on as it was.
+ */
+struct rt_conf {
+    const char *name;
+    int prio;               /* SCHED_FIFO priority, 0 for SCHED_OTHER */
+    int cpu;                /* core to pin to, -1 for any */
+};
+
+static struct rt_conf rt_audio = { "Audio", 0, -1 }, rt_key = { "Key", 0, -1 };
+
+/* move the calling thread as rt says */
+static void rt_enter(const struct rt_conf *rt)
+{
+    struct sched_param sp = { rt->prio };
+    struct rlimit rl;
+    cpu_set_t set;
+    char where[32] = "";
+    int err;
+    if (rt->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(rt->cpu, &set);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+            printf("[!] %s thread can't be pinned to CPU %d: %s\n", rt->name, rt->cpu, strerror(err));
+        else
+            sprintf(where, " on CPU %d", rt->cpu);
+    }
+    if (rt->prio <= 0) {
+        if (where[0])
+            printf("[+] %s thread%s.\n", rt->name, where);
+        return;
+    }
+    /* an unprivileged process may raise its soft limit as far as the hard one */
+    if (getrlimit(RLIMIT_RTPRIO, &rl) == 0 && rl.rlim_cur < rt->prio && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max < rt->prio ? rl.rlim_max : rt->prio;
+        setrlimit(RLIMIT_RTPRIO, &rl);
+    }
+    if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)) != 0) {
+        getrlimit(RLIMIT_RTPRIO, &rl);
+        printf("[!] %s thread stays SCHED_OTHER%s: SCHED_FIFO %d refused (%s, RLIMIT_RTPRIO %ld).\n",
+               rt->name, where, rt->prio, strerror(err), rl.rlim_cur == RLIM_INFINITY ? -1L : (long)rl.rlim_cur);
+        printf("    Run as root, or allow rtprio %d in /etc/security/limits.conf.\n", rt->prio);
+        return;
+    }
+    printf("[+] %s thread at SCHED_FIFO %d%s.\n", rt->name, rt->prio, where);
+    if (rt == &rt_audio && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        printf("[!] Unable to lock memory: %s; page faults may still delay the audio.\n", strerror(errno));
+}
+
+/*
+ *   Pile-up simulator
+ *
+ *   pileup_count stations call at once, each keying groups from the
+ *   charset with its own tone, speed, level, timing jitter and start,
+ *   spread around freq.  Stations are mixed a SYNTH_BLOCK at a time and
+ *   one whose key is up for the whole block only advances its phase.
+ *   White Gaussian noise comes from four xoshiro128** streams side by
+ *   side in a vector, through Box-Muller on all four lanes with a log
+ *   and a sine and cosine good to float precision; QSB fades each station on a slow sine of its own,
+ *   QRN adds crashes of noise that decay within tens of milliseconds.
+ *   Live, a station that signs off is replaced by a new caller; offline
+ *   the mix ends when the last one is done.
+ */
+#define PILEUP_MAX 1024
+#define PILEUP_SPREAD 300           /* Hz either side of freq */
+#define PILEUP_RANGE 30             /* dB from the loudest to the weakest */
+#define PILEUP_WPM_LO 16
+#define PILEUP_WPM_HI 36
+
+typedef unsigned int v4su __attribute__ ((vector_size (16)));
+
+struct station {
+    struct nco osc;
+    struct rng r;
+    double hz;
+    double fade, fade_step;     /* QSB phase and step per frame, in cycles */
+    float level, gain;          /* gain at the end of the last block */
+    int wpm, jitter;            /* jitter in percent of each element */
+    unsigned int dit, len, pos; /* frames */
+    int mark, code, bit, sym, groups, done;
+    char *text;
+    size_t tlen;
+};
+
+struct pileup {
+    struct station *st;
+    int count, active, inblock, groups, respawn;
+    FILE *log;                  /* each station's text when it signs off, or NULL */
+    unsigned int rate, serial;
+    int sym[GEN_MAXSYM], code[GEN_MAXSYM], nsym;
+    float ramp[1024];           /* RAMP_USEC at up to 196 kHz */
+    unsigned int ramp_frames;
+    float master, noise, qsb, qrn;
+    v4su ns[4];                 /* noise generator, one stream per lane */
+    v4sf crash;                 /* QRN envelope, four frames apart */
+    float crash_step;           /* its decay over four frames */
+    struct rng r;
+};
+
+static int pileup_count = 0;
+static float pileup_noise = 0, pileup_qsb = 0, pileup_qrn = 0;
+static struct pileup pileup;
+
+static inline double pileup_unit(struct rng *r)
+{
+    return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* code of one charset symbol, 0 if it has none */
+static int pileup_code(const char *text, int len)
+{
+    unsigned int cp = (unsigned char)text[0];
+    char name[8];
+    if (text[0] == '<' && len < (int)sizeof(name)) {
+        memcpy(name, text, len);
+        name[len] = 0;
+        return cw_encode_prosign(name);
+    }
+    if (len == 2)
+        cp = ((cp & 0x1f) << 6) | (text[1] & 0x3f);
+    else if (len == 3)
+        cp = ((cp & 0x0f) << 12) | ((text[1] & 0x3f) << 6) | (text[2] & 0x3f);
+    return cw_encode(cp);
+}
+
+/* a new caller with its own settings, keying after [delay] frames */
+static void station_start(struct pileup *pu, struct station *st, unsigned int delay)
+{
+    rng_seed(&st->r, gen_seed, 0x5000 + pu->serial++);
+    st->hz = freq + (pileup_unit(&st->r) * 2 - 1) * PILEUP_SPREAD;
+    st->hz = st->hz < 200 ? 200 : st->hz;
+    nco_set_freq(&st->osc, st->hz, pu->rate);
+    st->wpm = PILEUP_WPM_LO + rng_next(&st->r) % (PILEUP_WPM_HI - PILEUP_WPM_LO + 1);
+    st->dit = (uint64_t)pu->rate * 1200 / 1000 / st->wpm;
+    st->jitter = rng_next(&st->r) % 11;
+    st->level = pu->master * pow(10, -pileup_unit(&st->r) * PILEUP_RANGE / 20);
+    st->fade = pileup_unit(&st->r);
+    st->fade_step = (0.05 + 0.25 * pileup_unit(&st->r)) / pu->rate;
+    st->gain = st->level * (1 - pu->qsb * (0.5 + 0.5 * sin(2 * M_PI * st->fade)));
+    st->len = delay;
+    st->pos = st->mark = st->sym = st->done = 0;
+    st->bit = -1;
+    st->groups = pu->groups;
+    st->tlen = 0;
+    pu->active++;
+}
+
+static void station_done(struct pileup *pu, struct station *st)
+{
+    st->done = 1;
+    st->len = ~0U;
+    st->pos = 0;
+    pu->active--;
+    st->text[st->tlen] = 0;
+    if (pu->log)
+        fprintf(pu->log, "[+] %4.0f Hz %2d WPM  %s\n", st->hz, st->wpm, st->text);
+    if (pu->respawn)
+        station_start(pu, st, pu->rate / 2 + rng_next(&pu->r) % (pu->rate * 3));
+}
+
+/* move a station on to its next mark or gap */
+static void station_element(struct pileup *pu, struct station *st)
+{
+    int units, k;
+    if (st->mark) {
+        st->mark = 0;
+        units = st->bit >= 0 ? 1 : st->sym < pu->inblock ? 3 : 7;
+        if (units == 7 && --st->groups == 0) {
+            station_done(pu, st);
+            return;
+        }
+    } else {
+        if (st->bit < 0) {
+            if (st->sym == pu->inblock) {
+                st->sym = 0;
+                st->text[st->tlen++] = ' ';
+            }
+            k = pu->sym[(uint32_t)(rng_next(&st->r) >> 32) * (uint64_t)pu->nsym >> 32];
+            memcpy(st->text + st->tlen, gen_charset.sym[k], gen_charset.len[k]);
+            st->tlen += gen_charset.len[k];
+            st->code = pu->code[k];
+            st->bit = 30 - __builtin_clz(st->code);
+            st->sym++;
+        }
+        st->mark = 1;
+        units = (st->code >> st->bit--) & 1 ? 3 : 1;
+    }
+    st->len = st->dit * units;
+    st->len += (int64_t)st->len * st->jitter * ((int)(rng_next(&st->r) >> 48) - 32768) / 3276800;
+    st->pos = 0;
+}
+
+/* add n frames of one station to mix */
+static void station_mix(struct pileup *pu, struct station *st, float *mix, int n)
+{
+    float tone[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    float env[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    unsigned int run, edge, k;
+    int i = 0, keyed = 0;
+    float g0 = st->gain, dg;
+    v4sf g, step, t, e, m;
+    while (i < n) {
+        if (st->pos == st->len)
+            station_element(pu, st);
+        run = st->len - st->pos < (unsigned int)(n - i) ? st->len - st->pos : (unsigned int)(n - i);
+        if (!st->mark)
+            memset(env + i, 0, run * sizeof(float));
+        for (k = 0; st->mark && k < run; k++) {
+            edge = st->pos + k < st->len - 1 - st->pos - k ? st->pos + k : st->len - 1 - st->pos - k;
+            env[i + k] = edge < pu->ramp_frames ? pu->ramp[edge] : 1;
+        }
+        keyed |= st->mark;
+        st->pos += run;
+        i += run;
+    }
+    st->fade += st->fade_step * n;
+    st->fade -= floor(st->fade);
+    st->gain = st->level * (1 - pu->qsb * (0.5 + 0.5 * sin(2 * M_PI * st->fade)));
+    if (!keyed) {
+        st->osc.phase += st->osc.step * n;
+        return;
+    }
+    nco_render(&st->osc, tone, n);
+    for (i = n; i % 4; i++)
+        env[i] = 0;
+    dg = (st->gain - g0) / n;
+    g = (v4sf){ g0, g0 + dg, g0 + 2 * dg, g0 + 3 * dg };
+    step = (v4sf){ 4 * dg, 4 * dg, 4 * dg, 4 * dg };
+    for (i = 0; i < n; i += 4) {
+        memcpy(&t, tone + i, sizeof(t));
+        memcpy(&e, env + i, sizeof(e));
+        memcpy(&m, mix + i, sizeof(m));
+        m += t * e * g;
+        memcpy(mix + i, &m, sizeof(m));
+        g += step;
+    }
+}
+
+/* xoshiro128** on four lanes */
+static inline v4su pileup_next(v4su *s)
+{
+    v4su t = s[1] * 5, result = ((t << 7) | (t >> 25)) * 9;
+    t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 11) | (s[3] >> 21);
+    return result;
+}
+
+/* natural log of x in (0, 1]: x = 2^e * m with m in [sqrt(1/2), sqrt(2)), ln m by atanh */
+static inline v4sf pileup_log(v4sf x)
+{
+    const v4sf one = { 1, 1, 1, 1 };
+    v4si bits = (v4si)x, e = ((bits >> 23) & 0xff) - 127, big;
+    v4sf m = (v4sf)((bits & 0x7fffff) | 0x3f800000), t, t2;
+    big = m > (v4sf){ 1.41421356f, 1.41421356f, 1.41421356f, 1.41421356f };
+    m = (v4sf)(((v4si)(m * 0.5f) & big) | ((v4si)m & ~big));
+    e -= big;
+    t = (m - one) / (m + one);
+    t2 = t * t;
+    return __builtin_convertvector(e, v4sf) * 0.69314718f +
+           2.0f * t * (one + t2 * (1.0f / 3 + t2 * (1.0f / 5 + t2 * (1.0f / 7 + t2 * (1.0f / 9)))));
+}
+
+/* eight Gaussian samples of unit variance by Box-Muller, a radius from a and an angle from b */
+static inline void pileup_gauss(v4su *s, v4sf *z)
+{
+    const v4si sign = { (int)0x80000000, (int)0x80000000, (int)0x80000000, (int)0x80000000 };
+    v4su a = pileup_next(s), b = pileup_next(s);
+    v4si q = (v4si)(b >> 30), swap = (q & 1) != 0, flip = ((q & 2) != 0) & sign;
+    v4sf u = __builtin_convertvector((v4si)(a >> 8) + 1, v4sf) * (1.0f / 16777216.0f);    /* (0, 1] */
+    v4sf x = (__builtin_convertvector((v4si)((b >> 6) & 0xffffff), v4sf) * (1.0f / 16777216.0f) - 0.5f) * 1.57079633f;
+    v4sf x2 = x * x, sn, cs, c, r2 = -2.0f * pileup_log(u), r;
+    int k;
+    /* the angle is a quarter turn q plus pi/4 + x, x within pi/4 either side */
+    sn = x * (1.0f + x2 * (-1.0f / 6 + x2 * (1.0f / 120 + x2 * (-1.0f / 5040))));
+    cs = 1.0f + x2 * (-0.5f + x2 * (1.0f / 24 + x2 * (-1.0f / 720 + x2 * (1.0f / 40320))));
+    c = (v4sf)(((v4si)-sn & swap) | ((v4si)cs & ~swap));
+    sn = (v4sf)(((v4si)cs & swap) | ((v4si)sn & ~swap));
+    for (k = 0; k < 4; k++)
+        r[k] = sqrtf(r2[k]);
+    z[0] = r * (v4sf)((v4si)c ^ flip);
+    z[1] = r * (v4sf)((v4si)sn ^ flip);
+}
+
+/* band noise and QRN crashes added to n frames */
+static void pileup_noise_mix(struct pileup *pu, float *mix, int n)
+{
+    v4sf level = { pu->noise, pu->noise, pu->noise, pu->noise }, step, m, z[2];
+    int i;
+    if (pu->qrn > 0 && pileup_unit(&pu->r) < (double)pu->qrn * n / pu->rate) {
+        /* a crash of 10 to 80 ms, the last one's tail decays with it */
+        float amp = 0.2 + 0.8 * pileup_unit(&pu->r);
+        float d = exp(-1.0 / (pu->rate * (0.01 + 0.07 * pileup_unit(&pu->r))));
+        pu->crash_step = d * d * d * d;
+        pu->crash = pu->crash[0] * (v4sf){ 1, d, d * d, d * d * d } + amp * (v4sf){ 1, d, d * d, d * d * d };
+    }
+    if (pu->noise <= 0 && pu->crash[0] < 1e-4f)
+        return;
+    step = (v4sf){ pu->crash_step, pu->crash_step, pu->crash_step, pu->crash_step };
+    for (i = 0; i < n; i += 8) {
+        pileup_gauss(pu->ns, z);
+        memcpy(&m, mix + i, sizeof(m));
+        m += z[0] * (level + pu->crash);
+        memcpy(mix + i, &m, sizeof(m));
+        pu->crash *= step;
+        if (i + 4 >= n)
+            break;
+        memcpy(&m, mix + i + 4, sizeof(m));
+        m += z[1] * (level + pu->crash);
+        memcpy(mix + i + 4, &m, sizeof(m));
+        pu->crash *= step;
+    }
+}
+
+/* render n <= SYNTH_BLOCK frames of the band, returns the stations still keying */
+static int pileup_render(struct pileup *pu, float *out, int n)
+{
+    const v4sf hi = { 1, 1, 1, 1 }, lo = -hi;
+    v4sf x;
+    v4si over, under;
+    int i;
+    memset(out, 0, ((n + 3) & ~3) * sizeof(float));
+    for (i = 0; i < pu->count; i++)
+        if (!pu->st[i].done)
+            station_mix(pu, &pu->st[i], out, n);
+    pileup_noise_mix(pu, out, n);
+    for (i = 0; i < n; i += 4) {
+        memcpy(&x, out + i, sizeof(x));
+        over = x > hi;
+        under = x < lo;
+        x = (v4sf)(((v4si)x & ~(over | under)) | ((v4si)hi & over) | ((v4si)lo & under));
+        memcpy(out + i, &x, sizeof(x));
+    }
+    return pu->active;
+}
+
+static int pileup_init(struct pileup *pu, int count, unsigned int srate, int inblock, int groups,
+               int respawn, FILE *log)
+{
+    uint64_t x;
+    int i, k;
+    memset(pu, 0, sizeof(*pu));
+    sine_table_init();
+    pu->count = count;
+    pu->rate = srate;
+    pu->inblock = inblock;
+    pu->groups = groups;
+    pu->respawn = respawn;
+    pu->log = log;
+    pu->noise = pileup_noise;
+    pu->qsb = pileup_qsb;
+    pu->qrn = pileup_qrn;
+    pu->master = 0.7 / sqrt(count > 0 ? count : 1);
+    rng_seed(&pu->r, gen_seed, 0x4fff);
+    for (k = 0; k < 4; k++)
+        for (i = 0; i < 4; i++) {
+            x = rng_next(&pu->r);
+            pu->ns[k][i] = x | !x;      /* no lane may start all zero */
+        }
+    pu->ramp_frames = (uint64_t)RAMP_USEC * srate / 1000000;
+    pu->ramp_frames = pu->ramp_frames > sizeof(pu->ramp) / sizeof(pu->ramp[0]) ?
+            sizeof(pu->ramp) / sizeof(pu->ramp[0]) : pu->ramp_frames;
+    for (i = 0; i < (int)pu->ramp_frames; i++)
+        pu->ramp[i] = 0.5 - 0.5 * cos(M_PI * (i + 0.5) / pu->ramp_frames);
+    for (k = 0; k < gen_charset.count; k++)
+        if ((pu->code[k] = pileup_code(gen_charset.sym[k], gen_charset.len[k])))
+            pu->sym[pu->nsym++] = k;
+    if (!pu->nsym) {
+        printf("[!] Nothing in the charset can be keyed.\n");
+        return -1;
+    }
+    if (count && (pu->st = calloc(count, sizeof(struct station))) == NULL) {
+        printf("[!] No enough memory. Error code: pileup\n");
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if ((pu->st[i].text = malloc(groups * (inblock * gen_charset.maxlen + 1) + 1)) == NULL) {
+            printf("[!] No enough memory. Error code: pileup\n");
+            return -1;
+        }
+        station_start(pu, &pu->st[i], rng_next(&pu->r) % (srate * 3));
+    }
+    return 0;
+}
+
+static void pileup_free(struct pileup *pu)
+{
+    int i;
+    for (i = 0; pu->st && i < pu->count; i++)
+        free(pu->st[i].text);
+    free(pu->st);
+    pu->st = NULL;
+}
+
+/*
+ *   Iambic keyer (--iambic, --paddle)
+ *
+ *   The paddles only set bits in paddle_state, and in paddle_taps until
+ *   the keyer has seen them; the elements are timed in frames as the
+ *   audio thread renders them, so a dit is one unit to the sample at
+ *   any speed or period size.  After an element and its one unit gap
+ *   the keyer sends the other element if that paddle is in, else the
+ *   same one while its paddle is held.  Mode A looks at the paddles only
+ *   then; mode B also remembers the other paddle if it was in at any time
+ *   during the element, so letting go of a squeeze sends one more
+ *   alternate element.  A straight key goes
+ *   through the keyer as it is held.  Marks get the raised-cosine edges
+ *   of RAMP_USEC, and every mark and gap goes to the decoder: exact
+ *   within a run of elements, timed by key_now() before one.  Changed
+ *   live settings are taken up as the keyer decides on the next element.
+ */
+#define PADDLE_DIT 1
+#define PADDLE_DAH 2
+#define PADDLE_STRAIGHT 4
+
+enum { KEYER_IDLE, KEYER_MARK, KEYER_GAP, KEYER_STRAIGHT };
+
+struct keyer {
+    int mode;                   /* 'A' or 'B' */
+    int state, elem;            /* KEYER_*, and the last element, 0 dit 1 dah */
+    unsigned int unit;          /* frames per dit */
+    unsigned int pos, len;      /* frames into the state and its length */
+    unsigned int latch;         /* paddles that count for the next element */
+    uint64_t clock;             /* frames rendered */
+    uint64_t mark_end;          /* clock at the end of the last mark */
+    uint64_t base_clock;        /* clock at key_now() base, set when a run starts */
+    int64_t base;
+    float ramp[1024];           /* RAMP_USEC at up to 196 kHz, at most a quarter unit */
+    unsigned int ramp_frames;
+    float gain;
+    unsigned int seen;          /* live_seq of the settings in use */
+    struct nco osc;
+};
+
+static int keyer_on = 0;                    /* --iambic or --paddle */
+static int keyer_mode = 'B', keyer_wpm = 15;
+static int paddle_code[2] = { 29, 97 };     /* dit and dah: left and right Ctrl */
+static volatile unsigned int paddle_state, paddle_taps;
+static struct keyer keyer;
+
+static int64_t key_now(void);
+static void keyer_span(int mark, int64_t end, int usec);   /* with the key event pipeline */
+
+/* unit and edges for wpm */
+static void keyer_speed(struct keyer *k, int wpm, unsigned int srate)
+{
+    unsigned int i;
+    k->unit = (uint64_t)srate * 1200 / wpm / 1000;
+    k->ramp_frames = (uint64_t)RAMP_USEC * srate / 1000000;
+    k->ramp_frames = k->ramp_frames > k->unit / 4 ? k->unit / 4 : k->ramp_frames;
+    k->ramp_frames = k->ramp_frames > sizeof(k->ramp) / sizeof(k->ramp[0]) ?
+            sizeof(k->ramp) / sizeof(k->ramp[0]) : k->ramp_frames;
+    for (i = 0; i < k->ramp_frames; i++)
+        k->ramp[i] = 0.5 - 0.5 * cos(M_PI * (i + 0.5) / k->ramp_frames);
+}
+
+static void keyer_init(struct keyer *k, unsigned int srate)
+{
+    memset(k, 0, sizeof(*k));
+    k->mode = keyer_mode;
+    k->seen = __atomic_load_n(&live_seq, __ATOMIC_ACQUIRE);
+    k->gain = live_conf.volume / 100.0f;
+    keyer_speed(k, keyer_wpm, srate);
+    nco_set_freq(&k->osc, freq, srate);
+}
+
+static int keyer_active(const struct keyer *k)
+{
+    return k->state != KEYER_IDLE || paddle_state || paddle_taps;
+}
+
+static int64_t keyer_time(const struct keyer *k, uint64_t clock)
+{
+    return k->base + (int64_t)((clock - k->base_clock) * 1000000 / rate);
+}
+
+/* at the end of a gap, or while idle: what to send next */
+static void keyer_next(struct keyer *k)
+{
+    unsigned int held = __atomic_load_n(&paddle_state, __ATOMIC_ACQUIRE);
+    unsigned int taps = __atomic_exchange_n(&paddle_taps, 0, __ATOMIC_ACQ_REL);
+    int run = k->state == KEYER_GAP, elem;
+    int64_t gap = 0;
+    struct live_conf conf;
+    if (live_poll(&k->seen, &conf)) {
+        keyer_speed(k, conf.wpm, rate);
+        nco_set_freq(&k->osc, conf.freq, rate);
+        k->gain = conf.volume / 100.0f;
+    }
+    k->latch = k->mode == 'B' ? k->latch | held | taps : held | (run ? 0 : taps);
+    if (k->latch & PADDLE_STRAIGHT && !run) {
+        elem = -1;
+    } else if (run && k->latch & (k->elem ? PADDLE_DIT : PADDLE_DAH)) {
+        elem = !k->elem;
+    } else if (k->latch & (PADDLE_DIT | PADDLE_DAH)) {
+        elem = run ? k->elem : !(k->latch & PADDLE_DIT);
+        elem = k->latch & (elem ? PADDLE_DAH : PADDLE_DIT) ? elem : !elem;
+    } else {
+        k->state = KEYER_IDLE;
+        k->latch = 0;
+        return;
+    }
+    k->latch = 0;
+    if (run)
+        gap = (k->clock - k->mark_end) * 1000000 / rate;
+    else {
+        /* a new run: anchor the frame clock to the key clock */
+        gap = k->mark_end ? key_now() - keyer_time(k, k->mark_end) : 0;
+        k->base = key_now();
+        k->base_clock = k->clock;
+    }
+    keyer_span(0, keyer_time(k, k->clock), gap);
+    k->state = elem < 0 ? KEYER_STRAIGHT : KEYER_MARK;
+    k->elem = elem < 0 ? 0 : elem;
+    k->len = elem < 0 ? UINT32_MAX : elem ? 3 * k->unit : k->unit;
+    k->pos = 0;
+}
+
+/* count frames of the keyed tone as float at out */
+static void keyer_render(struct keyer *k, float *out, int count)
+{
+    unsigned int run, edge, i;
+    while (count > 0) {
+        if (k->state == KEYER_IDLE || (k->state == KEYER_GAP && k->pos == k->len))
+            keyer_next(k);
+        if (k->state == KEYER_STRAIGHT && k->len == UINT32_MAX && !(paddle_state & PADDLE_STRAIGHT))
+            k->len = k->pos + k->ramp_frames;   /* released: fall from here */
+        run = count < SYNTH_BLOCK ? count : SYNTH_BLOCK;
+        run = k->state != KEYER_IDLE && k->len - k->pos < run ? k->len - k->pos : run;
+        if (k->state == KEYER_MARK && k->mode == 'B')
+            k->latch |= paddle_state & (k->elem ? PADDLE_DIT : PADDLE_DAH);   /* squeezed */
+        if (k->state == KEYER_MARK || k->state == KEYER_STRAIGHT) {
+            nco_render(&k->osc, out, run);
+            for (i = 0; i < run; i++) {
+                edge = k->pos + i < k->len - 1 - k->pos - i ? k->pos + i : k->len - 1 - k->pos - i;
+                out[i] *= k->gain * (edge < k->ramp_frames ? k->ramp[edge] : 1);
+            }
+        } else
+            memset(out, 0, run * sizeof(float));
+        k->pos += k->state == KEYER_IDLE ? 0 : run;
+        k->clock += run;
+        out += run;
+        count -= run;
+        if ((k->state == KEYER_MARK || k->state == KEYER_STRAIGHT) && k->pos == k->len) {
+            keyer_span(1, keyer_time(k, k->clock), (int64_t)k->len * 1000000 / rate);
+            k->mark_end = k->clock;
+            k->state = k->state == KEYER_MARK ? KEYER_GAP : KEYER_IDLE;
+            k->pos = 0;
+            k->len = k->unit;
+        }
+    }
+}
+
+/*
+ *   Period sources - each fills frames of interleaved PCM at dst and
+ *   returns 1 once it has nothing more to play
+ */
+typedef int (*period_fill_t)(void *ctx, unsigned char *dst, snd_pcm_uframes_t frames);
+
+static int fill_silence(void *ctx, unsigned char *dst, snd_pcm_uframes_t frames)
+{
+    snd_pcm_format_set_silence(format, dst, frames * channels);
+    return 0;
+}
+
+/* the straight key's tone, which takes up live settings while the key is up */
+struct sidetone {
+    struct nco osc;
+    float gain;
+    unsigned int seen;
+};
+
+static void sidetone_init(struct sidetone *t)
+{
+    t->osc.phase = 0;
+    nco_set_freq(&t->osc, freq, rate);
+    t->gain = live_conf.volume / 100.0f;
+    t->seen = __atomic_load_n(&live_seq, __ATOMIC_ACQUIRE);
+}
+
+static void sidetone_poll(struct sidetone *t)
+{
+    struct live_conf conf;
+    if (live_poll(&t->seen, &conf)) {
+        nco_set_freq(&t->osc, conf.freq, rate);
+        t->gain = conf.volume / 100.0f;
+    }
+}
+
+static int fill_tone(void *ctx, unsigned char *dst, snd_pcm_uframes_t frames)
+{
+    struct sidetone *t = ctx;
+    float buf[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    int n, i;
+    for (; frames > 0; frames -= n, dst += n * frame_bytes) {
+        n = frames < SYNTH_BLOCK ? frames : SYNTH_BLOCK;
+        nco_render(&t->osc, buf, n);
+        if (t->gain != 1)
+            for (i = 0; i < n; i++)
+                buf[i] *= t->gain;
+        synth_kernel(buf, dst, n);
+    }
+    return 0;
+}
+
+static int fill_timeline(void *ctx, unsigned char *dst, snd_pcm_uframes_t frames)
+{
+    struct player *pl = ctx;
+    struct elem_cache *next;
+    /* cover the cache of the element under way, then the one to take up */
+    __atomic_store_n(&elem_playing[0], pl->cache, __ATOMIC_SEQ_CST);
+    do {
+        next = __atomic_load_n(&elem_live, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&elem_playing[1], next, __ATOMIC_SEQ_CST);
+    } while (next != __atomic_load_n(&elem_live, __ATOMIC_SEQ_CST));
+    return player_fill(pl, &timeline, next, dst, frames);
+}
+
+static int fill_keyer(void *ctx, unsigned char *dst, snd_pcm_uframes_t frames)
+{
+    float buf[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    int n;
+    for (; frames > 0; frames -= n, dst += n * frame_bytes) {
+        n = frames < SYNTH_BLOCK ? frames : SYNTH_BLOCK;
+        keyer_render(ctx, buf, n);
+        synth_kernel(buf, dst, n);
+    }
+    return 0;
+}
+
+static int fill_pileup(void *ctx, unsigned char *dst, snd_pcm_uframes_t frames)
+{
+    float buf[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    int n;
+    for (; frames > 0; frames -= n, dst += n * frame_bytes) {
+        n = frames < SYNTH_BLOCK ? frames : SYNTH_BLOCK;
+        pileup_render(ctx, buf, n);
+        synth_kernel(buf, dst, n);
+    }
+    return 0;
+}
+
+/*
+ *   Write one period straight into the mmapped ring buffer, sleeping in
+ *   snd_pcm_wait() until a period of it is free.  Same results as
+ *   write_period(), or the source's end flag.
+ */
+static int mmap_period(snd_pcm_t *handle, period_fill_t fill, void *ctx)
+{
+    const snd_pcm_channel_area_t *ring;
+    snd_pcm_uframes_t offset, frames, left = period_size;
+    snd_pcm_sframes_t avail, committed;
+    int err, done = 0;
+    while (left > 0) {
+        if ((avail = snd_pcm_avail_update(handle)) < 0) {
+            if (xrun_recovery(handle, avail) < 0) {
+                printf("[!] Avail update error: %s\n", snd_strerror(avail));
+                return -1;
+            }
+            continue;
+        }
+        if ((snd_pcm_uframes_t)avail < left) {
+            /* full: a stream short of its start threshold would never drain */
+            if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+                snd_pcm_start(handle);
+            else if ((err = snd_pcm_wait(handle, 1000)) < 0 && xrun_recovery(handle, err) < 0) {
+                printf("[!] Wait error: %s\n", snd_strerror(err));
+                return -1;
+            }
+            continue;
+        }
+        frames = left;
+        if ((err = snd_pcm_mmap_begin(handle, &ring, &offset, &frames)) < 0) {
+            if (xrun_recovery(handle, err) < 0) {
+                printf("[!] MMAP begin avail error: %s\n", snd_strerror(err));
+                return -1;
+            }
+            continue;
+        }
+        done |= fill(ctx, (unsigned char *)ring[0].addr + ring[0].first / 8 + offset * frame_bytes, frames);
+        committed = snd_pcm_mmap_commit(handle, offset, frames);
+        if (committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+            if (xrun_recovery(handle, committed >= 0 ? -EPIPE : committed) < 0) {
+                printf("[!] MMAP commit error: %s\n", snd_strerror(committed));
+                return -1;
+            }
+            break;  /* skip the rest of the period */
+        }
+        left -= frames;
+    }
+    return done;
+}
+
+static int transfer_mmap = 0;       /* the device took mmap access */
+
+/*
+ *   Play one period of a source through the negotiated access, -1 on error
+ */
+static int put_period(snd_pcm_t *handle, signed short *samples, period_fill_t fill, void *ctx)
+{
+    int64_t t0 = stats_self ? stats_usec() : 0;
+    int done;
+    if (transfer_mmap)
+        done = mmap_period(handle, fill, ctx);
+    else {
+        done = fill(ctx, (unsigned char *)samples, period_size);
+        done = write_period(handle, (unsigned char *)samples) < 0 ? -1 : done;
+    }
+    if (stats_self) {
+        stats_self->periods++;
+        stats_hist(HIST_PERIOD, stats_usec() - t0);
+    }
+    return done;
+}
+
+/*
+ *   Transfer loop - the keyed tone
+ *
+ *   Once the key is up the thread waits on key_wake_fd while what is
+ *   queued plays out, then stops the stream and blocks there with no
+ *   timeout.  A key down writes a period of tone into the stopped stream
+ *   and starts it at once, so the tone begins within a period and
+ *   nothing wakes while the key stays up.
+ */
+static int tone_loop(snd_pcm_t *handle,
+              signed short *samples,
+              snd_pcm_channel_area_t *areas)
+{
+    struct sidetone tone;
+    struct pollfd pfd = { key_wake_fd, POLLIN, 0 };
+    struct timespec cpu, tail, *wait;
+    double t0 = mono_time();
+    snd_pcm_sframes_t delay;
+    uint64_t wakes;
+    sidetone_init(&tone);
+    keyer_init(&keyer, rate);
+    while (!m_Interrupt){
+      while (OnWav || (keyer_on && keyer_active(&keyer))){
+        if (put_period(handle, samples, keyer_on ? fill_keyer : fill_tone, keyer_on ? (void *)&keyer : &tone) < 0)
+            return -1;
+        if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+            snd_pcm_start(handle);  /* don't wait for the start threshold after an xrun */
+      }
+      sidetone_poll(&tone);
+      if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+          wait = NULL;      /* stopped, until the key goes down */
+      } else if (snd_pcm_delay(handle, &delay) < 0 || delay <= 0) {
+          /* the tail has played out; an idle keyer needs no clock, a new run anchors it */
+          snd_pcm_drop(handle);
+          snd_pcm_prepare(handle);
+          continue;
+      } else {
+          tail.tv_sec = delay / rate;
+          tail.tv_nsec = (long)(delay % rate) * 1000000000L / rate;
+          wait = &tail;
+      }
+      if (key_wake_fd < 0)
+          usleep(period_time / 2);
+      else if (ppoll(&pfd, 1, wait, NULL) > 0 && read(key_wake_fd, &wakes, sizeof(wakes)) < 0)
+          continue;
+    }printf("\n=============================\n");
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    printf("[-] Sound thread used %.2f s CPU in %.1f s.\n", cpu.tv_sec + cpu.tv_nsec * 1e-9, mono_time() - t0);
+    return 0;
+}
+
+/*
+ *   Transfer loop - playing the timeline
+ */
+static int timeline_loop(snd_pcm_t *handle,
+              signed short *samples,
+              snd_pcm_channel_area_t *areas)
+{
+    struct player pl = { { 0, 0, "" }, 0, 1 };
+    int finished = 0, due = 0;
+    /* past the end of the text, pad with silence until the last echo is due */
+    while (!m_Interrupt && (!finished || due)){
+        if ((finished = put_period(handle, samples, fill_timeline, &pl)) < 0) {
+            echo_finish(&echo_queue);
+            return -1;
+        }
+        due = echo_sync(&echo_queue, handle, pl.clock);
+    }
+    echo_finish(&echo_queue);
+    m_Interrupt = 1;
+    return 0;
+}
+
+static int file_loop(snd_pcm_t *handle,
+              signed short *samples,
+              snd_pcm_channel_area_t *areas)
+{
+    int rf;
+    pthread_t RF_pid, EC_pid;
+    OnWav = 0;m_Interrupt = 0;
+    if (elem_cache_update(&elem_cache) < 0)
+        return -1;
+    timeline_reset(&timeline);
+    /* the echo side is set up before the audio thread needs it */
+    echo_queue.head = echo_queue.tail = echo_queue.dropped = 0;
+    echo_ring.head = echo_ring.tail = 0;
+    echo_ring.eof = 0;
+    echo_hidden_len = 0;
+    if (echo_lag < 0 && echo_hidden == NULL) {
+        if ((echo_hidden = malloc(ECHO_HIDDEN)) == NULL) {
+            printf("[!] No enough memory. Error code: echo\n");
+            return -1;
+        }
+        echo_hidden_size = ECHO_HIDDEN;
+    }
+    if (echo_wake_fd < 0)
+        echo_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(pthread_create(&EC_pid, NULL, EchoDaemon, NULL)!=0){
+        printf("[!] Fail to create EchoDaemon thread.\n");
+        return -1;
+    }
+    if((rf = pthread_create(&RF_pid, NULL, ReadFile_AK, NULL))<0){
+        printf("[!] Fail to create AutoKey thread.\n");
+    }
+    timeline_loop(handle,samples,areas);
+    pthread_join(EC_pid,NULL);
+    printf("\n=============================\n");
+    pthread_join(RF_pid,NULL);printf("[-] AutoKey closed.\n");
+    OnWav = 0;m_Interrupt = 0;
+    return 0;
+}
+
+/*
+ *   Transfer loop - playing the pile-up
+ */
+static int pileup_loop(snd_pcm_t *handle,
+              signed short *samples,
+              snd_pcm_channel_area_t *areas)
+{
+    struct timespec cpu;
+    double t0 = mono_time();
+    while (!m_Interrupt){
+        if (put_period(handle, samples, fill_pileup, &pileup) < 0)
+            return -1;
+    }
+    printf("\n=============================\n");
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    printf("[-] Sound thread used %.2f s CPU in %.1f s.\n", cpu.tv_sec + cpu.tv_nsec * 1e-9, mono_time() - t0);
+    return 0;
+}
+
+/*
+ *   Transfer methods, TRANSFER_MODES loops each: the keyed tone, a text
+ *   file and the pile-up.  "write" copies each period through
+ *   snd_pcm_writei(), "mmap" renders it in place in the device ring.
+ */
+#define TRANSFER_MODES 3
+
+struct transfer_method {
+    const char *name;
+    snd_pcm_access_t access;
+    int (*transfer_loop)(snd_pcm_t *handle,
+                 signed short *samples,
+                 snd_pcm_channel_area_t *areas);
+};
+static struct transfer_method transfer_methods[] = {
+    { "write", SND_PCM_ACCESS_RW_INTERLEAVED, tone_loop },
+    { "write", SND_PCM_ACCESS_RW_INTERLEAVED, file_loop },
+    { "write", SND_PCM_ACCESS_RW_INTERLEAVED, pileup_loop },
+    { "mmap", SND_PCM_ACCESS_MMAP_INTERLEAVED, tone_loop },
+    { "mmap", SND_PCM_ACCESS_MMAP_INTERLEAVED, file_loop },
+    { "mmap", SND_PCM_ACCESS_MMAP_INTERLEAVED, pileup_loop },
+    { NULL, SND_PCM_ACCESS_RW_INTERLEAVED, NULL }
+};
+static const char *transfer_name = "write";
+
+/* first entry of the method called name, -1 if there is none */
+static int transfer_find(const char *name)
+{
+    int i;
+    for (i = 0; transfer_methods[i].name; i += TRANSFER_MODES)
+        if (!strcmp(transfer_methods[i].name, name))
+            return i;
+    return -1;
+}
+
+/*
+ *   Text encoder, fed one byte at a time
+ *
+ *   UTF-8 sequences and <prosign> names are collected until complete,
+ *   then queued as elements with the symbol echoed after its last one.
+ *   Anything without a code is echoed after a character gap.
+ */
+struct cw_encoder {
+    char buf[8];
+    int len;
+    int want;               /* UTF-8 continuation bytes still expected */
+};
+
+static void encode_code(struct timeline *tl, int code, const char *echo)
+{
+    int bit;
+    for (bit = 30 - __builtin_clz(code); bit >= 0; bit--) {
+        timeline_push(tl, (code >> bit) & 1 ? ELEM_DAH : ELEM_DIT, NULL);
+        if (bit)
+            timeline_push(tl, ELEM_SGAP, NULL);
+    }
+    timeline_push(tl, ELEM_BGAP, echo);
+}
+
+static void encode_symbol(struct timeline *tl, const char *text, int len)
+{
+    unsigned int cp = (unsigned char)text[0];
+    char echo[8];
+    int code;
+    if (len == 2)
+        cp = ((cp & 0x1f) << 6) | (text[1] & 0x3f);
+    else if (len == 3)
+        cp = ((cp & 0x0f) << 12) | ((text[1] & 0x3f) << 6) | (text[2] & 0x3f);
+    memcpy(echo, text, len);
+    echo[len] = 0;
+    if (cp >= 'a' && cp <= 'z')
+        echo[0] = cp - 'a' + 'A';
+    if ((code = cw_encode(cp)))
+        encode_code(tl, code, echo);
+    else {
+        /* a word space is the character gap before it, another one and an element gap */
+        timeline_push(tl, ELEM_BGAP, echo);
+        timeline_push(tl, ELEM_SGAP, NULL);
+    }
+}
+
+static void encoder_flush(struct cw_encoder *enc, struct timeline *tl)
+{
+    int code, i;
+    enc->buf[enc->len] = 0;
+    if (enc->buf[0] != '<')
+        encode_symbol(tl, enc->buf, enc->len);
+    else if (enc->buf[enc->len - 1] == '>' && (code = cw_encode_prosign(enc->buf)))
+        encode_code(tl, code, enc->buf);
+    else {
+        /* not a prosign after all */
+        for (i = 0; i < enc->len; i++)
+            encode_symbol(tl, enc->buf + i, 1);
+    }
+    enc->len = enc->want = 0;
+}
+
+static void encoder_feed(struct cw_encoder *enc, struct timeline *tl, int byte)
+{
+    if (enc->len && enc->buf[0] == '<') {
+        if (byte != '<' && !(byte & 0x80)) {
+            enc->buf[enc->len++] = byte;
+            if (byte == '>' || enc->len == sizeof(enc->buf) - 1)
+                encoder_flush(enc, tl);
+            return;
+        }
+        encoder_flush(enc, tl);
+    }
+    if (enc->want) {
+        if ((byte & 0xc0) == 0x80) {
+            enc->buf[enc->len++] = byte;
+            if (--enc->want == 0)
+                encoder_flush(enc, tl);
+            return;
+        }
+        encoder_flush(enc, tl);     /* broken sequence */
+    }
+    enc->buf[enc->len++] = byte;
+    if (byte == '<')
+        return;
+    if ((byte & 0xe0) == 0xc0)
+        enc->want = 1;
+    else if ((byte & 0xf0) == 0xe0)
+        enc->want = 2;
+    else if ((byte & 0xf8) == 0xf0)
+        enc->want = 3;
+    else
+        encoder_flush(enc, tl);
+}
+
+/*
+ *   Streaming input - the text source read ahead into a byte ring
+ *
+ *   TextDaemon() moves whatever the source holds into text_ring: it
+ *   waits in poll() while a pipe, FIFO or terminal is idle and then
+ *   takes everything there with one read(), so a writer bursting into
+ *   a FIFO or stdin is drained at once and never blocks on a full pipe
+ *   while the timeline is full.  ReadFile_AK() is the lookahead: it
+ *   encodes from the ring into the timeline as soon as bytes arrive,
+ *   up to TIMELINE_SIZE elements ahead of playback.  A UTF-8 sequence
+ *   or <prosign> split across reads stays in the encoder until its
+ *   last byte comes, and is only cut short at the end of the text.
+ */
+#define TEXT_RING 65536     /* bytes, power of two */
+#define TEXT_POLL_MS 100    /* an idle source is left to look at m_Interrupt */
+
+struct text_ring {
+    unsigned char buf[TEXT_RING];
+    unsigned int head, tail;
+    int eof;                /* the source ended or failed, head is final */
+};
+static struct text_ring text_ring;
+static int text_fd = -1;    /* -i source, practice_text when -1 */
+
+/* the source of -i, "-" for stdin; a FIFO waits here for its writer */
+static int text_open(const char *path)
+{
+    struct stat st;
+    int fd;
+    if (!strcmp(path, "-"))
+        return STDIN_FILENO;
+    if (stat(path, &st) == 0 && S_ISFIFO(st.st_mode))
+        printf("[+] Waiting for a writer on %s\n", path);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+void * TextDaemon()
+{
+    struct text_ring *r = &text_ring;
+    struct pollfd pfd = { text_fd, POLLIN, 0 };
+    size_t off = 0;
+    unsigned int head, n;
+    ssize_t got;
+    while (!m_Interrupt) {
+        head = r->head;
+        n = TEXT_RING - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+        if (n == 0) {
+            usleep(period_time);
+            continue;
+        }
+        if (n > TEXT_RING - head % TEXT_RING)
+            n = TEXT_RING - head % TEXT_RING;
+        if (text_fd < 0) {
+            got = practice_len - off < n ? practice_len - off : n;
+            memcpy(r->buf + head % TEXT_RING, practice_text + off, got);
+            off += got;
+        } else {
+            if (poll(&pfd, 1, TEXT_POLL_MS) <= 0)
+                continue;
+            if ((got = read(text_fd, r->buf + head % TEXT_RING, n)) < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    continue;
+                printf("[!] Unable to read text: %s\n", strerror(errno));
+                break;
+            }
+        }
+        if (got == 0)
+            break;
+        __atomic_store_n(&r->head, head + got, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&r->eof, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void * ReadFile_AK()
+{
+    struct text_ring *r = &text_ring;
+    struct cw_encoder enc = { { 0 }, 0, 0 };
+    pthread_t TD_pid;
+    unsigned int tail;
+    r->head = r->tail = 0;
+    r->eof = 0;
+    if(pthread_create(&TD_pid, NULL, TextDaemon, NULL)!=0){
+        printf("[!] Fail to create TextReader thread.\n");timeline.done=1;return 0;
+    }
+    while(!m_Interrupt){
+      tail = r->tail;
+      if(tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)){
+        if(__atomic_load_n(&r->eof, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)){break;}
+        usleep(period_time);continue;
+      }
+      encoder_feed(&enc, &timeline, r->buf[tail % TEXT_RING]);
+      __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    if(enc.len){encoder_flush(&enc, &timeline);}
+    timeline.done=1;
+    pthread_join(TD_pid,NULL);
+    return 0;
+}
+
+/*
+ *   Offline renderer - text files to WAV or raw PCM without a sound device
+ *
+ *   Each input runs the same encoder, timeline and player as
+ *   write_from_file(), one thread per core, so the output is the live
+ *   signal sample for sample.  PCM goes out in RENDER_BLOCK writes.
+ */
+#define RENDER_BLOCK (1 << 20)  /* bytes per write */
+#define RENDER_SLACK 96         /* most events one fed byte can queue */
+
+struct render_batch {
+    char **inputs;
+    int count;
+    const char *output;
+    int to_dir;
+    int raw;
+    int next;               /* next input to take, shared by the workers */
+    int failed;
+    double seconds;         /* audio rendered, summed by the workers */
+    pthread_mutex_t lock;
+};
+
+static void put_le(unsigned char *p, uint32_t v, int bytes)
+{
+    while (bytes-- > 0) {
+        *p++ = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static void wav_header(unsigned char *h, uint32_t data_bytes)
+{
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, 36 + data_bytes, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le(h + 16, 16, 4);
+    put_le(h + 20, synth_float ? 3 : 1, 2);
+    put_le(h + 22, channels, 2);
+    put_le(h + 24, rate, 4);
+    put_le(h + 28, rate * frame_bytes, 4);
+    put_le(h + 32, frame_bytes, 2);
+    put_le(h + 34, synth_phys_bps * 8, 2);
+    memcpy(h + 36, "data", 4);
+    put_le(h + 40, data_bytes, 4);
+}
+
+/* play everything queued on the timeline into buf, writing it out when full */
+static int render_queued(struct player *pl, struct timeline *tl, FILE *fout,
+             unsigned char *buf, size_t *used, uint64_t *total)
+{
+    snd_pcm_uframes_t frames = timeline_frames(tl, pl), n;
+    while (frames > 0) {
+        n = (RENDER_BLOCK - *used) / frame_bytes;
+        n = n < frames ? n : frames;
+        player_fill(pl, tl, &elem_cache, buf + *used, n);
+        *used += n * frame_bytes;
+        *total += n * frame_bytes;
+        frames -= n;
+        if (RENDER_BLOCK - *used < frame_bytes) {
+            if (fwrite(buf, 1, *used, fout) != *used)
+                return -1;
+            *used = 0;
+        }
+    }
+    return 0;
+}
+
+static int render_file(const char *in, const char *out, int raw, double *seconds)
+{
+    struct timeline *tl;
+    struct player pl = { { 0, 0, "" }, 0, 0 };
+    struct cw_encoder enc = { { 0 }, 0, 0 };
+    unsigned char header[44], *buf;
+    uint64_t total = 0;
+    size_t used = 0;
+    FILE *fin, *fout;
+    int letter, err = 0;
+    fin = in ? fopen(in, "r") : fmemopen(practice_text, practice_len, "r");
+    if (fin == NULL) {
+        printf("[!] Unable to read %s\n", in ? in : "practice text");
+        return -1;
+    }
+    if ((fout = fopen(out, "wb")) == NULL) {
+        printf("[!] Unable to write %s\n", out);
+        fclose(fin);
+        return -1;
+    }
+    setvbuf(fout, NULL, _IONBF, 0);
+    tl = malloc(sizeof(*tl));
+    buf = malloc(RENDER_BLOCK);
+    if (tl == NULL || buf == NULL) {
+        printf("[!] No enough memory. Error code: render\n");
+        err = -1;
+        goto out;
+    }
+    timeline_reset(tl);
+    if (!raw && fwrite(header, 1, sizeof(header), fout) != sizeof(header))
+        err = -1;
+    while (!err && (letter = fgetc(fin)) != EOF) {
+        encoder_feed(&enc, tl, letter);
+        if (timeline_count(tl) > TIMELINE_SIZE - RENDER_SLACK)
+            err = render_queued(&pl, tl, fout, buf, &used, &total);
+    }
+    if (enc.len)
+        encoder_flush(&enc, tl);
+    if (!err)
+        err = render_queued(&pl, tl, fout, buf, &used, &total);
+    if (!err && used && fwrite(buf, 1, used, fout) != used)
+        err = -1;
+    if (!err && !raw) {
+        wav_header(header, total > 0xffffffd0ULL ? 0xffffffd0U : total);
+        if (fseek(fout, 0, SEEK_SET) || fwrite(header, 1, sizeof(header), fout) != sizeof(header))
+            err = -1;
+    }
+    if (err)
+        printf("[!] Failed writing %s: %s\n", out, strerror(errno));
+    *seconds = (double)total / frame_bytes / rate;
+out:
+    free(buf);
+    free(tl);
+    fclose(fin);
+    if (fclose(fout) && !err)
+        err = -1;
+    return err;
+}
+
+static void *render_worker(void *arg)
+{
+    struct render_batch *batch = arg;
+    char out[4096];
+    double seconds;
+    int i, err;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        const char *in = batch->inputs[i], *base, *dot;
+        if (batch->to_dir) {
+            base = !in ? "practice" : strrchr(in, '/') ? strrchr(in, '/') + 1 : in;
+            dot = strrchr(base, '.');
+            snprintf(out, sizeof(out), "%s/%.*s.%s", batch->output,
+                 (int)(dot && dot != base ? dot - base : strlen(base)), base, batch->raw ? "raw" : "wav");
+        } else
+            snprintf(out, sizeof(out), "%s", batch->output);
+        err = render_file(in, out, batch->raw, &seconds);
+        pthread_mutex_lock(&batch->lock);
+        batch->failed += err < 0;
+        batch->seconds += err < 0 ? 0 : seconds;
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return 0;
+}
+
+/*
+ *   Render every input, spread over one worker per online CPU
+ */
+static int render_batch(char **inputs, int count, const char *output, int raw)
+{
+    struct render_batch batch = { inputs, count, output, 0, raw, 0, 0, 0 };
+    struct stat st;
+    pthread_t *workers;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN), i;
+    double t0 = mono_time();
+    const char *ext = strrchr(output, '.');
+    batch.to_dir = count > 1 || (stat(output, &st) == 0 && S_ISDIR(st.st_mode));
+    batch.raw = raw || (!batch.to_dir && ext && (!strcmp(ext, ".raw") || !strcmp(ext, ".pcm")));
+    if (batch.to_dir && mkdir(output, 0755) < 0 && errno != EEXIST) {
+        printf("[!] Unable to create %s: %s\n", output, strerror(errno));
+        return -1;
+    }
+    synth_select();
+    if (elem_cache_update(&elem_cache) < 0)
+        return -1;
+    jobs = jobs < 1 ? 1 : jobs > count ? count : jobs;
+    pthread_mutex_init(&batch.lock, NULL);
+    if ((workers = calloc(jobs, sizeof(pthread_t))) == NULL) {
+        printf("[!] No enough memory. Error code: render\n");
+        return -1;
+    }
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&workers[i], NULL, render_worker, &batch) != 0) {
+            printf("[!] Fail to create render thread.\n");
+            jobs = i;
+            break;
+        }
+    }
+    if (jobs == 0)
+        render_worker(&batch);
+    for (i = 0; i < jobs; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&batch.lock);
+    printf("[-] Rendered %d of %d files, %.1f s of audio in %.2f s on %d threads.\n",
+           count - batch.failed, count, batch.seconds, mono_time() - t0, jobs ? jobs : 1);
+    return batch.failed ? -1 : 0;
+}
+
+/*
+ *   Render the pile-up until its last station signs off
+ */
+static int render_pileup(const char *out, int raw, int inblock, int groups)
+{
+    float buf[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    unsigned char header[44], *pcm = NULL;
+    const char *ext = strrchr(out, '.');
+    double t0 = mono_time();
+    uint64_t total = 0;
+    size_t used = 0;
+    FILE *fout;
+    int err = 0, keying = 1;
+    raw = raw || (ext && (!strcmp(ext, ".raw") || !strcmp(ext, ".pcm")));
+    synth_select();
+    if (pileup_init(&pileup, pileup_count, rate, inblock, groups, 0, stdout) < 0)
+        return -1;
+    if ((fout = fopen(out, "wb")) == NULL) {
+        printf("[!] Unable to write %s\n", out);
+        pileup_free(&pileup);
+        return -1;
+    }
+    setvbuf(fout, NULL, _IONBF, 0);
+    if ((pcm = malloc(RENDER_BLOCK)) == NULL) {
+        printf("[!] No enough memory. Error code: render\n");
+        err = -1;
+    }
+    if (!err && !raw && fwrite(header, 1, sizeof(header), fout) != sizeof(header))
+        err = -1;
+    while (!err && keying) {
+        keying = pileup_render(&pileup, buf, SYNTH_BLOCK);
+        synth_kernel(buf, pcm + used, SYNTH_BLOCK);
+        used += SYNTH_BLOCK * frame_bytes;
+        total += SYNTH_BLOCK * frame_bytes;
+        if (RENDER_BLOCK - used < SYNTH_BLOCK * frame_bytes) {
+            if (fwrite(pcm, 1, used, fout) != used)
+                err = -1;
+            used = 0;
+        }
+    }
+    if (!err && used && fwrite(pcm, 1, used, fout) != used)
+        err = -1;
+    if (!err && !raw) {
+        wav_header(header, total > 0xffffffd0ULL ? 0xffffffd0U : total);
+        if (fseek(fout, 0, SEEK_SET) || fwrite(header, 1, sizeof(header), fout) != sizeof(header))
+            err = -1;
+    }
+    if (fclose(fout) && !err)
+        err = -1;
+    if (err)
+        printf("[!] Failed writing %s: %s\n", out, strerror(errno));
+    else
+        printf("[-] Rendered a pile-up of %d stations, %.1f s of audio in %.2f s.\n",
+               pileup_count, (double)total / frame_bytes / rate, mono_time() - t0);
+    free(pcm);
+    pileup_free(&pileup);
+    return err;
+}
+
+/*
+ *   Key event pipeline
+ *
+ *   KeyDaemon_CW turns evdev transitions into mark and space durations
+ *   measured on the kernel timestamps, so scheduling delay of the reader
+ *   does not show up in them. Spans go through a single-producer ring to
+ *   PrintDaemon, which sleeps until the next event or the next character
+ *   or word deadline instead of polling.
+ */
+#define KEY_RING_SIZE 256
+#define KEY_MAX_DEVICES 8
+
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+struct key_span {
+    int64_t end;            /* time of the transition closing the span, usec */
+    int usec;               /* duration */
+    int mark;               /* 1 key was down, 0 key was up */
+};
+
+struct key_ring {
+    struct key_span ev[KEY_RING_SIZE];
+    unsigned int head, tail;
+    unsigned int dropped;
+};
+
+struct decoder {
+    int code, len;          /* packed code and element count of the character */
+    int64_t up;             /* last key release, usec, 0 while the key is down */
+    int word;               /* a character went out since the last word gap */
+    int thr_dida, thr_char, thr_space;  /* classification thresholds, usec */
+    int adaptive;           /* learn the thresholds from the keying */
+    int mark[2];            /* dit and dah centres, usec */
+    int space[3];           /* element, character and word gap centres, usec */
+    unsigned int seen;      /* live_seq the fixed thresholds are from */
+    FILE *out;              /* decoded text, NULL to discard */
+    struct beam *beam;      /* --beam search in place of the greedy choice, or NULL */
+};
+
+static struct key_ring key_ring;
+static int key_device[KEY_MAX_DEVICES] = { 3 };     /* /dev/input/event numbers, -e */
+static int key_devices = 1;
+static int decode_adaptive = 0;     /* --adaptive */
+static volatile int decoder_wpm = 0;    /* speed estimate of the adaptive decoder */
+static clockid_t key_clock = CLOCK_REALTIME;    /* clock of the evdev timestamps */
+static int64_t key_replay_clock = -1;   /* the virtual key clock of --replay-fast, -1 off */
+
+static int64_t key_now(void)
+{
+    struct timespec ts;
+    if (key_replay_clock >= 0)
+        return key_replay_clock;
+    clock_gettime(key_clock, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void key_ring_push(struct key_ring *kr, int mark, int64_t end, int usec)
+{
+    struct key_span *ev;
+    if (kr->head - __atomic_load_n(&kr->tail, __ATOMIC_ACQUIRE) == KEY_RING_SIZE) {
+        kr->dropped++;
+        STATS_ADD(dropped, 1);
+        return;
+    }
+    ev = &kr->ev[kr->head % KEY_RING_SIZE];
+    ev->end = end;
+    ev->usec = usec;
+    ev->mark = mark;
+    __atomic_store_n(&kr->head, kr->head + 1, __ATOMIC_RELEASE);
+    decode_wake();
+}
+
+/* a span timed by the keyer, which is then key_ring's only producer */
+static void keyer_span(int mark, int64_t end, int usec)
+{
+    key_ring_push(&key_ring, mark, end, usec);
+}
+
+static int key_ring_pop(struct key_ring *kr, struct key_span *ev)
+{
+    unsigned int queued = __atomic_load_n(&kr->head, __ATOMIC_ACQUIRE) - kr->tail;
+    if (queued == 0)
+        return -1;
+    STATS_MAX(key_depth, queued);
+    *ev = kr->ev[kr->tail % KEY_RING_SIZE];
+    __atomic_store_n(&kr->tail, kr->tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ *   The adaptive decoder keeps one running centre per cluster (dit, dah,
+ *   element gap, character gap), moved a quarter of the way to each new
+ *   span. The opposite cluster follows half of the move as if the weight
+ *   were 1:3, so a speed change shows up on both sides after a few
+ *   elements while the actual weighting is still learned. Thresholds sit
+ *   half way between the centres. Constant time and memory per span.
+ */
+#define DECODER_MIN_DIT 10000   /* 120 WPM */
+
+static void decoder_reset(struct decoder *dec, int adaptive, FILE *out)
+{
+    dec->code = 1;
+    dec->len = 0;
+    dec->up = 0;
+    dec->word = 0;
+    dec->thr_dida = val_dida;
+    dec->thr_char = val_char;
+    dec->thr_space = val_space;
+    dec->adaptive = adaptive;
+    dec->mark[0] = val_dida * 2 / 3;
+    dec->mark[1] = val_dida * 4 / 3;
+    dec->space[0] = val_char / 2;
+    dec->space[1] = val_char * 3 / 2;
+    dec->space[2] = val_space * 2 - dec->space[1];
+    dec->seen = __atomic_load_n(&live_seq, __ATOMIC_ACQUIRE);
+    dec->out = out;
+    dec->beam = NULL;
+}
+
+static int decoder_speed(const struct decoder *dec)
+{
+    /* PARIS timing from the dit alone, the dah is as heavy as the fist makes it */
+    return (1200000 + dec->mark[0] / 2) / dec->mark[0];
+}
+
+/* how far the other centres follow a move of one, Q8, by cluster moved */
+static const short decoder_mark_follow[2][2] = { { 256, 384 }, { 43, 256 } };
+static const short decoder_space_follow[3][3] = { { 256, 384, 896 }, { 43, 256, 299 }, { 0, 55, 256 } };
+
+static void decoder_learn_mark(struct decoder *dec, int usec, int dah)
+{
+    int m0 = dec->mark[0], m1 = dec->mark[1], dit = m0, d;
+    usec = usec < m1 * 2 ? usec : m1 * 2;
+    d = (usec - (dah ? m1 : m0)) >> 2;
+    m0 += d * decoder_mark_follow[dah][0] >> 8;
+    m1 += d * decoder_mark_follow[dah][1] >> 8;
+    m0 = m0 > DECODER_MIN_DIT ? m0 : DECODER_MIN_DIT;
+    m1 = m1 > m0 * 3 / 2 ? m1 : m0 * 3 / 2;
+    dec->mark[0] = m0;
+    dec->mark[1] = m1;
+    dec->thr_dida = (m0 + m1) >> 1;
+    /* gaps are seen too late when the keying slows down, pull them along */
+    d = (m0 - dit) >> 1;
+    dec->space[0] += d;
+    dec->space[1] += d * 3;
+    dec->space[2] += d * 7;
+    dec->thr_char += d * 2;
+    dec->thr_space += d * 5;
+}
+
+static void decoder_learn_gap(struct decoder *dec, int usec)
+{
+    int *g = dec->space, c = (usec >= dec->thr_char) + (usec >= dec->thr_space);
+    int d = (usec - g[c]) >> 2;
+    g[0] += d * decoder_space_follow[c][0] >> 8;
+    g[1] += d * decoder_space_follow[c][1] >> 8;
+    g[2] += d * decoder_space_follow[c][2] >> 8;
+    g[0] = g[0] > DECODER_MIN_DIT ? g[0] : DECODER_MIN_DIT;
+    g[1] = g[1] > g[0] * 2 ? g[1] : g[0] * 2;
+    g[2] = g[2] > g[1] * 3 / 2 ? g[2] : g[1] * 3 / 2;
+    dec->thr_char = (g[0] + g[1]) >> 1;
+    dec->thr_space = (g[1] + g[2]) >> 1;
+}
+
+/*
+ *   Language model (--lm, --lm-build)
+ *
+ *   A word list of "WORD [COUNT]" lines becomes one file that the beam
+ *   decoder maps read-only, so it costs nothing to load and sessions
+ *   share its pages.  It holds a character trigram over the 64 symbols
+ *   from space to '_' (lower case folded, anything else is '?') with
+ *   word boundaries as spaces, then a trie of the words breadth first,
+ *   each node's children together and sorted.  Costs are -log2 of a
+ *   probability in eighths of a bit, a byte each: a trie node's is that
+ *   of its symbol after the parent's prefix, its end that of the word
+ *   ending there.  Integers are in host byte order.
+ *
+ *   Callsigns are too many to list, so a word off the trie that has
+ *   their shape (up to three characters, a digit, one to four letters)
+ *   pays less at its end than any other unknown word.
+ */
+#define LM_MAGIC "LCWLM01\n"
+#define LM_SYMS 64
+#define LM_SCALE 8              /* cost units per bit */
+#define LM_NONE 255             /* no word ends at the node */
+#define LM_K 2.0                /* below this count an order gives way to the one under it */
+#define LM_CALL_START 0x1
+#define LM_CALL_ACCEPT 0x1e0    /* one to four suffix letters read */
+
+struct lm_header {
+    char magic[8];
+    uint32_t words;
+    uint32_t nodes;         /* trie nodes, the root first */
+    uint32_t trigram;       /* offsets in the file */
+    uint32_t trie;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct lm_node {
+    uint32_t child;         /* index of the first child */
+    uint8_t nchild;
+    uint8_t sym;
+    uint8_t cost;
+    uint8_t end;
+};
+
+struct lm {
+    const unsigned char *base;      /* the mapped file, NULL without a model */
+    size_t size;
+    const uint8_t *tri;             /* [h2][h1][sym] */
+    const struct lm_node *node;
+    uint32_t nodes, words;
+};
+
+static struct lm lm;
+static const char *lm_path = NULL;      /* --lm */
+
+static int lm_sym(int c)
+{
+    c = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+    return c >= ' ' && c < ' ' + LM_SYMS ? c - ' ' : '?' - ' ';
+}
+
+static uint8_t lm_cost(double p)
+{
+    double bits = -log2(p) * LM_SCALE + 0.5;
+    return bits < 0 ? 0 : bits > LM_NONE - 1 ? LM_NONE - 1 : bits;
+}
+
+/* callsign shapes the word still fits after c: bit 0 start, 1-3 prefix, 4 digit, 5-8 suffix */
+static unsigned int lm_call_step(unsigned int st, int c)
+{
+    int digit = c >= '0' && c <= '9', letter = c >= 'A' && c <= 'Z';
+    unsigned int next = (st & 0x7) << 1;
+    if (!digit && !letter)
+        return 0;
+    if (digit && st & 0xe)
+        next |= 0x10;
+    if (letter)
+        next |= (st & 0xf0) << 1;
+    return next & 0x1ff;
+}
+
+struct lm_build_node {
+    int32_t child, sibling;
+    double count, ends;
+    uint8_t sym, cost;
+};
+
+/* build the model of word list [list] into [path] */
+static int lm_build(const char *list, const char *path)
+{
+    const size_t tri_size = (size_t)LM_SYMS * LM_SYMS * LM_SYMS;
+    struct lm_build_node *bn, *grow;
+    struct lm_header hdr;
+    struct lm_node ln;
+    double *tri, *bi, uni[LM_SYMS] = { 0 }, n2[LM_SYMS] = { 0 }, total = 0, count, n3, p1, p2, p3;
+    uint32_t *order, *first, nb = 1, cap = 4096, words = 0, head, tail;
+    int32_t node, *link;
+    uint8_t *cost;
+    char line[256], word[64], *c;
+    int h1, h2, s, fields, err = -1;
+    FILE *fin, *fout;
+    if ((fin = fopen(list, "r")) == NULL) {
+        printf("[!] Unable to read word list %s: %s\n", list, strerror(errno));
+        return -1;
+    }
+    tri = calloc(tri_size, sizeof(double));
+    bi = calloc(LM_SYMS * LM_SYMS, sizeof(double));
+    cost = malloc(tri_size);
+    bn = calloc(cap, sizeof(*bn));
+    order = first = NULL;
+    if (!tri || !bi || !cost || !bn)
+        goto nomem;
+    bn[0].child = bn[0].sibling = -1;
+    while (fgets(line, sizeof(line), fin)) {
+        fields = sscanf(line, "%63s %lf", word, &count);
+        if (fields < 1 || word[0] == '#' || (fields == 2 && !(count > 0)))
+            continue;
+        count = fields == 2 ? count : 1;
+        for (c = word; *c && (*c == '?' || lm_sym(*c) != '?' - ' '); c++)
+            ;
+        if (*c)
+            continue;   /* outside the alphabet */
+        bn[0].count += count;
+        for (c = word, node = 0, h1 = h2 = 0; *c; c++, node = *link) {
+            if (nb == cap) {
+                if ((grow = realloc(bn, cap * 2 * sizeof(*bn))) == NULL)
+                    goto nomem;
+                bn = grow;
+                cap *= 2;
+            }
+            s = lm_sym(*c);
+            for (link = &bn[node].child; *link >= 0 && bn[*link].sym < s; link = &bn[*link].sibling)
+                ;
+            if (*link < 0 || bn[*link].sym != s) {
+                memset(&bn[nb], 0, sizeof(bn[nb]));
+                bn[nb].child = -1;
+                bn[nb].sibling = *link;
+                bn[nb].sym = s;
+                *link = nb++;
+            }
+            bn[*link].count += count;
+            tri[(h2 * LM_SYMS + h1) * LM_SYMS + s] += count;
+            h2 = h1;
+            h1 = s;
+        }
+        bn[node].ends += count;
+        tri[(h2 * LM_SYMS + h1) * LM_SYMS] += count;
+        words++;
+    }
+    if (!words) {
+        printf("[!] No words in %s.\n", list);
+        goto out;
+    }
+    /* each order smoothed towards the one below by LM_K of its mass */
+    for (h2 = 0; h2 < LM_SYMS; h2++)
+        for (h1 = 0; h1 < LM_SYMS; h1++)
+            for (s = 0; s < LM_SYMS; s++)
+                bi[h1 * LM_SYMS + s] += tri[(h2 * LM_SYMS + h1) * LM_SYMS + s];
+    for (h1 = 0; h1 < LM_SYMS; h1++)
+        for (s = 0; s < LM_SYMS; s++) {
+            n2[h1] += bi[h1 * LM_SYMS + s];
+            uni[s] += bi[h1 * LM_SYMS + s];
+            total += bi[h1 * LM_SYMS + s];
+        }
+    for (h2 = 0; h2 < LM_SYMS; h2++)
+        for (h1 = 0; h1 < LM_SYMS; h1++) {
+            for (s = 0, n3 = 0; s < LM_SYMS; s++)
+                n3 += tri[(h2 * LM_SYMS + h1) * LM_SYMS + s];
+            for (s = 0; s < LM_SYMS; s++) {
+                p1 = (uni[s] + 1) / (total + LM_SYMS);
+                p2 = (bi[h1 * LM_SYMS + s] + LM_K * p1) / (n2[h1] + LM_K);
+                p3 = (tri[(h2 * LM_SYMS + h1) * LM_SYMS + s] + LM_K * p2) / (n3 + LM_K);
+                cost[(h2 * LM_SYMS + h1) * LM_SYMS + s] = lm_cost(p3);
+            }
+        }
+    /* lay the trie out breadth first */
+    order = malloc(nb * sizeof(*order));
+    first = malloc((nb + 1) * sizeof(*first));
+    if (!order || !first)
+        goto nomem;
+    order[0] = 0;
+    for (head = 0, tail = 1; head < nb; head++) {
+        first[head] = tail;
+        for (node = bn[order[head]].child; node >= 0; node = bn[node].sibling) {
+            bn[node].cost = lm_cost(bn[node].count / bn[order[head]].count);
+            order[tail++] = node;
+        }
+    }
+    first[nb] = tail;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LM_MAGIC, sizeof(hdr.magic));
+    hdr.words = words;
+    hdr.nodes = nb;
+    hdr.trigram = sizeof(hdr);
+    hdr.trie = hdr.trigram + tri_size;
+    hdr.size = hdr.trie + nb * sizeof(ln);
+    if ((fout = fopen(path, "wb")) == NULL) {
+        printf("[!] Unable to write language model %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fout);
+    fwrite(cost, tri_size, 1, fout);
+    for (head = 0; head < nb; head++) {
+        ln.child = first[head];
+        ln.nchild = first[head + 1] - first[head];
+        ln.sym = bn[order[head]].sym;
+        ln.cost = bn[order[head]].cost;
+        ln.end = bn[order[head]].ends > 0 ? lm_cost(bn[order[head]].ends / bn[order[head]].count) : LM_NONE;
+        fwrite(&ln, sizeof(ln), 1, fout);
+    }
+    if (ferror(fout) | fclose(fout)) {
+        printf("[!] Unable to write language model %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    printf("[+] Language model of %u words, %u trie nodes, %.1f KiB in %s.\n", words, nb, hdr.size / 1024.0, path);
+    err = 0;
+    goto out;
+nomem:
+    printf("[!] No enough memory. Error code: language model\n");
+out:
+    fclose(fin);
+    free(tri);
+    free(bi);
+    free(cost);
+    free(bn);
+    free(order);
+    free(first);
+    return err;
+}
+
+/* map the model at path into m */
+static int lm_open(const char *path, struct lm *m)
+{
+    const struct lm_header *h;
+    const struct lm_node *node;
+    struct stat st;
+    void *base;
+    uint32_t i;
+    int fd;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        printf("[!] Unable to open language model %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    base = st.st_size >= (off_t)sizeof(*h) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("[!] %s is not a language model.\n", path);
+        return -1;
+    }
+    h = base;
+    node = (const struct lm_node *)((const unsigned char *)base + h->trie);
+    i = memcmp(h->magic, LM_MAGIC, sizeof(h->magic)) || h->size != st.st_size || h->trigram != sizeof(*h) ||
+        h->trie != h->trigram + LM_SYMS * LM_SYMS * LM_SYMS || !h->nodes ||
+        (uint64_t)h->trie + (uint64_t)h->nodes * sizeof(*node) != h->size ? 0 : h->nodes;
+    if (i) {
+        /* every child after its parent and inside the trie, so lookups can't run off or loop */
+        for (i = 0; i < h->nodes; i++)
+            if (node[i].nchild && (node[i].child <= i || node[i].child + node[i].nchild > h->nodes))
+                break;
+    }
+    if (i != h->nodes || !i) {
+        munmap(base, st.st_size);
+        printf("[!] %s is not a language model.\n", path);
+        return -1;
+    }
+    m->base = base;
+    m->size = st.st_size;
+    m->tri = (const uint8_t *)base + h->trigram;
+    m->node = node;
+    m->nodes = h->nodes;
+    m->words = h->words;
+    return 0;
+}
+
+static void lm_close(struct lm *m)
+{
+    if (m->base)
+        munmap((void *)m->base, m->size);
+    m->base = NULL;
+}
+
+/*
+ *   Beam search decoder (--beam)
+ *
+ *   Marks and gaps are noisy observations of elements: the cost of a
+ *   reading is its squared log distance from the decoder's centre of
+ *   that element, the learned ones with --adaptive, else placed so the
+ *   fixed thresholds fall half way between them, so without a model
+ *   the beam splits elements where the greedy decoder does.  Every mark
+ *   extends a hypothesis by a dit and by a dah, every gap by one more
+ *   element, the end of a character or the end of a word, and a
+ *   character or word that ends pays its cost in the model.
+ *   Hypotheses in the same state (character so far, trie node, two
+ *   symbols of history, callsign shape) are merged, keeping the
+ *   cheaper, and only the best --beam of them are kept, so a span costs
+ *   a bounded amount of work and the beam never allocates.
+ *
+ *   Text goes out as soon as all hypotheses agree on it, a word at a
+ *   time from the best one if they hold back too much, and all of the
+ *   best one once the key has been up for a word gap.  The error sign
+ *   wipes the word under way.
+ */
+#define BEAM_MAX 64
+#define BEAM_TEXT 48            /* characters a hypothesis holds back */
+#define BEAM_SIGMA 0.2          /* spread of log durations around an element */
+#define BEAM_FLAT 5.3           /* bits of a character without a model, about log2(40) */
+#define BEAM_OOV 14.0           /* bits for ending a word the trie does not know */
+#define BEAM_CALL 6.0           /* ... if it is shaped like a callsign */
+#define BEAM_UNKNOWN 16.0       /* a code that is no character */
+
+struct beam_hyp {
+    float cost;             /* bits */
+    unsigned short code;    /* the character under way, packed */
+    unsigned char len;
+    unsigned char h1, h2;   /* last two symbols */
+    unsigned char n;        /* characters in text */
+    unsigned short call;    /* lm_call_step() state of the word */
+    int node;               /* trie node of the word, -1 off the trie */
+    char text[BEAM_TEXT];
+};
+
+struct beam_rank {
+    float cost;
+    int cand;
+};
+
+struct beam {
+    struct beam_hyp hyp[BEAM_MAX];
+    struct beam_hyp cand[BEAM_MAX * 3];
+    struct beam_rank rank[BEAM_MAX * 3];
+    int count, width;
+    int closed;             /* the key has been up for a word gap since the last mark */
+    const struct lm *lm;
+};
+
+static int beam_width = 0;      /* --beam */
+
+static void beam_init(struct beam *b, int width, const struct lm *m)
+{
+    memset(&b->hyp[0], 0, sizeof(b->hyp[0]));
+    b->hyp[0].code = 1;
+    b->hyp[0].call = LM_CALL_START;
+    b->count = 1;
+    b->width = width < 1 ? 1 : width > BEAM_MAX ? BEAM_MAX : width;
+    b->closed = 1;
+    b->lm = m;
+}
+
+/* bits for c after the hypothesis so far, moving it on */
+static float beam_lm_char(const struct lm *m, struct beam_hyp *h, int c)
+{
+    const struct lm_node *nd;
+    int s = lm_sym(c), i;
+    float bits = BEAM_FLAT;
+    h->call = lm_call_step(h->call, s + ' ');
+    if (m->base) {
+        bits = m->tri[(h->h2 * LM_SYMS + h->h1) * LM_SYMS + s] / (float)LM_SCALE;
+        if (h->node >= 0) {
+            nd = &m->node[h->node];
+            for (i = 0; i < nd->nchild && m->node[nd->child + i].sym < s; i++)
+                ;
+            h->node = i < nd->nchild && m->node[nd->child + i].sym == s ? (int)nd->child + i : -1;
+            bits = h->node >= 0 ? m->node[h->node].cost / (float)LM_SCALE : bits;
+        }
+        if (h->node < 0 && h->call && bits > BEAM_FLAT)
+            bits = BEAM_FLAT;
+    }
+    h->h2 = h->h1;
+    h->h1 = s;
+    return bits;
+}
+
+/* bits for ending the word here */
+static float beam_lm_end(const struct lm *m, struct beam_hyp *h)
+{
+    float bits = 0;
+    if (m->base && h->h1) {
+        if (h->node >= 0 && m->node[h->node].end != LM_NONE)
+            bits = m->node[h->node].end / (float)LM_SCALE;
+        else
+            bits = m->tri[(h->h2 * LM_SYMS + h->h1) * LM_SYMS] / (float)LM_SCALE +
+                   (h->call & LM_CALL_ACCEPT ? BEAM_CALL : BEAM_OOV);
+    }
+    h->node = 0;
+    h->call = LM_CALL_START;
+    h->h2 = h->h1;
+    h->h1 = 0;
+    return bits;
+}
+
+/* close the character under way */
+static void beam_char(const struct lm *m, struct beam_hyp *h)
+{
+    const char *t = cw_decode[h->code];
+    if (h->len > CW_MAXLEN || cw_is_error(h->code, h->len)) {
+        h->cost += BEAM_UNKNOWN;
+        while (h->n && h->text[h->n - 1] != ' ')
+            h->n--;
+        h->node = 0;
+        h->call = LM_CALL_START;
+        h->h1 = 0;
+        t = "";
+    } else if (!t) {
+        h->cost += BEAM_UNKNOWN;
+        t = "?";
+    }
+    for (; *t && h->n < BEAM_TEXT - 1; t++) {
+        h->cost += beam_lm_char(m, h, (unsigned char)*t);
+        h->text[h->n++] = *t;
+    }
+    h->code = 1;
+    h->len = 0;
+}
+
+static void beam_word(const struct lm *m, struct beam_hyp *h)
+{
+    h->cost += beam_lm_end(m, h);
+    if (h->n && h->n < BEAM_TEXT - 1 && h->text[h->n - 1] != ' ')
+        h->text[h->n++] = ' ';
+}
+
+/* bits for a span of usec read as an element centred on centre, none past it if open */
+static float beam_cost(int usec, int centre, int open)
+{
+    double x = log((usec > 0 ? usec : 1) / (double)(centre > 0 ? centre : 1));
+    return open && x > 0 ? 0 : x * x / (2 * BEAM_SIGMA * BEAM_SIGMA) * M_LOG2E;
+}
+
+static int beam_order(const void *a, const void *b)
+{
+    float d = ((const struct beam_rank *)a)->cost - ((const struct beam_rank *)b)->cost;
+    return (d > 0) - (d < 0);
+}
+
+static int beam_same(const struct beam_hyp *a, const struct beam_hyp *b)
+{
+    return a->code == b->code && a->len == b->len && a->node == b->node &&
+           a->h1 == b->h1 && a->h2 == b->h2 && a->call == b->call;
+}
+
+/* emit the first len characters of the best hypothesis, dropping those that disagree */
+static void beam_emit(struct beam *b, int len, FILE *out)
+{
+    char lead[BEAM_TEXT];
+    int i, k, chars = 0;
+    memcpy(lead, b->hyp[0].text, len);
+    for (i = 0; i < len; i++)
+        chars += lead[i] != ' ';
+    if (out) {
+        fwrite(lead, 1, len, out);
+        fflush(out);
+    }
+    STATS_ADD(chars, chars);
+    for (i = k = 0; i < b->count; i++) {
+        if (b->hyp[i].n < len || memcmp(b->hyp[i].text, lead, len))
+            continue;
+        b->hyp[k] = b->hyp[i];
+        b->hyp[k].n -= len;
+        memmove(b->hyp[k].text, b->hyp[k].text + len, b->hyp[k].n);
+        k++;
+    }
+    b->count = k;
+}
+
+/* keep the best width of n candidates, then put out what they agree on */
+static void beam_select(struct beam *b, int n, FILE *out)
+{
+    const struct beam_hyp *c;
+    int i, k, common, space;
+    float base;
+    for (i = 0; i < n; i++) {
+        b->rank[i].cost = b->cand[i].cost;
+        b->rank[i].cand = i;
+    }
+    qsort(b->rank, n, sizeof(b->rank[0]), beam_order);
+    for (i = b->count = 0; i < n && b->count < b->width; i++) {
+        c = &b->cand[b->rank[i].cand];
+        for (k = 0; k < b->count && !beam_same(&b->hyp[k], c); k++)
+            ;
+        if (k == b->count)
+            b->hyp[b->count++] = *c;
+    }
+    for (i = 0, base = b->hyp[0].cost; i < b->count; i++)
+        b->hyp[i].cost -= base;
+    for (common = b->hyp[0].n, i = 1; i < b->count && common; i++)
+        for (k = 0; k < common; k++)
+            if (k >= b->hyp[i].n || b->hyp[i].text[k] != b->hyp[0].text[k]) {
+                common = k;
+                break;
+            }
+    if (common)
+        beam_emit(b, common, out);
+    for (i = k = 0; i < b->count; i++)
+        k = b->hyp[i].n > k ? b->hyp[i].n : k;
+    if (k >= BEAM_TEXT - 10) {
+        /* held back too long: settle the best one's first word */
+        for (space = 0; space < b->hyp[0].n && b->hyp[0].text[space] != ' '; space++)
+            ;
+        beam_emit(b, space < b->hyp[0].n ? space + 1 : b->hyp[0].n, out);
+    }
+}
+
+static void beam_mark(struct decoder *dec, int usec)
+{
+    struct beam *b = dec->beam;
+    struct beam_hyp *c;
+    float cost[2];
+    int i, dah, n = 0;
+    cost[0] = beam_cost(usec, dec->adaptive ? dec->mark[0] : dec->thr_dida / 1.732, 0);
+    cost[1] = beam_cost(usec, dec->adaptive ? dec->mark[1] : dec->thr_dida * 1.732, 1);
+    b->closed = 0;
+    for (i = 0; i < b->count; i++) {
+        if (b->hyp[i].len >= CW_MAXLEN)
+            continue;
+        for (dah = 0; dah < 2; dah++) {
+            c = &b->cand[n++];
+            *c = b->hyp[i];
+            c->code = c->code * 2 + dah;
+            c->len++;
+            c->cost += cost[dah];
+        }
+    }
+    if (n == 0) {
+        /* longer than any character: start over from the best */
+        beam_char(b->lm, &b->hyp[0]);
+        b->count = 1;
+        beam_mark(dec, usec);
+        return;
+    }
+    beam_select(b, n, dec->out);
+}
+
+static void beam_space(struct decoder *dec, int usec)
+{
+    struct beam *b = dec->beam;
+    struct beam_hyp *c;
+    float cost[3];
+    double g1 = dec->thr_char * 1.732;
+    int i, n = 0;
+    if (b->closed)
+        return;
+    /* fixed centres as far each side of a threshold as the one across it */
+    cost[0] = beam_cost(usec, dec->adaptive ? dec->space[0] : dec->thr_char / 1.732, 0);
+    cost[1] = beam_cost(usec, dec->adaptive ? dec->space[1] : g1, 0);
+    cost[2] = beam_cost(usec, dec->adaptive ? dec->space[2] : dec->thr_space / g1 * dec->thr_space, 1);
+    for (i = 0; i < b->count; i++) {
+        c = &b->cand[n++];
+        *c = b->hyp[i];
+        c->cost += cost[0];
+        c = &b->cand[n++];
+        *c = b->hyp[i];
+        c->cost += cost[1];
+        beam_char(b->lm, c);
+        c = &b->cand[n++];
+        *c = b->hyp[i];
+        c->cost += cost[2];
+        beam_char(b->lm, c);
+        beam_word(b->lm, c);
+    }
+    beam_select(b, n, dec->out);
+}
+
+/* the key has been up for a word gap: settle on the best hypothesis */
+static void beam_finish(struct decoder *dec)
+{
+    struct beam *b = dec->beam;
+    int i;
+    for (i = 0; i < b->count; i++) {
+        b->cand[i] = b->hyp[i];
+        if (b->cand[i].len)
+            beam_char(b->lm, &b->cand[i]);
+        beam_word(b->lm, &b->cand[i]);
+    }
+    beam_select(b, b->count, dec->out);
+    beam_emit(b, b->hyp[0].n, dec->out);
+    b->count = 1;
+    b->closed = 1;
+}
+
+/* decode dec's spans through b from now on */
+static void decoder_beam(struct decoder *dec, struct beam *b)
+{
+    beam_init(b, beam_width, &lm);
+    dec->beam = b;
+}
+
+static void decoder_span(struct decoder *dec, const struct key_span *ev)
+{
+    struct live_conf conf;
+    int dah;
+    STATS_ADD(spans, 1);
+    if (!dec->adaptive && live_poll(&dec->seen, &conf)) {
+        /* the speed was changed, val_* went with it */
+        dec->thr_dida = val_dida;
+        dec->thr_char = val_char;
+        dec->thr_space = val_space;
+    }
+    if (!ev->mark) {
+        /* a pause is not a gap of the keying */
+        if (dec->beam && ev->usec > 0)
+            beam_space(dec, ev->usec);
+        if (dec->adaptive && ev->usec > 0 && ev->usec < dec->space[2] * 2)
+            decoder_learn_gap(dec, ev->usec);
+        dec->up = 0;
+        return;
+    }
+    dah = ev->usec >= dec->thr_dida;
+    stats_hist(HIST_ELEMENT, ev->usec - (dec->adaptive ? dec->mark[dah] : dah ? usec_DA : usec_DI));
+    if (dec->beam)
+        beam_mark(dec, ev->usec);
+    if (dec->adaptive)
+        decoder_learn_mark(dec, ev->usec, dah);
+    dec->up = ev->end;
+    if (dec->beam)
+        return;
+    dec->len++;
+    if (dec->len <= CW_MAXLEN)
+        dec->code = dec->code * 2 + dah;
+}
+
+/* time the pending character or word gap completes, -1 if nothing is pending */
+static int64_t decoder_deadline(const struct decoder *dec)
+{
+    if (!dec->up)
+        return -1;
+    if (dec->beam)
+        return dec->beam->closed ? -1 : dec->up + dec->thr_space;
+    if (dec->len)
+        return dec->up + dec->thr_char;
+    return dec->word ? dec->up + dec->thr_space : -1;
+}
+
+static void decoder_tick(struct decoder *dec, int64_t now)
+{
+    if (!dec->up)
+        return;
+    if (dec->beam) {
+        if (!dec->beam->closed && now - dec->up >= dec->thr_space) {
+            beam_finish(dec);
+            if (dec->adaptive)
+                __atomic_store_n(&decoder_wpm, decoder_speed(dec), __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    if (dec->len && now - dec->up >= dec->thr_char) {
+        if (!dec->out) {
+        } else if (dec->len > CW_MAXLEN || cw_is_error(dec->code, dec->len)) {
+            fputs(" correction-> ", dec->out);
+        } else {
+            fputs(cw_decode[dec->code] ? cw_decode[dec->code] : "?", dec->out);
+        }
+        dec->len = 0;
+        dec->code = 1;
+        dec->word = 1;
+        STATS_ADD(chars, 1);
+        if (dec->adaptive)
+            __atomic_store_n(&decoder_wpm, decoder_speed(dec), __ATOMIC_RELAXED);
+        if (dec->out)
+            fflush(dec->out);
+    }
+    if (dec->word && now - dec->up >= dec->thr_space) {
+        if (dec->out) {
+            fputc(' ', dec->out);
+            fflush(dec->out);
+        }
+        dec->word = 0;
+    }
+}
+
+/*
+ *   Open key device [num], asking for sudo once; -1 if it can't be read
+ */
+static int key_open(int num)
+{
+    char access_KB[96], full_INPUT[64];
+    int fd = -1, clk = CLOCK_MONOTONIC;
+    sprintf(full_INPUT,"%s%d",INPUT_KEYBOARD,num);
+    if((fd = open(full_INPUT, O_RDONLY)) < 0) {
+        sprintf(access_KB,"%s%s","sudo chmod +r ",full_INPUT);
+        printf("LinuxCW needs sudo to access your keyboard input.\n");
+        system(access_KB);
+        if((fd = open(full_INPUT, O_RDONLY)) < 0) {
+        printf("[!] cannot access keyboard, error:%d\n", errno);
+        return -1;}
+        printf("Validated!\n");
+    }
+    if (ioctl(fd, EVIOCSCLOCKID, &clk) == 0)
+        key_clock = CLOCK_MONOTONIC;
+    return fd;
+}
+
+/* what a key does: PADDLE_STRAIGHT, a paddle with the keyer on, 0 for ENTER and ESC */
+static int key_role(int code)
+{
+    if ((code==0x1C) || (code==0x01))
+        return 0;
+    if (keyer_on && code == paddle_code[0])
+        return PADDLE_DIT;
+    if (keyer_on && code == paddle_code[1])
+        return PADDLE_DAH;
+    return PADDLE_STRAIGHT;
+}
+
+/*
+ *   Key recording (--record)
+ *
+ *   Every paddle and straight key transition key_event() follows is
+ *   appended to a log as one LEB128 varint: microseconds since the
+ *   transition before, shifted left by three, over two bits of role
+ *   (1 dit paddle, 2 dah paddle, 3 straight key) and one of key down.
+ *   The key thread writes the bytes straight into a shared mapping of
+ *   the file that slides along in RECORD_WINDOW steps, so a transition
+ *   costs a few stores and a remap every few thousand.  A record never
+ *   starts with a zero byte, so the zeros past the last one end the log
+ *   even if the session dies before record_finish() truncates the file.
+ */
+#define RECORD_MAGIC "LCWKEYS1"
+#define RECORD_WINDOW 65536     /* bytes mapped at once, a multiple of the page size */
+
+struct record_header {
+    char magic[8];
+    int64_t started;        /* wall clock at the start, usec */
+    int32_t wpm;            /* -w, the keyer speed with a keyer */
+    int32_t keyer;          /* 'A' or 'B' with --iambic, else 0 */
+    int32_t reserved[4];
+};
+
+struct key_record {
+    int fd;
+    unsigned char *map;     /* the window, NULL when not recording */
+    off_t base;             /* file offset of the window */
+    size_t pos;             /* next byte in the window */
+    int64_t last;           /* time of the last transition, 0 before the first */
+    unsigned int events;
+    volatile int on, busy;  /* record_finish() waits out a writer */
+    const char *path;
+};
+
+static struct key_record key_record = { -1, NULL, 0, 0, 0, 0, 0, 0, NULL };
+
+/* move the window on to the page holding pos */
+static int record_slide(struct key_record *rec)
+{
+    off_t base = (rec->base + rec->pos) & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    munmap(rec->map, RECORD_WINDOW);
+    rec->pos = rec->base + rec->pos - base;
+    rec->base = base;
+    if (ftruncate(rec->fd, base + RECORD_WINDOW) < 0 ||
+        (rec->map = mmap(NULL, RECORD_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fd, base)) == MAP_FAILED) {
+        rec->map = NULL;
+        printf("[!] Key recording stopped: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* append a transition of a PADDLE_* key at t, usec on key_clock */
+static void record_put(struct key_record *rec, int role, int down, int64_t t)
+{
+    uint64_t v;
+    __atomic_store_n(&rec->busy, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rec->on, __ATOMIC_SEQ_CST) && rec->map &&
+        (rec->pos + 10 <= RECORD_WINDOW || record_slide(rec) == 0)) {
+        v = rec->last && t > rec->last ? t - rec->last : 0;
+        v = v << 3 | (role == PADDLE_STRAIGHT ? 3 : role) << 1 | !!down;
+        rec->last = t;
+        do {
+            rec->map[rec->pos++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+            v >>= 7;
+        } while (v);
+        rec->events++;
+    }
+    __atomic_store_n(&rec->busy, 0, __ATOMIC_RELEASE);
+}
+
+static void record_finish(void)
+{
+    struct key_record *rec = &key_record;
+    __atomic_store_n(&rec->on, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&rec->busy, __ATOMIC_SEQ_CST))
+        sched_yield();
+    if (rec->map) {
+        munmap(rec->map, RECORD_WINDOW);
+        rec->map = NULL;
+        if (ftruncate(rec->fd, rec->base + rec->pos) == 0)
+            printf("[-] %u key events recorded to %s.\n", rec->events, rec->path);
+    }
+    if (rec->fd >= 0)
+        close(rec->fd);
+    rec->fd = -1;
+}
+
+/* start recording to path, with the settings a replay needs */
+static int record_start(const char *path, int wpm)
+{
+    struct key_record *rec = &key_record;
+    struct record_header *h;
+    if ((rec->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+        ftruncate(rec->fd, RECORD_WINDOW) < 0 ||
+        (rec->map = mmap(NULL, RECORD_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fd, 0)) == MAP_FAILED) {
+        printf("[!] Unable to record keying to %s: %s\n", path, strerror(errno));
+        if (rec->fd >= 0)
+            close(rec->fd);
+        rec->fd = -1;
+        rec->map = NULL;
+        return -1;
+    }
+    h = (struct record_header *)rec->map;
+    memcpy(h->magic, RECORD_MAGIC, sizeof(h->magic));
+    h->started = (int64_t)time(NULL) * 1000000;
+    h->wpm = keyer_on ? keyer_wpm : wpm;
+    h->keyer = keyer_on ? keyer_mode : 0;
+    rec->pos = sizeof(*h);
+    rec->path = path;
+    rec->on = 1;
+    atexit(record_finish);
+    return 0;
+}
+
+/*
+ *   Follow one evdev event: OnWav, and the span it closes onto key_ring;
+ *   with the keyer on only the paddle bits, the keyer times the rest
+ */
+static void key_event(const struct input_event *ev, int64_t *down, int64_t *up)
+{
+    int64_t t;
+    int role;
+    if (ev->type != EV_KEY || !(role = key_role(ev->code)))
+        return;
+    t = ev->input_event_sec * 1000000LL + ev->input_event_usec;
+    if (key_record.on && ev->value < 2)
+        record_put(&key_record, role, ev->value, t);
+    if (keyer_on) {
+        if (ev->value) {
+            __atomic_or_fetch(&paddle_state, role, __ATOMIC_RELEASE);
+            __atomic_or_fetch(&paddle_taps, role, __ATOMIC_RELEASE);
+            key_wake();
+        } else
+            __atomic_and_fetch(&paddle_state, ~role, __ATOMIC_RELEASE);
+        return;
+    }
+    if(!OnWav && ev->value && (ev->code!=0x1C) && (ev->code!=0x01)){
+        OnWav = 1;key_wake();
+        key_ring_push(&key_ring, 0, t, *up ? t - *up : 0);
+        *down = t;
+    }
+    if(ev->value == 0 && OnWav){
+        OnWav = 0;
+        key_ring_push(&key_ring, 1, t, t - *down);
+        *up = t;
+    }
+}
+
+/* open every key device, the fds at fd and, unless NULL, their event numbers at num; how many opened */
+static int key_open_all(int *fd, int *num)
+{
+    int i, n = 0;
+    for (i = 0; i < key_devices; i++)
+        if ((fd[n] = key_open(key_device[i])) >= 0) {
+            if (num)
+                num[n] = key_device[i];
+            n++;
+        }
+    return n;
+}
+
+void * KeyDaemon_CW()
+{
+    struct pollfd pfd[KEY_MAX_DEVICES];
+    int fd[KEY_MAX_DEVICES], num[KEY_MAX_DEVICES], n, i, ret = -1;
+    int64_t down = 0, up = 0;
+    struct input_event ev;
+    rt_enter(&rt_key);
+    if ((n = key_open_all(fd, num)) == 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        pfd[i].fd = fd[i];
+        pfd[i].events = POLLIN;
+    }
+    KeyEventAccess = 1;
+    sleep(1);
+    stats_enter("key");
+    while(n > 0) {
+        if (poll(pfd, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = n - 1; i >= 0; i--) {
+            if (!pfd[i].revents)
+                continue;
+            memset(&ev, 0, sizeof(struct input_event));
+
+            ret = read(pfd[i].fd, &ev, sizeof(struct input_event));
+            if (ret != sizeof(struct input_event)) {
+                printf("[!] Key device %s%d read failed: %s\n", INPUT_KEYBOARD, num[i],
+                       ret < 0 ? strerror(errno) : ret == 0 ? "end of file" : "short event");
+                close(pfd[i].fd);
+                num[i] = num[n - 1];
+                pfd[i] = pfd[--n];
+                continue;
+            }
+            key_event(&ev, &down, &up);
+        }
+    }
+    stats_leave();
+    return 0;
+}
+
+void * PrintDaemon()
+{
+    struct decoder dec;
+    struct beam beam;
+    struct key_span ev;
+    struct pollfd pfd = { decode_wake_fd, POLLIN, 0 };
+    struct timespec ts;
+    uint64_t wakes;
+    int64_t due;
+    decoder_reset(&dec, decode_adaptive, stdout);
+    if (beam_width)
+        decoder_beam(&dec, &beam);
+    stats_enter("decode");
+    while(!m_Interrupt){
+        while (key_ring_pop(&key_ring, &ev) == 0)
+            decoder_span(&dec, &ev);
+        decoder_tick(&dec, key_now());
+        if ((due = decoder_deadline(&dec)) >= 0)
+            due = due - key_now() > 0 ? due - key_now() : 0;
+        else if (decode_wake_fd < 0)
+            due = 5000;     /* no eventfd, fall back to polling */
+        if (due >= 0) {
+            ts.tv_sec = due / 1000000;
+            ts.tv_nsec = due % 1000000 * 1000;
+        }
+        if (ppoll(&pfd, 1, due >= 0 ? &ts : NULL, NULL) > 0 && read(decode_wake_fd, &wakes, sizeof(wakes)) < 0)
+            break;
+    }
+    stats_leave();
+    if (dec.adaptive)
+        printf("\n[-] Keying speed about %d WPM.\n", decoder_speed(&dec));
+    return 0;
+}
+
+/*
+ *   Key replay (--replay, --replay-fast)
+ *
+ *   A recording is mapped read-only and its transitions go through
+ *   key_event() again as if keyed on a paddle or straight key, with the
+ *   keyer speed and mode it was made with.  --replay does it at the pace
+ *   it was keyed, through the sidetone and decoder of a keying session.
+ *   --replay-fast puts key_now() on a virtual clock that jumps from one
+ *   transition to the next, running the keyer for paddles without a
+ *   sound device, and decodes as fast as that goes.
+ */
+#define REPLAY_CHUNK 256        /* keyer frames between decoder runs */
+#define REPLAY_START 1000000    /* virtual clock at the start, usec */
+
+struct key_log {
+    const unsigned char *base;
+    size_t size;
+    const struct record_header *hdr;
+};
+
+static struct key_log key_log;
+static const char *replay_path = NULL;      /* --replay, --replay-fast */
+static int replay_fast = 0;
+
+static int key_log_open(const char *path, struct key_log *log)
+{
+    struct stat st;
+    void *base;
+    int fd;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        printf("[!] Unable to open key recording %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    base = st.st_size >= (off_t)sizeof(*log->hdr) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED || memcmp(base, RECORD_MAGIC, 8) ||
+        ((const struct record_header *)base)->wpm < 5 || ((const struct record_header *)base)->wpm > 99) {
+        if (base != MAP_FAILED)
+            munmap(base, st.st_size);
+        printf("[!] %s is not a key recording.\n", path);
+        return -1;
+    }
+    log->base = base;
+    log->size = st.st_size;
+    log->hdr = base;
+    return 0;
+}
+
+/* the transition at *pos onto *t, *role and *down; -1 at the end */
+static int key_log_next(const struct key_log *log, size_t *pos, int64_t *t, int *role, int *down)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    if (*pos >= log->size || log->base[*pos] == 0)
+        return -1;
+    do {
+        if (*pos >= log->size || shift > 63)
+            return -1;
+        v |= (uint64_t)(log->base[*pos] & 0x7f) << shift;
+        shift += 7;
+    } while (log->base[(*pos)++] & 0x80);
+    *t += v >> 3;
+    *role = (v >> 1 & 3) == 3 ? PADDLE_STRAIGHT : v >> 1 & 3;
+    *down = v & 1;
+    return 0;
+}
+
+/* key_event() for a recorded transition at t */
+static void replay_event(int role, int down, int64_t t, int64_t *dn, int64_t *up)
+{
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.input_event_sec = t / 1000000;
+    ev.input_event_usec = t % 1000000;
+    ev.type = EV_KEY;
+    ev.value = down;
+    if (role == PADDLE_DIT || role == PADDLE_DAH)
+        ev.code = paddle_code[role - 1];
+    else
+        ev.code = paddle_code[0] != KEY_SPACE && paddle_code[1] != KEY_SPACE ? KEY_SPACE : KEY_B;
+    key_event(&ev, dn, up);
+}
+
+/* the keying session's KeyDaemon_CW, taking the keys from key_log at 1x */
+void * ReplayDaemon()
+{
+    struct timespec ts;
+    size_t pos = sizeof(*key_log.hdr);
+    int64_t t = 0, base, down = 0, up = 0;
+    unsigned int n = 0;
+    int role, dn;
+    rt_enter(&rt_key);
+    key_clock = CLOCK_MONOTONIC;
+    KeyEventAccess = 1;
+    sleep(1);
+    stats_enter("replay");
+    base = key_now();
+    while (!m_Interrupt && key_log_next(&key_log, &pos, &t, &role, &dn) == 0) {
+        ts.tv_sec = (base + t) / 1000000;
+        ts.tv_nsec = (base + t) % 1000000 * 1000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+        replay_event(role, dn, base + t, &down, &up);
+        n++;
+    }
+    stats_leave();
+    if (!m_Interrupt) {
+        /* let the last character and word out, then end the session */
+        usleep(2 * val_space + 500000);
+        printf("\n[-] Replayed %u key events, %.1f s.\n", n, t / 1e6);
+    }
+    OnWav = 0;
+    m_Interrupt = 1;
+    key_wake();
+    decode_wake();
+    return 0;
+}
+
+/* decode what key_ring holds, ticking the decoder up to each span */
+static void replay_drain(struct decoder *dec)
+{
+    struct key_span span;
+    int64_t due;
+    while (key_ring_pop(&key_ring, &span) == 0) {
+        while ((due = decoder_deadline(dec)) >= 0 && due <= span.end)
+            decoder_tick(dec, due);
+        decoder_span(dec, &span);
+    }
+}
+
+/* run the virtual clock, and the keyer with it, up to target */
+static void replay_advance(struct decoder *dec, int64_t target, float *buf)
+{
+    int64_t frames, due;
+    while (keyer_on && (key_replay_clock = REPLAY_START + (int64_t)(keyer.clock * 1000000 / rate)) < target) {
+        frames = (target - key_replay_clock) * rate / 1000000 + 1;
+        keyer_render(&keyer, buf, frames < REPLAY_CHUNK ? frames : REPLAY_CHUNK);
+        replay_drain(dec);
+    }
+    key_replay_clock = target;
+    replay_drain(dec);
+    while ((due = decoder_deadline(dec)) >= 0 && due <= target)
+        decoder_tick(dec, due);
+}
+
+static int ReplayFast(void)
+{
+    struct decoder dec;
+    struct beam beam;
+    float buf[REPLAY_CHUNK];
+    size_t pos = sizeof(*key_log.hdr);
+    int64_t t = 0, down = 0, up = 0;
+    unsigned int n = 0;
+    int role, dn;
+    double t0 = mono_time();
+    if (keyer_on) {
+        /* thresholds as a keyer session sets them */
+        val_dida = val_char = 2 * 1200000 / keyer_wpm;
+        val_space = 5 * 1200000 / keyer_wpm;
+        keyer_init(&keyer, rate);
+    }
+    decoder_reset(&dec, decode_adaptive, stdout);
+    if (beam_width)
+        decoder_beam(&dec, &beam);
+    key_replay_clock = REPLAY_START;
+    stats_enter("replay");
+    while (key_log_next(&key_log, &pos, &t, &role, &dn) == 0) {
+        replay_advance(&dec, REPLAY_START + t, buf);
+        replay_event(role, dn, REPLAY_START + t, &down, &up);
+        n++;
+    }
+    replay_advance(&dec, REPLAY_START + t + 2 * val_space + 1000000, buf);
+    stats_leave();
+    key_replay_clock = -1;
+    printf("\n[-] Replayed %u key events, %.1f s of keying in %.3f s.\n", n, t / 1e6, mono_time() - t0);
+    if (dec.adaptive)
+        printf("[-] Keying speed about %d WPM.\n", decoder_speed(&dec));
+    return 0;
+}
+
+/*
+ *   Open the playback device for transfer mode [method] of --method,
+ *   falling back to plain write access; the transfer method used, or -1
+ */
+static int sound_open(snd_pcm_t **handle, int method)
+{
+    int err, m = transfer_find(transfer_name) + method;
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_hw_params_alloca(&hwparams);
+    snd_pcm_sw_params_alloca(&swparams);
+    
+    if ((err = snd_output_stdio_attach(&output, stdout, 0)) < 0) {
+        printf("[!] Output failed: %s\n", snd_strerror(err));
+        return -1;
+    }
+    if ((err = snd_pcm_open(handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+        printf("[!] Playback open error: %s\n", snd_strerror(err));
+        return -1;
+    }
+    
+    if ((err = set_hwparams(*handle, hwparams, transfer_methods[m].access)) < 0 && m != method) {
+        printf("[!] Device refused %s access, falling back to %s.\n", transfer_methods[m].name, transfer_methods[method].name);
+        m = method;
+        err = set_hwparams(*handle, hwparams, transfer_methods[m].access);
+    }
+    if (err < 0) {
+        printf("[!] Setting of hwparams failed: %s\n", snd_strerror(err));
+        snd_pcm_close(*handle);
+        return -1;
+    }
+    transfer_mmap = transfer_methods[m].access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+    if ((err = set_swparams(*handle, swparams)) < 0) {
+        printf("[!] Setting of swparams failed: %s\n", snd_strerror(err));
+        snd_pcm_close(*handle);
+        return -1;
+    }
+    synth_select();
+    xrun_count = suspend_count = 0;
+    return m;
+}
+
+static void sound_close(snd_pcm_t *handle)
+{
+    if (xrun_count || suspend_count)
+        printf("[!] %u underruns and %u suspends while playing.\n", xrun_count, suspend_count);
+    snd_pcm_close(handle);printf("[-] SoundDaemon closed.\n");
+}
+
+int SoundDaemon_mod(int method)
+{    
+    snd_pcm_t *handle;
+    int err, m;
+    signed short *samples;
+    unsigned int chn;
+    snd_pcm_channel_area_t *areas;
+    rt_enter(&rt_audio);
+    if ((m = sound_open(&handle, method)) < 0)
+        return -1;
+    samples = malloc((period_size * channels * snd_pcm_format_physical_width(format)) / 8);
+    if (samples == NULL) {
+        printf("[!] No enough memory. Error code: samples\n");
+        return -1;
+    }
+    if ((areas = calloc(channels, sizeof(snd_pcm_channel_area_t))) == NULL) {
+        printf("[!] No enough memory. Error code: areas\n");
+        return -1;
+    }
+    for (chn = 0; chn < channels; chn++) {
+        areas[chn].addr = samples;
+        areas[chn].first = chn * snd_pcm_format_physical_width(format);
+        areas[chn].step = channels * snd_pcm_format_physical_width(format);
+    }
+    stats_enter("sound");
+    err = transfer_methods[m].transfer_loop(handle, samples, areas);
+    stats_leave();
+    if (err < 0){
+        printf("[!] Transfer failed: %s\n", snd_strerror(err));
+    }
+    free(areas);
+    free(samples);
+    sound_close(handle);
+    return 0;
+}
+
+/*
+ *   Live control - hotkeys and the --control socket
+ *
+ *   Both come down to live_set(), which works out the element lengths
+ *   and thresholds of the new settings, publishes them and then, while
+ *   a timeline plays, renders an element cache for them and makes it
+ *   elem_live.  All of that happens on the calling thread.  A cache the
+ *   player has left behind is freed on the next change once neither of
+ *   its hazard pointers is on it.
+ *
+ *   The socket takes one command per line, NAME [VALUE], where NAME is
+ *   wpm, spacing, tone or volume and a VALUE with a sign is a step, and
+ *   answers every line with the settings in force ("wpm 20 spacing 0
+ *   tone 750 volume 100") or "error ...".
+ */
+#define LIVE_RETIRED 4          /* the two hazards and the cache just replaced */
+#define CONTROL_LINE 128
+#define LIVE_HELP "Speed, word spacing, tone and volume go up and down with +/-, >/<, ]/[ and }/{ then ENTER.\n"
+
+enum { LIVE_WPM, LIVE_SPACING, LIVE_TONE, LIVE_VOLUME, LIVE_COUNT };
+
+static const char *const live_name[LIVE_COUNT] = { "wpm", "spacing", "tone", "volume" };
+static const int usec_15wpm[ELEM_COUNT] = { 80000, 250000, 50000, 320000 };    /* the defaults above */
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct elem_cache *live_retired[LIVE_RETIRED];
+static int live_retired_count;
+static int live_on = 0;                 /* a session the hotkeys apply to is playing */
+static const char *control_path = NULL; /* --control */
+static int control_fd = -1;
+
+static int live_scale(int usec, int wpm, double slow, double fast)
+{
+    return wpm < 15 ? ((15.0 / wpm - 1) * slow + 1) * usec : ((15.0 / wpm - 1) * fast + 1) * usec;
+}
+
+/* element lengths and thresholds of -w wpm, with the word gaps of -s spacing unless 0 */
+static void speed_set(int wpm, int spacing)
+{
+    usec_DI = live_scale(usec_15wpm[ELEM_DIT], wpm, 0.3, 0.9);
+    usec_DA = live_scale(usec_15wpm[ELEM_DAH], wpm, 0.3, 0.9);
+    usec_SGap = live_scale(usec_15wpm[ELEM_SGAP], wpm, 0.2, 0.50);
+    usec_BGap = live_scale(usec_15wpm[ELEM_BGAP], spacing ? spacing : wpm, 2.0, 1.05);
+    val_dida = 1.5*usec_DI; val_char = 2.5*usec_SGap; val_space = 1.5*usec_BGap;
+}
+
+static void live_free(struct elem_cache *cache)
+{
+    int elem;
+    if (cache == &elem_cache)
+        return;
+    for (elem = 0; elem < ELEM_COUNT; elem++)
+        free(cache->pcm[elem]);
+    free(cache);
+}
+
+/* keep old until the player is off it, free the ones it has left */
+static void live_retire(struct elem_cache *old)
+{
+    const struct elem_cache *busy0, *busy1;
+    int i, n;
+    live_retired[live_retired_count++] = old;
+    busy0 = __atomic_load_n(&elem_playing[0], __ATOMIC_SEQ_CST);
+    busy1 = __atomic_load_n(&elem_playing[1], __ATOMIC_SEQ_CST);
+    for (i = n = 0; i < live_retired_count; i++) {
+        if (live_retired[i] == busy0 || live_retired[i] == busy1)
+            live_retired[n++] = live_retired[i];
+        else
+            live_free(live_retired[i]);
+    }
+    live_retired_count = n;
+}
+
+/* make next the settings in force, with live_lock held */
+static int live_apply(const struct live_conf *next)
+{
+    struct elem_cache *cache;
+    __atomic_store_n(&live_seq, live_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    live_conf = *next;
+    speed_set(next->wpm, next->spacing);
+    keyer_wpm = next->wpm;
+    if (keyer_on) {
+        val_dida = val_char = 2 * 1200000 / keyer_wpm;
+        val_space = 5 * 1200000 / keyer_wpm;
+    }
+    freq = next->freq;
+    __atomic_store_n(&live_seq, live_seq + 1, __ATOMIC_RELEASE);
+    if (!elem_live->pcm[ELEM_DIT])
+        return 0;   /* no timeline playing, or not yet: it starts with these */
+    if ((cache = calloc(1, sizeof(*cache))) == NULL) {
+        printf("[!] No enough memory. Error code: elem_cache\n");
+        return -1;
+    }
+    if (elem_cache_update(cache) < 0) {
+        live_free(cache);
+        return -1;
+    }
+    cache = __atomic_exchange_n(&elem_live, cache, __ATOMIC_SEQ_CST);
+    live_retire(cache);
+    return 0;
+}
+
+static void live_format(char *buf, size_t size, const struct live_conf *c)
+{
+    snprintf(buf, size, "wpm %d spacing %d tone %.0f volume %d", c->wpm, c->spacing, c->freq, c->volume);
+}
+
+/* set field to value, or step it by value, and report the settings now in force */
+static int live_set(int field, double value, int step, char *buf, size_t size)
+{
+    struct live_conf next;
+    int err;
+    pthread_mutex_lock(&live_lock);
+    next = live_conf;
+    switch (field) {
+    case LIVE_WPM:
+        value += step ? next.wpm : 0;
+        next.wpm = value < 5 ? 5 : value > 99 ? 99 : value;
         break;
-      case '?':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DI);
-        putchar(letter);usleep(usec_BGap);
+    case LIVE_SPACING:
+        value += step ? (next.spacing ? next.spacing : next.wpm) : 0;
+        next.spacing = value < 1 ? 0 : value < 5 ? 5 : value > 99 ? 99 : value;
         break;
-      case '.':
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);usleep(usec_SGap);
-        PressKey(usec_DI);usleep(usec_SGap);PressKey(usec_DA);
-        putchar(letter);usleep(usec_BGap);
+    case LIVE_TONE:
+        value += step ? next.freq : 0;
+        next.freq = value < 250 ? 250 : value > 1000 ? 1000 : value;   /* as -f */
         break;
-      default:
-        putchar(letter);
-        usleep(usec_BGap);
+    case LIVE_VOLUME:
+        value += step ? next.volume : 0;
+        next.volume = value < 0 ? 0 : value > 100 ? 100 : value;
         break;
-      }
     }
-    m_Interrupt=1;OnWav=0;
-    fclose(fin);
+    err = live_apply(&next);
+    live_format(buf, size, &live_conf);
+    pthread_mutex_unlock(&live_lock);
+    return err;
+}
+
+/* a hotkey: step field by step */
+static void live_key(int field, double step)
+{
+    char buf[CONTROL_LINE];
+    if (!live_on)
+        return;
+    live_set(field, step, 1, buf, sizeof(buf));
+    printf("\n[+] %s\n", buf);
+}
+
+static void control_command(int fd, const char *line)
+{
+    char name[16], arg[32], buf[CONTROL_LINE], *end = arg;
+    int field = 0, k = sscanf(line, "%15s %31s", name, arg);
+    double value = k >= 2 ? strtod(arg, &end) : 0;
+    while (k >= 1 && field < LIVE_COUNT && strcmp(name, live_name[field]))
+        field++;
+    if (field == LIVE_COUNT)
+        snprintf(buf, sizeof(buf), "error unknown setting %s", name);
+    else if (k < 2) {
+        pthread_mutex_lock(&live_lock);
+        live_format(buf, sizeof(buf), &live_conf);
+        pthread_mutex_unlock(&live_lock);
+    } else if (end == arg || *end || !isfinite(value))
+        snprintf(buf, sizeof(buf), "error bad value %s", arg);
+    else if (live_set(field, value, arg[0] == '+' || arg[0] == '-', buf, sizeof(buf)) < 0)
+        snprintf(buf, sizeof(buf), "error no memory");
+    strcat(buf, "\n");
+    send(fd, buf, strlen(buf), MSG_NOSIGNAL);
+}
+
+/* one client at a time, line by line until it hangs up */
+static void *ControlDaemon(void *arg)
+{
+    char line[CONTROL_LINE], *nl;
+    int fd, n, len;
+    while ((fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+        for (len = 0; fd >= 0 && (n = read(fd, line + len, sizeof(line) - 1 - len)) > 0; ) {
+            len += n;
+            line[len] = 0;
+            while ((nl = strchr(line, '\n')) != NULL) {
+                *nl = 0;
+                control_command(fd, line);
+                len -= nl + 1 - line;
+                memmove(line, nl + 1, len + 1);
+            }
+            if (len == sizeof(line) - 1)
+                len = 0;    /* longer than any command */
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    printf("[!] Control socket failed: %s\n", strerror(errno));
+    return 0;
+}
+
+static void control_finish(void)
+{
+    unlink(control_path);
+}
+
+static int control_start(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    sigset_t all, old;
+    pthread_t pid;
+    int err;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("[!] Socket path %s is too long.\n", path);
+        return -1;
+    }
+    if (stat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        printf("[!] %s is there and not a socket.\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(control_fd, 4) < 0) {
+        printf("[!] Control socket on %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    atexit(control_finish);
+    /* no signals on this thread, they belong to the session's own */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&pid, NULL, ControlDaemon, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        printf("[!] Fail to create control thread.\n");
+        return -1;
+    }
+    pthread_detach(pid);
+    printf("[+] Control socket on %s (wpm, spacing, tone, volume).\n", path);
+    return 0;
+}
+
+/*
+ *   Act on a byte typed at the terminal, 1 when it ends the session
+ */
+static int enter_key(int c)
+{
+    switch (c)
+    {
+        case 3:
+          OnWav = 0;m_Interrupt = 1;key_wake();decode_wake();printf("[!] Manually interrupted by Ctrl-C.\n");return 1;
+        case 0x1B:
+          OnWav = 0;m_Interrupt = 1;key_wake();decode_wake();return 1;
+        case '\n':
+          if(decode_adaptive && decoder_wpm){printf(" [%d WPM]",decoder_wpm);}
+          putchar('\n');break;
+        case '+': case '=':
+          live_key(LIVE_WPM, 1);break;
+        case '-':
+          live_key(LIVE_WPM, -1);break;
+        case '>':
+          live_key(LIVE_SPACING, 1);break;
+        case '<':
+          live_key(LIVE_SPACING, -1);break;
+        case ']':
+          live_key(LIVE_TONE, 50);break;
+        case '[':
+          live_key(LIVE_TONE, -50);break;
+        case '}':
+          live_key(LIVE_VOLUME, 10);break;
+        case '{':
+          live_key(LIVE_VOLUME, -10);break;
+    }
+    return 0;
+}
+
+void * getEnter()
+{
+    //inspect key value
+    while(!enter_key(getchar()))
+        ;
+    return 0;
+}
+
+/*
+ *   Event loop runtime (--epoll)
+ *
+ *   One thread waits in epoll for everything a keying session reacts
+ *   to: the key device, the terminal, a timerfd at the decoder's next
+ *   character or word deadline, SIGINT and SIGTERM through a signalfd,
+ *   and the ALSA poll descriptors.  avail_min is raised to all but a
+ *   period, so the device reports writable once less than a period is
+ *   queued and gets one period of tone or silence, keeping one to two
+ *   queued whatever the key does: no wakeups in between, and a key up
+ *   cuts the tone within two periods.  With --rt the audio keeps a
+ *   SCHED_FIFO thread of its own running tone_loop() instead.
+ */
+#define LOOP_EVENTS 16
+#define LOOP_PCM_FDS 8
+
+/* epoll data; LOOP_KEY + i for key device i, LOOP_PCM + i for ALSA fd i */
+enum { LOOP_TTY, LOOP_TIMER, LOOP_SIGNAL, LOOP_KEY, LOOP_PCM = LOOP_KEY + KEY_MAX_DEVICES };
+
+static int runtime_epoll = 0;       /* --epoll */
+
+struct session_usage {
+    struct rusage ru;
+    double t;
+};
+
+static void session_mark(struct session_usage *u)
+{
+    getrusage(RUSAGE_SELF, &u->ru);
+    u->t = mono_time();
+}
+
+/* CPU time and context switches of all threads since session_mark() */
+static void session_report(const struct session_usage *u)
+{
+    struct session_usage now;
+    double cpu;
+    long switches;
+    session_mark(&now);
+    cpu = now.ru.ru_utime.tv_sec - u->ru.ru_utime.tv_sec + now.ru.ru_stime.tv_sec - u->ru.ru_stime.tv_sec +
+          (now.ru.ru_utime.tv_usec - u->ru.ru_utime.tv_usec + now.ru.ru_stime.tv_usec - u->ru.ru_stime.tv_usec) * 1e-6;
+    switches = now.ru.ru_nvcsw - u->ru.ru_nvcsw + now.ru.ru_nivcsw - u->ru.ru_nivcsw;
+    printf("[-] Session used %.2f s CPU in %.1f s, %.0f context switches per second.\n",
+           cpu, now.t - u->t, switches / (now.t - u->t));
+}
+
+static void *loop_sound(void *arg)
+{
+    *(int *)arg = SoundDaemon_mod(0);
+    return 0;
+}
+
+/* top the device up to two periods of whatever the key says */
+static int loop_audio(snd_pcm_t *handle, signed short *samples, struct sidetone *tone)
+{
+    snd_pcm_sframes_t avail, low = buffer_size - period_size > period_size ? buffer_size - period_size : period_size;
+    int err;
+    while ((avail = snd_pcm_avail_update(handle)) != 0) {
+        if (avail < 0) {
+            if (xrun_recovery(handle, avail) < 0) {
+                printf("[!] Avail update error: %s\n", snd_strerror(avail));
+                return -1;
+            }
+            continue;
+        }
+        if (avail < low)
+            break;
+        if (keyer_on)
+            err = put_period(handle, samples, fill_keyer, &keyer);
+        else {
+            if (!OnWav)
+                sidetone_poll(tone);
+            err = put_period(handle, samples, OnWav ? fill_tone : fill_silence, tone);
+        }
+        if (err < 0)
+            return -1;
+    }
+    if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+        snd_pcm_start(handle);
+    return 0;
+}
+
+static int loop_watch(int epfd, int fd, unsigned int events, unsigned int tag)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = tag;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int EventDaemon(void)
+{
+    struct epoll_event evs[LOOP_EVENTS];
+    struct pollfd pfds[LOOP_PCM_FDS];
+    struct input_event ie[16];
+    struct itimerspec due;
+    struct signalfd_siginfo si;
+    struct decoder dec;
+    struct beam beam;
+    struct key_span span;
+    struct sidetone tone;
+    snd_pcm_t *handle = NULL;
+    snd_pcm_sw_params_t *swparams;
+    signed short *samples = NULL;
+    unsigned short revents;
+    pthread_t audio_pid;
+    sigset_t mask;
+    char tty[64];
+    int64_t down = 0, up = 0, deadline;
+    int key_fd[KEY_MAX_DEVICES], opened, keys, epfd = -1, timer_fd = -1, sig_fd = -1, npfd = 0, audio_rc = 0, threaded = rt_audio.prio > 0;
+    int quit = 0, err = -1, started = 0, n, i, j, k, fd, pcm_ready;
+    uint64_t ticks;
+    snd_pcm_sw_params_alloca(&swparams);
+    /* before any thread starts, so the signals only ever reach sig_fd */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if ((keys = opened = key_open_all(key_fd, NULL)) == 0)
+        goto out;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(key_clock, TFD_NONBLOCK | TFD_CLOEXEC);
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (epfd < 0 || timer_fd < 0 || sig_fd < 0 ||
+        loop_watch(epfd, timer_fd, EPOLLIN, LOOP_TIMER) < 0 || loop_watch(epfd, sig_fd, EPOLLIN, LOOP_SIGNAL) < 0) {
+        printf("[!] Event loop setup failed: %s\n", strerror(errno));
+        goto out;
+    }
+    for (i = 0; i < opened; i++) {
+        fcntl(key_fd[i], F_SETFL, fcntl(key_fd[i], F_GETFL) | O_NONBLOCK);
+        if (loop_watch(epfd, key_fd[i], EPOLLIN, LOOP_KEY + i) < 0) {
+            printf("[!] Event loop setup failed: %s\n", strerror(errno));
+            goto out;
+        }
+    }
+    loop_watch(epfd, STDIN_FILENO, EPOLLIN, LOOP_TTY);
+    if (threaded) {
+        if (key_wake_fd < 0)
+            key_wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (pthread_create(&audio_pid, NULL, loop_sound, &audio_rc) != 0) {
+            printf("[!] Fail to create SoundDaemon thread.\n");
+            goto out;
+        }
+        started = 1;
+        err = 0;
+    } else {
+        if (sound_open(&handle, 0) < 0) {
+            handle = NULL;
+            goto out;
+        }
+        sidetone_init(&tone);
+        keyer_init(&keyer, rate);
+        samples = malloc((period_size * channels * snd_pcm_format_physical_width(format)) / 8);
+        if (samples == NULL) {
+            printf("[!] No enough memory. Error code: samples\n");
+            goto out;
+        }
+        if ((err = snd_pcm_sw_params_current(handle, swparams)) < 0 ||
+            (err = snd_pcm_sw_params_set_avail_min(handle, swparams, buffer_size - period_size > period_size ? buffer_size - period_size : period_size)) < 0 ||
+            (err = snd_pcm_sw_params(handle, swparams)) < 0) {
+            printf("[!] Unable to set avail min for playback: %s\n", snd_strerror(err));
+            goto out;
+        }
+        npfd = snd_pcm_poll_descriptors(handle, pfds, LOOP_PCM_FDS);
+        for (i = 0; i < npfd; i++)
+            if (loop_watch(epfd, pfds[i].fd, pfds[i].events, LOOP_PCM + i) < 0) {
+                printf("[!] Event loop setup failed: %s\n", strerror(errno));
+                err = -1;
+                goto out;
+            }
+        err = loop_audio(handle, samples, &tone);
+    }
+    decoder_reset(&dec, decode_adaptive, stdout);
+    if (beam_width)
+        decoder_beam(&dec, &beam);
+    stats_enter("event");
+    while (!quit && err >= 0) {
+        if ((n = epoll_wait(epfd, evs, LOOP_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("[!] Event loop wait failed: %s\n", strerror(errno));
+            break;
+        }
+        for (i = 0; i < npfd; i++)
+            pfds[i].revents = 0;
+        for (i = pcm_ready = 0; i < n; i++) {
+            switch (evs[i].data.u32) {
+            case LOOP_TTY:
+                if ((j = read(STDIN_FILENO, tty, sizeof(tty))) <= 0)
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);     /* no terminal, run until a signal */
+                for (k = 0; k < j && !quit; k++)
+                    quit = enter_key(tty[k]);
+                break;
+            case LOOP_TIMER:
+                while (read(timer_fd, &ticks, sizeof(ticks)) > 0)
+                    ;
+                break;
+            case LOOP_SIGNAL:
+                if (read(sig_fd, &si, sizeof(si)) == sizeof(si))
+                    printf("\n[!] Interrupted by %s.\n", strsignal(si.ssi_signo));
+                quit = 1;
+                break;
+            default:
+                if (evs[i].data.u32 >= LOOP_PCM) {
+                    pfds[evs[i].data.u32 - LOOP_PCM].revents = evs[i].events;
+                    pcm_ready = 1;
+                    break;
+                }
+                fd = key_fd[evs[i].data.u32 - LOOP_KEY];
+                while ((j = read(fd, ie, sizeof(ie))) > 0)
+                    for (k = 0; k < j / (int)sizeof(ie[0]); k++)
+                        key_event(&ie[k], &down, &up);
+                if (j == 0 || errno != EAGAIN) {
+                    printf("[!] Key device gone: %s\n", j ? strerror(errno) : "end of file");
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                    quit = --keys == 0;
+                }
+            }
+        }
+        while (key_ring_pop(&key_ring, &span) == 0)
+            decoder_span(&dec, &span);
+        decoder_tick(&dec, key_now());
+        memset(&due, 0, sizeof(due));
+        if ((deadline = decoder_deadline(&dec)) >= 0) {
+            due.it_value.tv_sec = deadline / 1000000;
+            due.it_value.tv_nsec = deadline % 1000000 * 1000 + 1;  /* 0 would disarm */
+        }
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &due, NULL);
+        /* an xrun shows as POLLERR; loop_audio() recovers it through avail */
+        if (pcm_ready && snd_pcm_poll_descriptors_revents(handle, pfds, npfd, &revents) == 0 && (revents & (POLLOUT | POLLERR)))
+            err = loop_audio(handle, samples, &tone);
+    }
+    stats_leave();
+    if (dec.adaptive)
+        printf("\n[-] Keying speed about %d WPM.\n", decoder_speed(&dec));
+    if (!threaded && err < 0)
+        printf("[!] Transfer failed: %s\n", snd_strerror(err));
+out:
+    /* every exit, so a failed setup neither leaks descriptors nor leaves the signals blocked */
+    OnWav = 0;
+    m_Interrupt = 1;
+    if (started) {
+        key_wake();
+        pthread_join(audio_pid, NULL);
+    }
+    free(samples);
+    if (handle)
+        sound_close(handle);
+    if (sig_fd >= 0)
+        close(sig_fd);
+    if (timer_fd >= 0)
+        close(timer_fd);
+    for (i = 0; i < opened; i++)
+        close(key_fd[i]);
+    if (epfd >= 0)
+        close(epfd);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    return err < 0 || audio_rc < 0 ? -1 : 0;
+}
+
+/*
+ *   Tone detector
+ *
+ *   Goertzel filters over blocks of TONE_BLOCK_USEC, four bins to a
+ *   vector. With a fixed tone the bins straddle freq to allow for some
+ *   mistuning; with --auto-tone they cover TONE_LO upwards. The bin with
+ *   the most long term power carries the tone.
+ *
+ *   A tone gate compares an envelope against a tracked peak and noise
+ *   floor with hysteresis, and a change that holds for TONE_DEBOUNCE
+ *   blocks becomes a key span on the sample clock, so the decoder sees
+ *   the same spans as from the keyboard.
+ */
+#define TONE_BLOCK_USEC 4000
+#define TONE_BINS 40                /* auto: 300 to 1275 Hz */
+#define TONE_LO 300
+#define TONE_STEP 25
+#define TONE_DEBOUNCE 2
+#define TONE_SNR 4.0f               /* peak over floor before anything is a mark */
+#define AUDIO_CHUNK 4096            /* frames read at a time */
+
+struct tone_gate {
+    float peak, floor;      /* envelope levels */
+    int mark, run;          /* current state, blocks the other state has held */
+    int64_t edge;           /* last transition, usec, -1 before the first */
+    struct decoder *dec;
+};
+
+struct tone_detector {
+    v4sf coef[TONE_BINS / 4], s1[TONE_BINS / 4], s2[TONE_BINS / 4];
+    float avg[TONE_BINS], hz[TONE_BINS];
+    int vecs;               /* vectors of bins in use */
+    int block, fill;        /* frames per block, frames in this block */
+    int tone;               /* bin carrying the tone */
+    uint64_t frames;        /* sample clock */
+    struct tone_gate gate;
+};
+
+struct audio_source {
+    FILE *fin;              /* WAV file, NULL for capture */
+    snd_pcm_t *handle;
+    unsigned int rate, channels;
+    int bytes, is_float;    /* per sample */
+};
+
+static int tone_auto = 0;           /* --auto-tone */
+
+static void gate_init(struct tone_gate *g, struct decoder *dec)
+{
+    memset(g, 0, sizeof(*g));
+    g->edge = -1;
+    g->dec = dec;
+}
+
+static void gate_edge(struct tone_gate *g, int64_t t)
+{
+    struct key_span ev;
+    ev.mark = g->mark;
+    ev.end = t;
+    ev.usec = g->edge < 0 ? 0 : t - g->edge;
+    decoder_span(g->dec, &ev);
+    g->mark = !g->mark;
+    g->edge = t;
+}
+
+/* envelope [e] of the block ending at [now], blocks of [block_usec] */
+static void gate_step(struct tone_gate *g, float e, int64_t now, int block_usec)
+{
+    float hi, lo;
+    int want;
+    if (e > g->peak)
+        g->peak = e;
+    else
+        g->peak -= (g->peak - g->floor) * (1.0f / 512);
+    if (e < g->floor)
+        g->floor = e;
+    else if (!g->mark)
+        g->floor += (e - g->floor) * (1.0f / 64);
+    hi = g->floor + (g->peak - g->floor) * 0.6f;
+    lo = g->floor + (g->peak - g->floor) * 0.4f;
+    want = g->peak > g->floor * TONE_SNR && e > (g->mark ? lo : hi);
+    decoder_tick(g->dec, now);
+    if (want == g->mark) {
+        g->run = 0;
+    } else if (++g->run >= TONE_DEBOUNCE) {
+        /* the change started with the first block of the run */
+        gate_edge(g, now - (int64_t)g->run * block_usec);
+        g->run = 0;
+    }
+}
+
+/* end of input: close an open mark and let the last character out */
+static void gate_finish(struct tone_gate *g, int64_t now)
+{
+    int64_t due;
+    if (g->mark)
+        gate_edge(g, now);
+    while ((due = decoder_deadline(g->dec)) >= 0)
+        decoder_tick(g->dec, due);
+}
+
+static void tone_init(struct tone_detector *td, struct decoder *dec, unsigned int srate, int autodetect)
+{
+    int i, bins = autodetect ? TONE_BINS : 4;
+    memset(td, 0, sizeof(*td));
+    for (i = 0; i < bins; i++) {
+        td->hz[i] = autodetect ? TONE_LO + i * TONE_STEP : freq + (i - 1.5) * TONE_STEP;
+        td->coef[i / 4][i % 4] = 2 * cos(2 * M_PI * td->hz[i] / srate);
+    }
+    td->vecs = bins / 4;
+    td->block = (uint64_t)srate * TONE_BLOCK_USEC / 1000000;
+    td->tone = autodetect ? 0 : 1;
+    gate_init(&td->gate, dec);
+}
+
+static void tone_block(struct tone_detector *td, unsigned int srate)
+{
+    float power[TONE_BINS];
+    int i;
+    for (i = 0; i < td->vecs; i++) {
+        v4sf p = td->s1[i] * td->s1[i] + td->s2[i] * td->s2[i] - td->coef[i] * td->s1[i] * td->s2[i];
+        memcpy(power + i * 4, &p, sizeof(p));
+        td->s1[i] = td->s2[i] = (v4sf){ 0, 0, 0, 0 };
+    }
+    for (i = 0; i < td->vecs * 4; i++) {
+        td->avg[i] += (power[i] - td->avg[i]) * (1.0f / 256);
+        td->tone = td->avg[i] > td->avg[td->tone] ? i : td->tone;
+    }
+    td->frames += td->block;
+    gate_step(&td->gate, sqrtf(power[td->tone]) / td->block, td->frames * 1000000 / srate,
+          (uint64_t)td->block * 1000000 / srate);
+}
+
+static void tone_feed(struct tone_detector *td, const float *x, size_t n, unsigned int srate)
+{
+    size_t i, m;
+    int j;
+    while (n > 0) {
+        m = td->block - td->fill < n ? td->block - td->fill : n;
+        for (j = 0; j < td->vecs; j++) {
+            v4sf s1 = td->s1[j], s2 = td->s2[j], c = td->coef[j], s0;
+            for (i = 0; i < m; i++) {
+                s0 = c * s1 - s2 + x[i];
+                s2 = s1;
+                s1 = s0;
+            }
+            td->s1[j] = s1;
+            td->s2[j] = s2;
+        }
+        x += m;
+        n -= m;
+        if ((td->fill += m) == td->block) {
+            tone_block(td, srate);
+            td->fill = 0;
+        }
+    }
+}
+
+static void tone_finish(struct tone_detector *td, unsigned int srate)
+{
+    gate_finish(&td->gate, td->frames * 1000000 / srate);
+}
+
+static uint32_t get_le(const unsigned char *p, int bytes)
+{
+    uint32_t v = 0;
+    while (bytes-- > 0)
+        v = v << 8 | p[bytes];
+    return v;
+}
+
+static int wav_open(struct audio_source *src, const char *path)
+{
+    unsigned char hdr[40];
+    uint32_t size;
+    int tag = 0, bits = 0;
+    if ((src->fin = fopen(path, "rb")) == NULL) {
+        printf("[!] Unable to read %s\n", path);
+        return -1;
+    }
+    if (fread(hdr, 1, 12, src->fin) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4))
+        goto bad;
+    while (fread(hdr, 1, 8, src->fin) == 8) {
+        size = get_le(hdr + 4, 4);
+        if (!memcmp(hdr, "data", 4))
+            break;
+        if (!memcmp(hdr, "fmt ", 4) && size >= 16) {
+            if (fread(hdr, 1, size < sizeof(hdr) ? size : sizeof(hdr), src->fin) < 16)
+                goto bad;
+            tag = get_le(hdr, 2);
+            src->channels = get_le(hdr + 2, 2);
+            src->rate = get_le(hdr + 4, 4);
+            bits = get_le(hdr + 14, 2);
+            if (tag == 0xfffe && size >= 26)
+                tag = get_le(hdr + 24, 2);
+            size = size > sizeof(hdr) ? size - sizeof(hdr) : 0;
+        }
+        if (fseek(src->fin, size + (size & 1), SEEK_CUR))
+            goto bad;
+    }
+    if (feof(src->fin) || !src->channels || !src->rate || !((tag == 1 && bits % 8 == 0 && bits <= 32) || (tag == 3 && bits == 32)))
+        goto bad;
+    src->bytes = bits / 8;
+    src->is_float = tag == 3;
+    return 0;
+bad:
+    printf("[!] %s is not a PCM or float WAV file\n", path);
+    fclose(src->fin);
+    src->fin = NULL;
+    return -1;
+}
+
+static int capture_open(struct audio_source *src, const char *name)
+{
+    snd_pcm_hw_params_t *hwparams;
+    unsigned int play_buffer = buffer_time, play_period = period_time;
+    snd_pcm_uframes_t play_buffer_size = buffer_size, play_period_size = period_size;
+    int err;
+    snd_pcm_hw_params_alloca(&hwparams);
+    if (snd_pcm_format_big_endian(format) == 1 || (snd_pcm_format_unsigned(format) == 1 && format != SND_PCM_FORMAT_U8)) {
+        printf("[!] Capture needs a little endian signed or float format\n");
+        return -1;
+    }
+    if ((err = snd_pcm_open(&src->handle, name, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+        printf("[!] Capture open error: %s\n", snd_strerror(err));
+        return -1;
+    }
+    /* long periods for capture, the playback settings stay as they were */
+    buffer_time = buffer_time < 200000 ? 200000 : buffer_time;
+    period_time = period_time < 20000 ? 20000 : period_time;
+    err = set_hwparams(src->handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED);
+    buffer_time = play_buffer;
+    period_time = play_period;
+    buffer_size = play_buffer_size;
+    period_size = play_period_size;
+    if (err < 0) {
+        printf("[!] Setting of hwparams failed: %s\n", snd_strerror(err));
+        snd_pcm_close(src->handle);
+        return -1;
+    }
+    src->rate = rate;
+    src->channels = channels;
+    src->bytes = snd_pcm_format_physical_width(format) / 8;
+    src->is_float = format == SND_PCM_FORMAT_FLOAT_LE;
+    return 0;
+}
+
+static void audio_close(struct audio_source *src)
+{
+    if (src->fin)
+        fclose(src->fin);
+    else
+        snd_pcm_close(src->handle);
+}
+
+/* read up to [frames] frames as float, first channel only; 0 at the end */
+static long audio_read(struct audio_source *src, unsigned char *raw, float *out, size_t frames)
+{
+    size_t stride = src->bytes * src->channels, i;
+    long n;
+    uint32_t v;
+    if (src->fin) {
+        n = fread(raw, stride, frames, src->fin);
+    } else {
+        while ((n = snd_pcm_readi(src->handle, raw, frames)) < 0 && !m_Interrupt)
+            if (xrun_recovery(src->handle, n) < 0) {
+                printf("[!] Capture read error: %s\n", snd_strerror(n));
+                return -1;
+            }
+        n = n < 0 ? 0 : n;
+    }
+    for (i = 0; i < n; i++) {
+        v = get_le(raw + i * stride, src->bytes);
+        if (src->is_float)
+            memcpy(&out[i], &v, sizeof(float));
+        else if (src->bytes == 1)
+            out[i] = ((int)v - 128) * (1.0f / 128);
+        else
+            out[i] = (int32_t)(v << (32 - 8 * src->bytes)) * (1.0f / 2147483648.0f);
+    }
+    return n;
+}
+
+/*
+ *   Decode CW from a receiver: ALSA capture device [src], or a WAV file
+ */
+int ListenDaemon(const char *src_name)
+{
+    struct audio_source src = { NULL, NULL, 0, 0, 0, 0 };
+    struct tone_detector td;
+    struct decoder dec;
+    struct beam beam;
+    struct stat st;
+    pthread_t BL_pid;
+    unsigned char *raw;
+    float *pcm;
+    long n;
+    double t0 = mono_time();
+    int i, err = -1, blocker = 0, live = stat(src_name, &st) < 0 || !S_ISREG(st.st_mode);
+    if (live ? capture_open(&src, src_name) : wav_open(&src, src_name))
+        return -1;
+    raw = malloc(AUDIO_CHUNK * src.bytes * src.channels);
+    pcm = malloc(AUDIO_CHUNK * sizeof(float));
+    if (raw == NULL || pcm == NULL) {
+        printf("[!] No enough memory. Error code: listen\n");
+        goto out;
+    }
+    decoder_reset(&dec, decode_adaptive, stdout);
+    if (beam_width)
+        decoder_beam(&dec, &beam);
+    tone_init(&td, &dec, src.rate, tone_auto);
+    if (live && (blocker = pthread_create(&BL_pid, NULL, getEnter, NULL) == 0))
+        printf("\n[+] Listening on %s at %u Hz (ESC-ENTER to stop):\n\n", src_name, src.rate);
+    stats_enter("listen");
+    while (!m_Interrupt && (n = audio_read(&src, raw, pcm, AUDIO_CHUNK)) > 0)
+        tone_feed(&td, pcm, n, src.rate);
+    tone_finish(&td, src.rate);
+    stats_leave();
+    for (i = 0; i < td.vecs * 4; i++)
+        td.tone = td.avg[i] > td.avg[td.tone] ? i : td.tone;
+    printf("\n[-] Tone at %.0f Hz", td.hz[td.tone]);
+    if (dec.adaptive)
+        printf(", about %d WPM", decoder_speed(&dec));
+    if (!live)
+        printf("; %.1f s of audio in %.2f s", (double)td.frames / src.rate, mono_time() - t0);
+    printf(".\n");
+    if (blocker)
+        pthread_join(BL_pid, NULL);
+    err = 0;
+out:
+    audio_close(&src);
+    free(raw);
+    free(pcm);
+    return err;
+}
+
+/*
+ *   Skimmer
+ *
+ *   The passband is cut into FFT bins: a Hann window of at most
+ *   SKIM_RES_HZ resolution slides over the audio in hops of
+ *   TONE_BLOCK_USEC, each hop reusing the samples of the previous window
+ *   (overlap-save), and gives one envelope sample per bin. A bin whose
+ *   long term power stands SKIM_SNR over its own floor (the level in the
+ *   spaces of the keying, so a crowded band does not hide it) and over
+ *   the lower quartile of the band (a static crash lifts all of it), over
+ *   its neighbours and within SKIM_RANGE of the strongest (key clicks of
+ *   a strong signal spread over the band) is a carrier, and gets a channel:
+ *   a tone gate and an adaptive decoder of its own. The last SKIM_REPLAY
+ *   batches of envelopes are kept, so a new channel starts from where
+ *   its carrier came up and the first characters are not lost while the
+ *   long term power builds up. A channel closes SKIM_HOLD after its
+ *   carrier falls SKIM_FADE under the best it had.
+ *   Hops are collected in batches of SKIM_BATCH and the channels of a
+ *   batch are shared out to a pool of workers, which steal from each
+ *   other once their own share is done.  A batch ends when every worker
+ *   has checked back in, so none is still stealing while the next one
+ *   is laid out.
+ */
+#define SKIM_RES_HZ 25
+#define SKIM_LO 200
+#define SKIM_HI 4000
+#define SKIM_SNR 10.0f
+#define SKIM_RANGE 1e-3f            /* 30 dB in power */
+#define SKIM_FADE 0.1f              /* carrier gone 10 dB under its best */
+#define SKIM_BATCH 64               /* hops per batch */
+#define SKIM_REPLAY 8               /* batches of envelopes kept */
+#define SKIM_HOLD 1000000           /* usec a channel outlives its carrier */
+#define SKIM_MAX_CHAN 128
+#define SKIM_MAX_WORKERS 64
+
+struct fft_plan {
+    int n;
+    int *rev;
+    float *cos_t, *sin_t;
+};
+
+struct skim_channel {
+    int bin;
+    int64_t heard;          /* last batch the carrier was there, usec */
+    float loud;             /* most long term power seen */
+    uint64_t next;          /* next hop to decode */
+    struct tone_gate gate;
+    struct decoder dec;
+    char *text;             /* decoded so far */
+    size_t len, shown;
+};
+
+struct skim_queue {
+    unsigned int next, end;
+    char pad[56];           /* one cache line each */
+};
+
+struct skimmer {
+    unsigned int rate;
+    struct fft_plan fft;
+    int n, hop, lo, bins;   /* FFT size, frames per hop, first bin, bins kept */
+    int hop_usec;
+    float *ring, *window, *re, *im;
+    int pos, fill;          /* ring write position, frames since the last hop */
+    float *env;             /* ring of SKIM_REPLAY batches of envelopes */
+    float *avg;             /* long term power by bin */
+    float *smooth, *floor;  /* short term power and its floor by bin */
+    float *band;            /* scratch for the band level */
+    int hops;               /* rows in the current batch */
+    uint64_t first;         /* hop number of the first row */
+    struct skim_channel *chan[SKIM_MAX_CHAN];
+    int nchan, *chan_of;    /* channels, channel by bin or -1 */
+    int task[SKIM_MAX_CHAN], ntasks;
+    FILE *print;            /* decoded words as they complete, or NULL */
+    int peak_chan;          /* most channels at once */
+    /* worker pool, worker 0 is the calling thread */
+    int workers;
+    pthread_t threads[SKIM_MAX_WORKERS];
+    struct skim_queue queue[SKIM_MAX_WORKERS];
+    unsigned int generation;
+    int busy;               /* pool workers not yet through the generation */
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t start, finish;
+};
+
+struct skim_worker {
+    struct skimmer *sk;
+    int id;
+};
+
+static int fft_init(struct fft_plan *f, int n)
+{
+    int i, j, bits = __builtin_ctz(n);
+    f->n = n;
+    f->rev = malloc(n * sizeof(int));
+    f->cos_t = malloc(n / 2 * sizeof(float));
+    f->sin_t = malloc(n / 2 * sizeof(float));
+    if (!f->rev || !f->cos_t || !f->sin_t)
+        return -1;
+    for (i = 0; i < n; i++) {
+        for (j = 0, f->rev[i] = 0; j < bits; j++)
+            f->rev[i] |= (i >> j & 1) << (bits - 1 - j);
+    }
+    for (i = 0; i < n / 2; i++) {
+        f->cos_t[i] = cos(2 * M_PI * i / n);
+        f->sin_t[i] = -sin(2 * M_PI * i / n);
+    }
+    return 0;
+}
+
+static void fft_free(struct fft_plan *f)
+{
+    free(f->rev);
+    free(f->cos_t);
+    free(f->sin_t);
+}
+
+/* in place radix-2 transform */
+static void fft_run(const struct fft_plan *f, float *re, float *im)
+{
+    int n = f->n, i, j, k, len, half, step;
+    float t, wr, wi, tr, ti;
+    for (i = 0; i < n; i++) {
+        j = f->rev[i];
+        if (j > i) {
+            t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        half = len >> 1;
+        step = n / len;
+        for (i = 0; i < n; i += len) {
+            for (k = 0; k < half; k++) {
+                int a = i + k, b = a + half;
+                wr = f->cos_t[k * step];
+                wi = f->sin_t[k * step];
+                tr = re[b] * wr - im[b] * wi;
+                ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+static void skim_task(struct skimmer *sk, struct skim_channel *ch)
+{
+    int64_t now;
+    for (; ch->next < sk->first + sk->hops; ch->next++) {
+        now = (int64_t)((ch->next + 1) * sk->hop * 1000000 / sk->rate);
+        gate_step(&ch->gate, sk->env[ch->next % (SKIM_BATCH * SKIM_REPLAY) * sk->bins + ch->bin], now, sk->hop_usec);
+    }
+    fflush(ch->gate.dec->out);
+}
+
+static void skim_steal(struct skimmer *sk, int self)
+{
+    unsigned int i;
+    int k, w;
+    for (k = 0; k < sk->workers; k++) {
+        w = (self + k) % sk->workers;
+        while ((i = __atomic_fetch_add(&sk->queue[w].next, 1, __ATOMIC_RELAXED)) < sk->queue[w].end)
+            skim_task(sk, sk->chan[sk->task[i]]);
+    }
+}
+
+static void *skim_worker(void *arg)
+{
+    struct skim_worker *wk = arg;
+    struct skimmer *sk = wk->sk;
+    unsigned int seen = 0;
+    pthread_mutex_lock(&sk->lock);
+    while (1) {
+        while (sk->generation == seen && !sk->quit)
+            pthread_cond_wait(&sk->start, &sk->lock);
+        if (sk->quit)
+            break;
+        seen = sk->generation;
+        pthread_mutex_unlock(&sk->lock);
+        skim_steal(sk, wk->id);
+        pthread_mutex_lock(&sk->lock);
+        if (--sk->busy == 0)
+            pthread_cond_signal(&sk->finish);
+    }
+    pthread_mutex_unlock(&sk->lock);
+    free(wk);
+    return 0;
+}
+
+/* run every channel over the batch, shared out to the pool */
+static void skim_run(struct skimmer *sk)
+{
+    int w, i;
+    for (sk->ntasks = 0, i = 0; i < sk->nchan; i++)
+        sk->task[sk->ntasks++] = i;
+    if (!sk->ntasks)
+        return;
+    for (w = 0; w < sk->workers; w++) {
+        sk->queue[w].next = sk->ntasks * w / sk->workers;
+        sk->queue[w].end = sk->ntasks * (w + 1) / sk->workers;
+    }
+    pthread_mutex_lock(&sk->lock);
+    sk->busy = sk->workers - 1;
+    sk->generation++;
+    pthread_cond_broadcast(&sk->start);
+    pthread_mutex_unlock(&sk->lock);
+    skim_steal(sk, 0);
+    /* every task is taken once the caller is through, and done once the pool is */
+    pthread_mutex_lock(&sk->lock);
+    while (sk->busy > 0)
+        pthread_cond_wait(&sk->finish, &sk->lock);
+    pthread_mutex_unlock(&sk->lock);
+}
+
+static double skim_hz(const struct skimmer *sk, int bin)
+{
+    return (double)(bin + sk->lo) * sk->rate / sk->n;
+}
+
+/* print the words a channel completed since last time */
+static void skim_show(struct skimmer *sk, struct skim_channel *ch, int all)
+{
+    size_t end = ch->len;
+    if (!sk->print)
+        return;
+    while (!all && end > ch->shown && ch->text[end - 1] != ' ')
+        end--;
+    if (end > ch->shown)
+        fprintf(sk->print, "%7.1f Hz  %.*s\n", skim_hz(sk, ch->bin), (int)(end - ch->shown), ch->text + ch->shown);
+    ch->shown = end;
+}
+
+static void skim_close(struct skimmer *sk, int c, int64_t now)
+{
+    struct skim_channel *ch = sk->chan[c];
+    gate_finish(&ch->gate, now);
+    fclose(ch->dec.out);
+    skim_show(sk, ch, 1);
+    sk->chan_of[ch->bin] = -1;
+    free(ch->text);
+    free(ch);
+    sk->chan[c] = sk->chan[--sk->nchan];
+    if (c < sk->nchan)
+        sk->chan_of[sk->chan[c]->bin] = c;
+}
+
+/* k-th smallest of v[0..n), v is reordered */
+static float skim_select(float *v, int n, int k)
+{
+    int lo = 0, hi = n - 1, i, j;
+    float pivot, t;
+    while (lo < hi) {
+        pivot = v[(lo + hi) / 2];
+        for (i = lo, j = hi; i <= j; ) {
+            while (v[i] < pivot)
+                i++;
+            while (v[j] > pivot)
+                j--;
+            if (i <= j) {
+                t = v[i];
+                v[i++] = v[j];
+                v[j--] = t;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return v[k];
+}
+
+/* open channels on new carriers, drop the ones gone quiet */
+static void skim_detect(struct skimmer *sk, int64_t now)
+{
+    struct skim_channel *ch;
+    float strongest = 0, band;
+    int b, c;
+    for (b = 0; b < sk->bins; b++)
+        strongest = sk->avg[b] > strongest ? sk->avg[b] : strongest;
+    /* a static crash lifts the whole band, a carrier only its own bins */
+    memcpy(sk->band, sk->avg, sk->bins * sizeof(float));
+    band = skim_select(sk->band, sk->bins, sk->bins / 4);
+    for (c = 0; c < sk->nchan; c++) {
+        ch = sk->chan[c];
+        b = ch->bin;
+        ch->loud = sk->avg[b] > ch->loud ? sk->avg[b] : ch->loud;
+        if (sk->avg[b] > sk->floor[b] * (SKIM_SNR / 2) && sk->avg[b] > strongest * SKIM_RANGE && sk->avg[b] > ch->loud * SKIM_FADE)
+            ch->heard = now;
+    }
+    for (b = 1; b < sk->bins - 1 && sk->nchan < SKIM_MAX_CHAN; b++) {
+        if (sk->avg[b] <= sk->floor[b] * SKIM_SNR || sk->avg[b] <= strongest * SKIM_RANGE || sk->avg[b] <= band * SKIM_SNR)
+            continue;
+        if (sk->avg[b] < sk->avg[b - 1] || sk->avg[b] < sk->avg[b + 1])
+            continue;
+        if (sk->chan_of[b] >= 0 || sk->chan_of[b - 1] >= 0 || sk->chan_of[b + 1] >= 0)
+            continue;
+        if ((ch = calloc(1, sizeof(*ch))) == NULL)
+            return;
+        ch->bin = b;
+        ch->heard = now;
+        /* start on the first hop of the replay that already carries the signal */
+        ch->next = sk->first > SKIM_BATCH * (SKIM_REPLAY - 1) ? sk->first - SKIM_BATCH * (SKIM_REPLAY - 1) : 0;
+        while (ch->next < sk->first + sk->hops &&
+               sk->env[ch->next % (SKIM_BATCH * SKIM_REPLAY) * sk->bins + b] < sqrtf(sk->avg[b]) / (2 * sk->n))
+            ch->next++;
+        decoder_reset(&ch->dec, 1, open_memstream(&ch->text, &ch->len));
+        gate_init(&ch->gate, &ch->dec);
+        ch->gate.peak = ch->gate.floor = sqrtf(sk->floor[b]) / sk->n;
+        sk->chan_of[b] = sk->nchan;
+        sk->chan[sk->nchan++] = ch;
+    }
+    for (c = sk->nchan - 1; c >= 0; c--)
+        if (now - sk->chan[c]->heard > SKIM_HOLD)
+            skim_close(sk, c, now);
+    sk->peak_chan = sk->nchan > sk->peak_chan ? sk->nchan : sk->peak_chan;
+}
+
+static void skim_batch(struct skimmer *sk)
+{
+    int c;
+    skim_detect(sk, (int64_t)((sk->first + sk->hops) * sk->hop * 1000000 / sk->rate));
+    skim_run(sk);
+    for (c = 0; c < sk->nchan; c++)
+        skim_show(sk, sk->chan[c], 0);
+    if (sk->print)
+        fflush(sk->print);
+    sk->first += sk->hops;
+    sk->hops = 0;
+}
+
+static void skim_hop(struct skimmer *sk)
+{
+    float *row = sk->env + (sk->first + sk->hops) % (SKIM_BATCH * SKIM_REPLAY) * sk->bins, p;
+    int i;
+    for (i = 0; i < sk->n; i++) {
+        sk->re[i] = sk->ring[(sk->pos + i) % sk->n] * sk->window[i];
+        sk->im[i] = 0;
+    }
+    fft_run(&sk->fft, sk->re, sk->im);
+    for (i = 0; i < sk->bins; i++) {
+        p = sk->re[sk->lo + i] * sk->re[sk->lo + i] + sk->im[sk->lo + i] * sk->im[sk->lo + i];
+        row[i] = sqrtf(p) / sk->n;
+        sk->avg[i] += (p - sk->avg[i]) * (1.0f / 64);
+        sk->smooth[i] += (p - sk->smooth[i]) * (1.0f / 8);
+        /* no floor until the first window is full of audio */
+        if (sk->floor[i] < 0 || sk->first + sk->hops < (uint64_t)sk->n / sk->hop)
+            sk->floor[i] = sk->smooth[i] = p;
+        /* falls quickly into the gaps, creeps back up over seconds */
+        sk->floor[i] += (sk->smooth[i] - sk->floor[i]) * (sk->smooth[i] < sk->floor[i] ? 1.0f / 4 : 1.0f / 2048);
+    }
+    if (++sk->hops == SKIM_BATCH)
+        skim_batch(sk);
+}
+
+static void skim_feed(struct skimmer *sk, const float *x, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        sk->ring[sk->pos] = x[i];
+        sk->pos = (sk->pos + 1) % sk->n;
+        if (++sk->fill == sk->hop) {
+            sk->fill = 0;
+            skim_hop(sk);
+        }
+    }
+}
+
+static int skim_init(struct skimmer *sk, unsigned int srate, FILE *print)
+{
+    struct skim_worker *wk;
+    int i;
+    memset(sk, 0, sizeof(*sk));
+    sk->rate = srate;
+    for (sk->n = 64; srate / sk->n > SKIM_RES_HZ; sk->n <<= 1)
+        ;
+    sk->hop = (uint64_t)srate * TONE_BLOCK_USEC / 1000000;
+    sk->hop_usec = (uint64_t)sk->hop * 1000000 / srate;
+    sk->lo = (uint64_t)SKIM_LO * sk->n / srate;
+    sk->bins = (uint64_t)SKIM_HI * sk->n / srate - sk->lo;
+    sk->bins = sk->bins < sk->n / 2 - sk->lo ? sk->bins : sk->n / 2 - sk->lo;
+    sk->print = print;
+    sk->ring = calloc(sk->n, sizeof(float));
+    sk->window = malloc(sk->n * sizeof(float));
+    sk->re = malloc(sk->n * sizeof(float));
+    sk->im = malloc(sk->n * sizeof(float));
+    sk->env = malloc(SKIM_BATCH * SKIM_REPLAY * sk->bins * sizeof(float));
+    sk->avg = calloc(sk->bins, sizeof(float));
+    sk->smooth = calloc(sk->bins, sizeof(float));
+    sk->floor = malloc(sk->bins * sizeof(float));
+    sk->band = malloc(sk->bins * sizeof(float));
+    sk->chan_of = malloc(sk->bins * sizeof(int));
+    if (!sk->ring || !sk->window || !sk->re || !sk->im || !sk->env || !sk->avg || !sk->smooth || !sk->floor || !sk->band || !sk->chan_of || fft_init(&sk->fft, sk->n))
+        return -1;
+    for (i = 0; i < sk->n; i++)
+        sk->window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / sk->n);
+    for (i = 0; i < sk->bins; i++) {
+        sk->chan_of[i] = -1;
+        sk->floor[i] = -1;
+    }
+    pthread_mutex_init(&sk->lock, NULL);
+    pthread_cond_init(&sk->start, NULL);
+    pthread_cond_init(&sk->finish, NULL);
+    i = sysconf(_SC_NPROCESSORS_ONLN);
+    i = i < 1 ? 1 : i > SKIM_MAX_WORKERS ? SKIM_MAX_WORKERS : i;
+    for (sk->workers = 1; sk->workers < i; sk->workers++) {
+        if ((wk = malloc(sizeof(*wk))) == NULL)
+            break;
+        wk->sk = sk;
+        wk->id = sk->workers;
+        if (pthread_create(&sk->threads[sk->workers], NULL, skim_worker, wk) != 0) {
+            free(wk);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* flush the last batch, close every channel and stop the pool */
+static void skim_finish(struct skimmer *sk)
+{
+    int64_t now;
+    int w;
+    if (sk->hops)
+        skim_batch(sk);
+    now = (int64_t)(sk->first * sk->hop * 1000000 / sk->rate);
+    while (sk->nchan > 0)
+        skim_close(sk, sk->nchan - 1, now);
+    pthread_mutex_lock(&sk->lock);
+    sk->quit = 1;
+    pthread_cond_broadcast(&sk->start);
+    pthread_mutex_unlock(&sk->lock);
+    for (w = 1; w < sk->workers; w++)
+        pthread_join(sk->threads[w], NULL);
+    pthread_cond_destroy(&sk->finish);
+    pthread_cond_destroy(&sk->start);
+    pthread_mutex_destroy(&sk->lock);
+    fft_free(&sk->fft);
+    free(sk->ring);
+    free(sk->window);
+    free(sk->re);
+    free(sk->im);
+    free(sk->env);
+    free(sk->avg);
+    free(sk->smooth);
+    free(sk->floor);
+    free(sk->band);
+    free(sk->chan_of);
+}
+
+/*
+ *   Decode every CW signal in the passband of a capture device or WAV file
+ */
+int SkimDaemon(const char *src_name)
+{
+    struct audio_source src = { NULL, NULL, 0, 0, 0, 0 };
+    struct skimmer *sk;
+    struct stat st;
+    pthread_t BL_pid;
+    unsigned char *raw;
+    float *pcm;
+    long n;
+    double t0 = mono_time(), secs;
+    int err = -1, blocker = 0, peak, live = stat(src_name, &st) < 0 || !S_ISREG(st.st_mode);
+    if (live ? capture_open(&src, src_name) : wav_open(&src, src_name))
+        return -1;
+    raw = malloc(AUDIO_CHUNK * src.bytes * src.channels);
+    pcm = malloc(AUDIO_CHUNK * sizeof(float));
+    sk = malloc(sizeof(*sk));
+    if (raw == NULL || pcm == NULL || sk == NULL || skim_init(sk, src.rate, stdout) < 0) {
+        printf("[!] No enough memory. Error code: skim\n");
+        goto out;
+    }
+    if (live && (blocker = pthread_create(&BL_pid, NULL, getEnter, NULL) == 0))
+        printf("\n[+] Skimming %s (ESC-ENTER to stop):\n\n", src_name);
+    printf("%d Hz to %d Hz in %.1f Hz bins, %d workers\n", SKIM_LO, SKIM_HI, (double)src.rate / sk->n, sk->workers);
+    while (!m_Interrupt && (n = audio_read(&src, raw, pcm, AUDIO_CHUNK)) > 0)
+        skim_feed(sk, pcm, n);
+    secs = (double)(sk->first + sk->hops) * sk->hop / src.rate;
+    skim_finish(sk);
+    peak = sk->peak_chan;
+    printf("\n[-] Up to %d channels", peak);
+    if (!live)
+        printf("; %.1f s of audio in %.2f s", secs, mono_time() - t0);
+    printf(".\n");
+    if (blocker)
+        pthread_join(BL_pid, NULL);
+    err = 0;
+out:
+    audio_close(&src);
+    free(sk);
+    free(raw);
+    free(pcm);
+    return err;
+}
+
+/*
+ *   Training server (--serve, --load)
+ *
+ *   One process keys for many trainees. A client connects to a Unix
+ *   stream socket and sends text, and half closes when it has sent all
+ *   of it; its session keys the text through the same encoder, timeline
+ *   and player as the sound card path and streams it back in frames of
+ *   a type byte and a 24 bit little endian length:
+ *
+ *     'H'  rate (4 bytes), channels (2), bytes per frame (2), format name
+ *     'P'  one tick of PCM in that format
+ *     'T'  text the session's decoder copied from its own keying
+ *     'E'  the text is played out, the server closes the connection
+ *
+ *   Every SERVE_TICK_USEC one timer wakes the server and the live
+ *   sessions are shared out to a bounded pool of workers, each session
+ *   rendering one tick. Sessions live in fixed size arenas allocated up
+ *   front for --sessions of them, so the per session CPU and memory do
+ *   not depend on how many there are. A client that does not keep up
+ *   is skipped until its last tick went out.
+ */
+#define SERVE_TICK_USEC 20000
+#define SERVE_INBOX 4096            /* bytes of text waiting, power of two */
+#define SERVE_TEXT 1024             /* decoded text per tick */
+#define SERVE_HEADER 4
+#define SERVE_EVENTS 64
+#define SERVE_MAX_SESSIONS 4096
+#define SERVE_MAX_WORKERS 64
+#define LOAD_TEXT 4096              /* decoded text kept per load client */
+#define LOAD_TIMEOUT 10.0           /* seconds without a frame before giving up */
+
+enum { SERVE_LISTEN, SERVE_TIMER, SERVE_SIGNAL, SERVE_SESSION };
+
+struct serve_session {
+    int fd;                 /* -1 while the slot is free */
+    int eof;                /* the client sent all of its text */
+    int paused;             /* inbox full, not reading the socket */
+    int ended;              /* the end frame is queued */
+    int closing;            /* close after this tick */
+    unsigned int in_head, in_tail;
+    struct cw_encoder enc;
+    struct player pl;
+    struct decoder dec;
+    FILE *text;             /* decoder output, into text_buf */
+    uint64_t clock, edge;   /* frames rendered, frame the mark or space began */
+    int marking;
+    size_t out_len, out_sent;
+    unsigned char *out;     /* frames of the tick, at the end of the arena */
+    struct timeline tl;
+    unsigned char inbox[SERVE_INBOX];
+    char text_buf[SERVE_TEXT];
+};
+
+struct server {
+    unsigned char *arena;
+    size_t slot_bytes;
+    int slots, active, peak;
+    int *free_slot, nfree;
+    snd_pcm_uframes_t tick_frames;
+    unsigned long served, refused, late;
+    uint64_t frames;        /* rendered by the closed sessions */
+    int task[SERVE_MAX_SESSIONS], ntasks;
+    /* worker pool, worker 0 is the event loop */
+    int workers;
+    pthread_t threads[SERVE_MAX_WORKERS];
+    unsigned int next, generation;
+    int busy;               /* pool workers not yet through the generation */
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t start, finish;
+};
+
+static int serve_sessions = 256;    /* --sessions */
+static int serve_workers = 0;       /* --workers, 0 for one per online CPU */
+
+static struct serve_session *serve_slot(struct server *sv, int i)
+{
+    return (struct serve_session *)(sv->arena + i * sv->slot_bytes);
+}
+
+static int64_t serve_usec(uint64_t frames)
+{
+    return (int64_t)(frames * 1000000 / rate);
+}
+
+/* let [want] descriptors be open, as far as the hard limit goes */
+static void serve_nofile(int want)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)want) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)want ? rl.rlim_max : (rlim_t)want;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* queue a frame header, the payload goes at the pointer returned */
+static unsigned char *serve_frame(struct serve_session *s, int type, size_t len)
+{
+    unsigned char *p = s->out + s->out_len;
+    p[0] = type;
+    put_le(p + 1, len, 3);
+    s->out_len += SERVE_HEADER + len;
+    return p + SERVE_HEADER;
+}
+
+/* send what is queued: 0 when all went out, 1 if the client is behind, -1 if gone */
+static int serve_flush(struct serve_session *s)
+{
+    ssize_t n;
+    while (s->out_sent < s->out_len) {
+        n = send(s->fd, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (n <= 0) {
+            s->closing = 1;
+            return -1;
+        }
+        s->out_sent += n;
+    }
+    s->closing |= s->ended;
+    return 0;
+}
+
+/* the keying turns to [mark]: close the span before it for the decoder */
+static void serve_edge(struct serve_session *s, int mark)
+{
+    struct key_span span;
+    if (mark == s->marking)
+        return;
+    span.end = serve_usec(s->clock);
+    span.usec = serve_usec(s->clock - s->edge);
+    span.mark = s->marking;
+    decoder_span(&s->dec, &span);
+    s->marking = mark;
+    s->edge = s->clock;
+}
+
+/* render frames of the session's keying into dst, 1 once it is all played */
+static int serve_render(struct serve_session *s, unsigned char *dst, snd_pcm_uframes_t frames)
+{
+    const struct cw_event *next;
+    snd_pcm_uframes_t n;
+    int done = 0;
+    while (frames > 0) {
+        if (s->pl.pos == s->pl.cur.frames) {
+            if (timeline_count(&s->tl) == 0) {
+                done = player_fill(&s->pl, &s->tl, &elem_cache, dst, frames);
+                s->clock += frames;
+                break;
+            }
+            next = &s->tl.ev[s->tl.tail % TIMELINE_SIZE];
+            serve_edge(s, next->elem == ELEM_DIT || next->elem == ELEM_DAH);
+            n = next->frames;
+        } else
+            n = s->pl.cur.frames - s->pl.pos;
+        n = n < frames ? n : frames;
+        player_fill(&s->pl, &s->tl, &elem_cache, dst, n);
+        s->clock += n;
+        dst += n * frame_bytes;
+        frames -= n;
+    }
+    /* past the last word gap at the end, so the last word comes out */
+    decoder_tick(&s->dec, serve_usec(s->clock) + (done ? s->dec.thr_space : 0));
+    return done;
+}
+
+/* one tick of a session, run by a worker */
+static void serve_step(struct server *sv, struct serve_session *s)
+{
+    long n;
+    int done;
+    while (s->in_tail != s->in_head && timeline_count(&s->tl) <= TIMELINE_SIZE - RENDER_SLACK)
+        encoder_feed(&s->enc, &s->tl, s->inbox[s->in_tail++ % SERVE_INBOX]);
+    if (s->eof && s->in_tail == s->in_head && !s->tl.done) {
+        if (s->enc.len)
+            encoder_flush(&s->enc, &s->tl);
+        s->tl.done = 1;
+    }
+    if (serve_flush(s) != 0 || s->ended)
+        return;
+    s->out_len = s->out_sent = 0;
+    done = serve_render(s, serve_frame(s, 'P', sv->tick_frames * frame_bytes), sv->tick_frames);
+    if ((n = ftell(s->text)) > 0) {
+        memcpy(serve_frame(s, 'T', n), s->text_buf, n);
+        rewind(s->text);
+    }
+    if (done) {
+        serve_frame(s, 'E', 0);
+        s->ended = 1;
+    }
+    serve_flush(s);
+}
+
+static void serve_steal(struct server *sv)
+{
+    unsigned int i;
+    while ((i = __atomic_fetch_add(&sv->next, 1, __ATOMIC_RELAXED)) < (unsigned int)sv->ntasks)
+        serve_step(sv, serve_slot(sv, sv->task[i]));
+}
+
+static void *serve_worker(void *arg)
+{
+    struct server *sv = arg;
+    unsigned int seen = 0;
+    pthread_mutex_lock(&sv->lock);
+    while (1) {
+        while (sv->generation == seen && !sv->quit)
+            pthread_cond_wait(&sv->start, &sv->lock);
+        if (sv->quit)
+            break;
+        seen = sv->generation;
+        pthread_mutex_unlock(&sv->lock);
+        serve_steal(sv);
+        pthread_mutex_lock(&sv->lock);
+        if (--sv->busy == 0)
+            pthread_cond_signal(&sv->finish);
+    }
+    pthread_mutex_unlock(&sv->lock);
+    return 0;
+}
+
+/* run one tick of every live session, shared out to the pool */
+static void serve_run(struct server *sv)
+{
+    if (!sv->ntasks)
+        return;
+    /* the pool is all waiting on start, nobody reads next or the tasks */
+    sv->next = 0;
+    pthread_mutex_lock(&sv->lock);
+    sv->busy = sv->workers - 1;
+    sv->generation++;
+    pthread_cond_broadcast(&sv->start);
+    pthread_mutex_unlock(&sv->lock);
+    serve_steal(sv);
+    /* every task is taken once the loop is through, and done once the pool is */
+    pthread_mutex_lock(&sv->lock);
+    while (sv->busy > 0)
+        pthread_cond_wait(&sv->finish, &sv->lock);
+    pthread_mutex_unlock(&sv->lock);
+}
+
+static int serve_init(struct server *sv)
+{
+    size_t out = 3 * SERVE_HEADER + SERVE_TEXT;
+    int i;
+    memset(sv, 0, sizeof(*sv));
+    sv->slots = serve_sessions;
+    sv->tick_frames = (uint64_t)rate * SERVE_TICK_USEC / 1000000;
+    out += sv->tick_frames * frame_bytes;
+    sv->slot_bytes = (sizeof(struct serve_session) + out + 63) & ~(size_t)63;
+    sv->arena = calloc(sv->slots, sv->slot_bytes);
+    sv->free_slot = malloc(sv->slots * sizeof(int));
+    if (sv->arena == NULL || sv->free_slot == NULL)
+        return -1;
+    for (i = sv->slots - 1; i >= 0; i--) {
+        struct serve_session *s = serve_slot(sv, i);
+        s->fd = -1;
+        s->out = (unsigned char *)(s + 1);
+        if ((s->text = fmemopen(s->text_buf, SERVE_TEXT, "w")) == NULL)
+            return -1;
+        setvbuf(s->text, NULL, _IONBF, 0);
+        sv->free_slot[sv->nfree++] = i;
+    }
+    sv->workers = serve_workers ? serve_workers : sysconf(_SC_NPROCESSORS_ONLN);
+    sv->workers = sv->workers < 1 ? 1 : sv->workers > SERVE_MAX_WORKERS ? SERVE_MAX_WORKERS : sv->workers;
+    pthread_mutex_init(&sv->lock, NULL);
+    pthread_cond_init(&sv->start, NULL);
+    pthread_cond_init(&sv->finish, NULL);
+    for (i = 1; i < sv->workers; i++) {
+        if (pthread_create(&sv->threads[i], NULL, serve_worker, sv) != 0) {
+            printf("[!] Fail to create server worker thread.\n");
+            sv->workers = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void serve_free(struct server *sv)
+{
+    int i;
+    pthread_mutex_lock(&sv->lock);
+    sv->quit = 1;
+    pthread_cond_broadcast(&sv->start);
+    pthread_mutex_unlock(&sv->lock);
+    for (i = 1; i < sv->workers; i++)
+        pthread_join(sv->threads[i], NULL);
+    for (i = 0; i < sv->slots; i++) {
+        if (serve_slot(sv, i)->text)
+            fclose(serve_slot(sv, i)->text);
+    }
+    free(sv->arena);
+    free(sv->free_slot);
+}
+
+/* a new client in slot [i], greeted with the stream format */
+static void serve_open(struct server *sv, int i, int fd)
+{
+    struct serve_session *s = serve_slot(sv, i);
+    const char *name = snd_pcm_format_name(format);
+    unsigned char *p;
+    s->fd = fd;
+    s->eof = s->paused = s->ended = s->closing = 0;
+    s->in_head = s->in_tail = 0;
+    memset(&s->enc, 0, sizeof(s->enc));
+    memset(&s->pl, 0, sizeof(s->pl));
+    timeline_reset(&s->tl);
+    rewind(s->text);
+    decoder_reset(&s->dec, 0, s->text);
+    s->clock = s->edge = 0;
+    s->marking = 0;
+    s->out_len = s->out_sent = 0;
+    p = serve_frame(s, 'H', 8 + strnlen(name, SERVE_HEADER * 4));
+    put_le(p, rate, 4);
+    put_le(p + 4, channels, 2);
+    put_le(p + 6, frame_bytes, 2);
+    memcpy(p + 8, name, strnlen(name, SERVE_HEADER * 4));
+    if (++sv->active > sv->peak)
+        sv->peak = sv->active;
+}
+
+static void serve_close(struct server *sv, int i, int epfd)
+{
+    struct serve_session *s = serve_slot(sv, i);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+    sv->frames += s->clock;
+    sv->free_slot[sv->nfree++] = i;
+    sv->active--;
+    sv->served++;
+}
+
+/* take what the client sent into the inbox, off the loop while it is full */
+static void serve_read(struct serve_session *s, int epfd)
+{
+    unsigned int space, at;
+    ssize_t n;
+    while ((space = SERVE_INBOX - (s->in_head - s->in_tail)) > 0) {
+        at = s->in_head % SERVE_INBOX;
+        n = read(s->fd, s->inbox + at, space < SERVE_INBOX - at ? space : SERVE_INBOX - at);
+        if (n > 0) {
+            s->in_head += n;
+            continue;
+        }
+        if (n == 0)
+            s->eof = 1;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            s->closing = 1;
+        if (n == 0 || s->closing)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+        return;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    s->paused = 1;
+}
+
+int ServeDaemon(const char *path)
+{
+    struct epoll_event evs[SERVE_EVENTS];
+    struct sockaddr_un addr;
+    struct itimerspec tick = { { 0, SERVE_TICK_USEC * 1000 }, { 0, SERVE_TICK_USEC * 1000 } };
+    struct server *sv;
+    struct stat st;
+    sigset_t mask;
+    uint64_t ticks;
+    double t0 = mono_time(), cpu0, secs;
+    int lfd, epfd, timer_fd, sig_fd, fd, n, i, quit = 0, due, err = 0;
+    struct serve_session *s;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("[!] Socket path %s is too long.\n", path);
+        return -1;
+    }
+    if (stat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        printf("[!] %s is there and not a socket.\n", path);
+        return -1;
+    }
+    synth_select();
+    if (elem_cache_update(&elem_cache) < 0)
+        return -1;
+    serve_nofile(serve_sessions + 64);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if ((sv = malloc(sizeof(*sv))) == NULL || serve_init(sv) < 0) {
+        printf("[!] No enough memory. Error code: server\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (lfd < 0 || epfd < 0 || timer_fd < 0 || sig_fd < 0 ||
+        bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, SOMAXCONN) < 0 ||
+        timerfd_settime(timer_fd, 0, &tick, NULL) < 0 ||
+        loop_watch(epfd, lfd, EPOLLIN, SERVE_LISTEN) < 0 || loop_watch(epfd, timer_fd, EPOLLIN, SERVE_TIMER) < 0 ||
+        loop_watch(epfd, sig_fd, EPOLLIN, SERVE_SIGNAL) < 0) {
+        printf("[!] Server setup on %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    printf("[+] Serving up to %d sessions on %s, %d workers, %u Hz %s, ticks of %d ms.\n",
+           sv->slots, path, sv->workers, rate, snd_pcm_format_name(format), SERVE_TICK_USEC / 1000);
+    cpu0 = cpu_time();
+    while (!quit) {
+        if ((n = epoll_wait(epfd, evs, SERVE_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("[!] Server wait failed: %s\n", strerror(errno));
+            err = -1;
+            break;
+        }
+        for (i = due = 0; i < n; i++) {
+            switch (evs[i].data.u32) {
+            case SERVE_LISTEN:
+                while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    if (!sv->nfree || loop_watch(epfd, fd, EPOLLIN, SERVE_SESSION + sv->free_slot[sv->nfree - 1]) < 0) {
+                        close(fd);
+                        sv->refused++;
+                        continue;
+                    }
+                    serve_open(sv, sv->free_slot[--sv->nfree], fd);
+                }
+                break;
+            case SERVE_TIMER:
+                if (read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+                    sv->late += ticks - 1;
+                    due = 1;
+                }
+                break;
+            case SERVE_SIGNAL:
+                quit = 1;
+                break;
+            default:
+                serve_read(serve_slot(sv, evs[i].data.u32 - SERVE_SESSION), epfd);
+            }
+        }
+        if (!due)
+            continue;
+        for (i = sv->ntasks = 0; i < sv->slots; i++) {
+            s = serve_slot(sv, i);
+            if (s->fd >= 0 && !s->closing)
+                sv->task[sv->ntasks++] = i;
+        }
+        serve_run(sv);
+        for (i = 0; i < sv->slots; i++) {
+            s = serve_slot(sv, i);
+            if (s->fd < 0)
+                continue;
+            if (s->closing) {
+                serve_close(sv, i, epfd);
+            } else if (s->paused && s->in_head - s->in_tail < SERVE_INBOX) {
+                loop_watch(epfd, s->fd, EPOLLIN, SERVE_SESSION + i);
+                s->paused = 0;
+            }
+        }
+    }
+    for (i = 0; i < sv->slots; i++) {
+        if (serve_slot(sv, i)->fd >= 0)
+            serve_close(sv, i, epfd);
+    }
+    secs = (double)sv->frames / rate;
+    printf("\n[-] Served %lu sessions, %d at most at once, %.0f s of audio in %.0f s.\n",
+           sv->served, sv->peak, secs, mono_time() - t0);
+    if (secs > 0)
+        printf("[-] %.3f ms of CPU per second of session audio.\n", (cpu_time() - cpu0) * 1000 / secs);
+    if (sv->late || sv->refused)
+        printf("[!] %lu ticks late, %lu clients refused.\n", sv->late, sv->refused);
+    serve_free(sv);
+    free(sv);
+    close(sig_fd);
+    close(timer_fd);
+    close(lfd);
+    close(epfd);
+    unlink(path);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    printf("[-] Server closed.\n");
+    return err;
+}
+
+/*
+ *   Load test client: rounds of 1, 4, 16... up to --sessions clients
+ *   key the same text at once; each round shows the server's CPU per
+ *   second of session audio and resident memory per session, read from
+ *   /proc of the server process, and the worst gap between two ticks
+ */
+struct load_client {
+    int fd, done;
+    unsigned char head[SERVE_HEADER], hello[8];
+    size_t got, size, left; /* header bytes, frame length, payload bytes still to come */
+    int type;
+    uint64_t pcm;           /* bytes of PCM received */
+    double first, last, gap;
+    char text[LOAD_TEXT];
+    size_t len;
+};
+
+struct load_round {
+    double audio, cpu, gap;
+    long rss;
+    int ok;
+};
+
+static unsigned int load_rate, load_frame;
+
+/* server CPU seconds and resident KiB from /proc */
+static int load_proc(pid_t pid, double *cpu, long *rss)
+{
+    char path[64], line[512], *p;
+    unsigned long ut, st;
+    FILE *f;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    p = fgets(line, sizeof(line), f) ? strrchr(line, ')') : NULL;
+    fclose(f);
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2)
+        return -1;
+    *cpu = (double)(ut + st) / sysconf(_SC_CLK_TCK);
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld", rss) == 1)
+            break;
+    fclose(f);
+    return 0;
+}
+
+static int load_connect(const char *path, pid_t *pid)
+{
+    struct sockaddr_un addr;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (pid && getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+        *pid = cred.pid;
+    return fd;
+}
+
+/* follow the frames in n bytes at p */
+static void load_parse(struct load_client *c, const unsigned char *p, size_t n, double now)
+{
+    size_t k;
+    while (n > 0) {
+        if (c->got < SERVE_HEADER) {
+            c->head[c->got++] = *p++;
+            n--;
+            if (c->got < SERVE_HEADER)
+                continue;
+            c->type = c->head[0];
+            c->size = c->left = get_le(c->head + 1, 3);
+            if (c->type == 'P') {
+                c->gap = c->last && now - c->last > c->gap ? now - c->last : c->gap;
+                c->first = c->first ? c->first : now;
+                c->last = now;
+            }
+            c->done |= c->type == 'E';
+        }
+        k = c->left < n ? c->left : n;
+        if (c->type == 'P')
+            c->pcm += k;
+        else if (c->type == 'T' && c->len + k < LOAD_TEXT) {
+            memcpy(c->text + c->len, p, k);
+            c->len += k;
+        } else if (c->type == 'H' && c->size - c->left < sizeof(c->hello)) {
+            memcpy(c->hello + c->size - c->left, p, k < sizeof(c->hello) - (c->size - c->left) ? k : sizeof(c->hello) - (c->size - c->left));
+            load_rate = get_le(c->hello, 4);
+            load_frame = get_le(c->hello + 6, 2);
+        }
+        c->left -= k;
+        p += k;
+        n -= k;
+        if (c->left == 0)
+            c->got = 0;
+    }
+}
+
+/* upper case, single spaces, no space at either end */
+static void load_squeeze(char *dst, const char *src)
+{
+    char *p = dst;
+    for (; *src; src++) {
+        if (isspace((unsigned char)*src)) {
+            if (p != dst && p[-1] != ' ')
+                *p++ = ' ';
+        } else
+            *p++ = toupper((unsigned char)*src);
+    }
+    if (p != dst && p[-1] == ' ')
+        p--;
+    *p = 0;
+}
+
+static int load_round(const char *path, pid_t pid, int count, const char *text, size_t len,
+              const char *want, struct load_round *r)
+{
+    struct epoll_event ev, evs[SERVE_EVENTS];
+    struct load_client *cl = calloc(count, sizeof(*cl));
+    unsigned char *buf = malloc(1 << 16);
+    char *got = malloc(LOAD_TEXT);
+    double cpu0, cpu1, t, heard = mono_time();
+    long rss = 0;
+    int epfd = epoll_create1(EPOLL_CLOEXEC), left, streaming = 0, i, n;
+    ssize_t k;
+    memset(r, 0, sizeof(*r));
+    if (cl == NULL || buf == NULL || got == NULL || epfd < 0) {
+        printf("[!] No enough memory. Error code: load\n");
+        return -1;
+    }
+    load_proc(pid, &cpu0, &rss);
+    for (i = 0; i < count; i++) {
+        if ((cl[i].fd = load_connect(path, NULL)) < 0) {
+            printf("[!] Unable to connect to %s: %s\n", path, strerror(errno));
+            count = i;
+            break;
+        }
+        if (send(cl[i].fd, text, len, MSG_NOSIGNAL) != (ssize_t)len)
+            printf("[!] Session %d sent only part of the text.\n", i);
+        shutdown(cl[i].fd, SHUT_WR);
+        fcntl(cl[i].fd, F_SETFL, fcntl(cl[i].fd, F_GETFL) | O_NONBLOCK);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, cl[i].fd, &ev);
+    }
+    left = count;
+    while (left > 0 && mono_time() - heard < LOAD_TIMEOUT) {
+        if ((n = epoll_wait(epfd, evs, SERVE_EVENTS, 1000)) < 0 && errno != EINTR)
+            break;
+        t = mono_time();
+        for (i = 0; i < n; i++) {
+            struct load_client *c = &cl[evs[i].data.u32];
+            while ((k = read(c->fd, buf, 1 << 16)) > 0) {
+                load_parse(c, buf, k, t);
+                heard = t;
+            }
+            if (k == 0 || (k < 0 && errno != EAGAIN)) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                left--;
+            }
+        }
+        /* the memory in use with every session streaming */
+        if (!streaming) {
+            for (i = 0, streaming = 1; i < count && streaming; i++)
+                streaming = cl[i].first > 0;
+            if (streaming)
+                load_proc(pid, &cpu1, &rss);
+        }
+    }
+    load_proc(pid, &cpu1, &rss);
+    r->rss = streaming ? rss : 0;
+    for (i = 0; i < count; i++) {
+        cl[i].text[cl[i].len] = 0;
+        load_squeeze(got, cl[i].text);
+        r->ok += cl[i].done && !strcmp(got, want);
+        r->audio += load_frame && load_rate ? (double)cl[i].pcm / load_frame / load_rate : 0;
+        r->gap = cl[i].gap > r->gap ? cl[i].gap : r->gap;
+        close(cl[i].fd);
+    }
+    r->cpu = r->audio > 0 ? (cpu1 - cpu0) * 1000 / r->audio : 0;
+    r->audio = count ? r->audio / count : 0;
+    close(epfd);
+    free(cl);
+    free(buf);
+    free(got);
+    return count;
+}
+
+int LoadDaemon(const char *path, const char *text, size_t len)
+{
+    struct load_round r;
+    char *want = malloc(len + 1), *copy = malloc(len + 1);
+    long idle;
+    double cpu;
+    pid_t pid = 0;
+    int count, done, fd;
+    if (want == NULL || copy == NULL) {
+        printf("[!] No enough memory. Error code: load\n");
+        return -1;
+    }
+    memcpy(copy, text, len);
+    copy[len] = 0;
+    load_squeeze(want, copy);
+    serve_nofile(serve_sessions + 64);
+    /* an empty session, only to learn who the server is */
+    if ((fd = load_connect(path, &pid)) < 0 || pid <= 0) {
+        printf("[!] No server on %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    usleep(2 * SERVE_TICK_USEC);
+    if (load_proc(pid, &cpu, &idle) < 0) {
+        printf("[!] Unable to read /proc of server %d.\n", (int)pid);
+        return -1;
+    }
+    printf("[+] Loading the server on %s (pid %d), %zu bytes of text per session.\n\n", path, (int)pid, len);
+    printf("Sessions  Audio s  CPU ms/s  KiB/session  Worst gap ms  Decoded\n");
+    for (count = 1; ; count = count * 4 < serve_sessions ? count * 4 : serve_sessions) {
+        if ((done = load_round(path, pid, count, text, len, want, &r)) < 0)
+            break;
+        printf("%8d %8.1f %9.3f %12.1f %13.1f  %d/%d\n", done, r.audio, r.cpu,
+               r.rss > idle ? (double)(r.rss - idle) / done : 0.0, r.gap * 1000, r.ok, done);
+        if (done < count || count >= serve_sessions)
+            break;
+    }
+    free(want);
+    free(copy);
     return 0;
 }
 
-void * KeyDaemon_CW()
+/*
+ *   Benchmarks (--bench), run without a sound device
+ */
+/* read one sample of the selected format back as [-1, 1] */
+static double bench_sample(const unsigned char *p)
+{
+    uint32_t v = 0;
+    float f;
+    int i;
+    for (i = 0; i < synth_bits / 8; i++)
+        v |= (uint32_t)p[synth_big_endian ? synth_phys_bps - 1 - i : i] << (i * 8);
+    if (synth_float) {
+        memcpy(&f, &v, sizeof(f));
+        return f;
+    }
+    if (synth_unsigned)
+        v ^= 1U << (synth_bits - 1);
+    if (synth_bits < 32 && ((v >> (synth_bits - 1)) & 1))
+        v |= ~0U << synth_bits;
+    return (int32_t)v / (double)((1U << (synth_bits - 1)) - 1);
+}
+
+static int bench_synth(void)
+{
+    static const snd_pcm_format_t formats[] = {
+        SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S16_BE,
+        SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S32_BE,
+        SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_FLOAT_BE
+    };
+    snd_pcm_format_t saved_format = format;
+    unsigned int saved_channels = channels;
+    const int frames = 1 << 21;
+    snd_pcm_channel_area_t areas[2];
+    int f, chn, i, fails = 0;
+    printf("Tone synthesis, %u Hz at %.0f Hz, %d frames per run\n", rate, freq, frames);
+    printf("%-10s %2s %12s %12s %8s %10s\n", "format", "ch", "sin() Ms/s", "nco Ms/s", "speedup", "max err");
+    for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        for (chn = 1; chn <= 2; chn++) {
+            unsigned char *ref, *out;
+            double phase = 0, t0, t1, t2, err = 0, tol;
+            struct nco osc = { 0, 0 };
+            format = formats[f];
+            channels = chn;
+            synth_select();
+            ref = malloc((size_t)frames * frame_bytes);
+            out = malloc((size_t)frames * frame_bytes);
+            if (ref == NULL || out == NULL) {
+                printf("[!] No enough memory. Error code: bench\n");
+                return -1;
+            }
+            for (i = 0; i < chn; i++) {
+                areas[i].addr = ref;
+                areas[i].first = i * synth_phys_bps * 8;
+                areas[i].step = frame_bytes * 8;
+            }
+            nco_set_freq(&osc, freq, rate);
+            t0 = mono_time();
+            generate_sine_ref(areas, 0, frames, &phase);
+            t1 = mono_time();
+            for (i = 0; i < chn; i++)
+                areas[i].addr = out;
+            generate_sine(areas, 0, frames, &osc);
+            t2 = mono_time();
+            for (i = 0; i < frames * chn; i++) {
+                double d = fabs(bench_sample(ref + i * synth_phys_bps) - bench_sample(out + i * synth_phys_bps));
+                err = d > err ? d : err;
+            }
+            tol = synth_bits == 16 ? 1.0001 / 32767 : 1e-6;
+            fails += err > tol;
+            printf("%-10s %2d %12.1f %12.1f %7.1fx %10.2e %s\n", snd_pcm_format_name(format), chn,
+                   frames * chn / (t1 - t0) * 1e-6, frames * chn / (t2 - t1) * 1e-6,
+                   (t1 - t0) / (t2 - t1), err, err > tol ? "FAIL" : "ok");
+            free(ref);
+            free(out);
+        }
+    }
+    format = saved_format;
+    channels = saved_channels;
+    return fails ? -1 : 0;
+}
+
+/* sound at pcm[i]; a lone zero sample is the sine crossing zero inside a mark */
+static int timing_sound(const float *pcm, size_t i, size_t len)
+{
+    return pcm[i] != 0.0f || (i > 0 && i + 1 < len && pcm[i - 1] != 0.0f && pcm[i + 1] != 0.0f);
+}
+
+/*
+ *   Render text offline and measure every mark and gap in the output
+ *   against the timing model: with dah = 3 dits, element, character and
+ *   word gaps of 1, 3 and 7 dits, a run of n units lasts n * dit * rate
+ *   / 1e6 frames. The model comes from the codebook and the unit alone,
+ *   not from the element cache or the timeline. The speeds have dits in
+ *   multiples of 40 ms, whole frames at any rate that divides by 25 Hz.
+ */
+static int bench_timing(void)
+{
+    static const char text[] = "PARIS PARIS ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 /,?. ";
+    static const int wpms[] = { 5, 10, 15, 30 };
+    const int saved[4] = { usec_DI, usec_DA, usec_SGap, usec_BGap };
+    snd_pcm_format_t saved_format = format;
+    unsigned int saved_channels = channels;
+    struct player pl = { { 0, 0, "" }, 0, 0 };
+    struct cw_encoder enc = { { 0 }, 0, 0 };
+    long expect[4 * sizeof(text) * 8];  /* >0 mark, <0 gap, in units, then frames */
+    long err, max_err, run;
+    float *pcm = NULL;
+    size_t len, size = 0, i;
+    int w, k, bit, code, unit, nexp, bad, fails = 0;
+    const char *p;
+    double t0, t1;
+    format = SND_PCM_FORMAT_FLOAT;
+    channels = 1;
+    synth_select();
+    for (w = 0; w < (int)(sizeof(wpms) / sizeof(wpms[0])); w++) {
+        unit = 1200000 / wpms[w];
+        usec_DI = unit;
+        usec_DA = 3 * unit;
+        usec_SGap = unit;
+        usec_BGap = 3 * unit;
+        if (elem_cache_update(&elem_cache) < 0) {
+            fails++;
+            break;
+        }
+        /* the model, in units; back to back gaps are one silence */
+        for (p = text, nexp = 0; *p; p++) {
+            if ((code = cw_encode((unsigned char)*p)) == 0) {
+                expect[nexp - 1] -= 4;      /* the text starts with a letter */
+                continue;
+            }
+            for (bit = 30 - __builtin_clz(code); bit >= 0; bit--) {
+                expect[nexp++] = (code >> bit) & 1 ? 3 : 1;
+                if (bit)
+                    expect[nexp++] = -1;
+            }
+            expect[nexp++] = -3;
+        }
+        for (k = 0; k < nexp; k++)
+            expect[k] = (expect[k] < 0 ? -1 : 1) * (long)((unsigned long long)labs(expect[k]) * unit * rate / 1000000);
+        timeline_reset(&timeline);
+        len = 0;
+        t0 = mono_time();
+        for (p = text; *p; p++) {
+            size_t frames = 0;
+            encoder_feed(&enc, &timeline, *p);
+            for (k = timeline.tail; k != timeline.head; k++)
+                frames += timeline.ev[k % TIMELINE_SIZE].frames;
+            if (len + frames > size) {
+                size = (len + frames) * 2;
+                if ((pcm = realloc(pcm, size * sizeof(float) + 16)) == NULL) {
+                    printf("[!] No enough memory. Error code: bench\n");
+                    return -1;
+                }
+            }
+            player_fill(&pl, &timeline, &elem_cache, (unsigned char *)(pcm + len), frames);
+            len += frames;
+        }
+        t1 = mono_time();
+        /* measure: every change between sound and silence ends a run */
+        for (i = 1, k = 0, run = 1, bad = 0, max_err = 0; i <= len; i++, run++) {
+            if (i < len && timing_sound(pcm, i, len) == timing_sound(pcm, i - 1, len))
+                continue;
+            if (k >= nexp || (expect[k] < 0) == timing_sound(pcm, i - 1, len)) {
+                bad++;
+                break;
+            }
+            err = labs(run - labs(expect[k++]));
+            max_err = err > max_err ? err : max_err;
+            bad += err != 0;
+            run = 0;
+        }
+        bad += k != nexp;
+        printf("%2d WPM at %u Hz, dit %lu frames: %d of %d marks and gaps off the model, max error %ld frames; %.1f s of audio in %.2f ms\n",
+               wpms[w], rate, (unsigned long)((unsigned long long)unit * rate / 1000000), bad, nexp, max_err,
+               (double)len / rate, (t1 - t0) * 1e3);
+        fails += bad != 0;
+    }
+    free(pcm);
+    usec_DI = saved[0];
+    usec_DA = saved[1];
+    usec_SGap = saved[2];
+    usec_BGap = saved[3];
+    elem_cache_update(&elem_cache);
+    format = saved_format;
+    channels = saved_channels;
+    return fails ? -1 : 0;
+}
+
+/*
+ *   Round trip every symbol of the codebook through the encoder, the
+ *   timeline and the decode tables, then time the lookups
+ */
+static int bench_codebook(void)
+{
+#define CW_BENCH_ENTRY(k, t, c) { t, CW_PACK(c) },
+    static const struct cw_symbol latin[] = { CW_LATIN(CW_BENCH_ENTRY) CW_COMMON(CW_BENCH_ENTRY) CW_PROSIGNS(CW_BENCH_ENTRY) };
+    static const struct cw_symbol cyrillic[] = { CW_CYRILLIC(CW_BENCH_ENTRY) };
+    static const struct cw_symbol aliases[] = { CW_ALIASES(CW_BENCH_ENTRY) };
+    static const struct { const struct cw_symbol *sym; int count; const char *const *decode; } sets[] = {
+        { latin, sizeof(latin) / sizeof(latin[0]), cw_decode_latin },
+        { cyrillic, sizeof(cyrillic) / sizeof(cyrillic[0]), cw_decode_cyrillic },
+        { aliases, sizeof(aliases) / sizeof(aliases[0]), NULL },
+    };
+    struct cw_encoder enc = { { 0 }, 0, 0 };
+    int set, i, checked = 0, bad = 0;
+    unsigned int sum = 0;
+    const char *p;
+    double t0, t1;
+    long n;
+    for (set = 0; set < sizeof(sets) / sizeof(sets[0]); set++) {
+        for (i = 0; i < sets[set].count; i++) {
+            const struct cw_symbol *sym = &sets[set].sym[i];
+            struct cw_event ev;
+            int code = 1;
+            timeline_reset(&timeline);
+            for (p = sym->text; *p; p++)
+                encoder_feed(&enc, &timeline, (unsigned char)*p);
+            if (enc.len)
+                encoder_flush(&enc, &timeline);
+            while (timeline_pop(&timeline, &ev) == 0) {
+                if (ev.elem == ELEM_DIT || ev.elem == ELEM_DAH)
+                    code = code * 2 + (ev.elem == ELEM_DAH);
+                if (ev.elem == ELEM_BGAP && strcmp(ev.echo, sym->text))
+                    code = 0;
+            }
+            checked++;
+            if (code != sym->code || (sets[set].decode && (!sets[set].decode[code] || strcmp(sets[set].decode[code], sym->text)))) {
+                printf("[!] %s does not round trip (code %#x)\n", sym->text, code);
+                bad++;
+            }
+        }
+    }
+    t0 = mono_time();
+    for (n = 0; n < 50000000; n++)
+        sum += cw_encode('A' + n % 26);
+    t1 = mono_time();
+    for (n = 0; n < 50000000; n++)
+        sum += cw_decode_latin[(n & ((2 << CW_MAXLEN) - 1)) | 2] != NULL;
+    printf("Codebook: %d of %d symbols round trip; encode %.0f M/s, decode %.0f M/s (%u)\n",
+           checked - bad, checked, 50 / (t1 - t0), 50 / (mono_time() - t1), sum & 1);
+    timeline_reset(&timeline);
+    return bad ? -1 : 0;
+#undef CW_BENCH_ENTRY
+}
+
+/* edit distance of two strings, for character error rates */
+static long bench_distance(const char *a, const char *b)
+{
+    size_t n = strlen(b), i, j;
+    long *row = malloc((n + 1) * sizeof(long)), diag, up, d;
+    if (row == NULL)
+        return -1;
+    for (j = 0; j <= n; j++)
+        row[j] = j;
+    for (i = 0; a[i]; i++) {
+        diag = row[0];
+        row[0] = i + 1;
+        for (j = 1; j <= n; j++) {
+            up = row[j];
+            d = diag + (a[i] != b[j - 1]);
+            d = up + 1 < d ? up + 1 : d;
+            d = row[j - 1] + 1 < d ? row[j - 1] + 1 : d;
+            row[j] = d;
+            diag = up;
+        }
+    }
+    d = row[n];
+    free(row);
+    return d;
+}
+
+/*
+ *   A synthetic fist: how bench_key_text() keys a text
+ */
+struct bench_trace {
+    int wpm;
+    int ratio;              /* dah to dit, tenths */
+    int jitter;             /* most random error on any span, percent */
+    int weight;             /* percent of a dit and its space that is mark, 50 even */
+    int drift;              /* speed change from the first to the last span, percent */
+};
+
+static struct bench_trace bench_trace_opt = { 0, 30, 10, 50, 0 };    /* --trace, no wpm for the set */
+
+/*
+ *   Key a text as mark and space spans of tr, on a virtual clock at *t
+ */
+static int bench_key_text(const char *text, const struct bench_trace *tr,
+              struct rng *r, struct key_span *out, int max, int64_t *t)
+{
+    int n = 0, bit, code, gap = 0, jitter = tr->jitter, len = strlen(text) + 1, dit, extra;
+    const char *p;
+#define BENCH_SPAN(m, us) do { int u_ = (us) + (int)((int64_t)(us) * jitter / 100 * \
+        ((int)(rng_next(r) >> 49) - 16384) / 16384); \
+        *t += u_; out[n].mark = (m); out[n].usec = u_; out[n].end = *t; n++; } while (0)
+    for (p = text; *p && n < max - 16; p++) {
+        if (*p == ' ' || *p == '\n') {
+            gap = 7;
+            continue;
+        }
+        if ((code = cw_encode(*p)) == 0)
+            continue;
+        dit = 1200000 / tr->wpm * 100 / (100 + tr->drift * (int)(p - text) / len);
+        extra = dit * (tr->weight - 50) / 50;
+        for (bit = 30 - __builtin_clz(code); bit >= 0; bit--) {
+            BENCH_SPAN(0, (gap ? dit * gap : dit) - extra);
+            BENCH_SPAN(1, (code >> bit & 1 ? dit * tr->ratio / 10 : dit) + extra);
+            gap = 0;
+        }
+        gap = gap ? gap : 3;
+    }
+#undef BENCH_SPAN
+    return n;
+}
+
+/* feed spans to a decoder, ticking it at its deadlines as PrintDaemon does */
+static void bench_decode(struct decoder *dec, const struct key_span *ev, int count)
+{
+    int64_t due;
+    int i;
+    for (i = 0; i < count; i++) {
+        while ((due = decoder_deadline(dec)) >= 0 && due <= ev[i].end)
+            decoder_tick(dec, due);
+        decoder_span(dec, &ev[i]);
+    }
+    while ((due = decoder_deadline(dec)) >= 0)
+        decoder_tick(dec, due);
+}
+
+static int bench_decoder(void)
+{
+    static const struct bench_trace speeds[] = {
+        { 15, 30, 5, 50, 0 }, { 28, 35, 10, 50, 0 }, { 10, 40, 10, 50, 0 },
+    };
+    const int ns = sizeof(speeds) / sizeof(speeds[0]), groups = 200, events = 100000;
+    struct charset cs;
+    struct key_span *ev;
+    struct decoder dec;
+    struct rng r;
+    char *text, *ref, *hyp = NULL, *q;
+    size_t hyplen = 0, len;
+    int mode, trial, i, k, n = 0, bad = 0, wpm;
+    int64_t t = 0;
+    long dist;
+    double t0, dt, best[2] = { 0, 0 }, cer[2];
+    FILE *out;
+    charset_parse(&cs, "alnum");
+    text = malloc(gen_bytes(&cs, groups, 5) * ns + 1);
+    ref = malloc(gen_bytes(&cs, groups, 5) * ns + 1);
+    ev = malloc(events * sizeof(*ev));
+    if (!text || !ref || !ev) {
+        printf("[!] No enough memory. Error code: bench decoder\n");
+        return -1;
+    }
+    /* the same number of groups at each speed, the decoder set for the first */
+    rng_seed(&r, 1, 0);
+    len = gen_groups(&cs, 0, groups * ns, 5, groups, text);
+    for (i = 0, k = 0; k < ns; k++) {
+        char *line = text + i, keep;
+        while (text[i++] != '\n')
+            ;
+        keep = text[i];
+        text[i] = 0;
+        n += bench_key_text(line, &speeds[k], &r, ev + n, events - n, &t);
+        text[i] = keep;
+    }
+    for (i = 0, q = ref; i < len; i++)
+        if (text[i] != '\n')
+            *q++ = text[i];
+    *q = 0;
+    printf("Decoder on %d spans, %d groups each at %d/%d/%d WPM, set for %d WPM\n",
+           n, groups, speeds[0].wpm, speeds[1].wpm, speeds[2].wpm, speeds[0].wpm);
+    for (mode = 0; mode < 2; mode++) {
+        out = open_memstream(&hyp, &hyplen);
+        decoder_reset(&dec, mode, out);
+        bench_decode(&dec, ev, n);
+        fclose(out);
+        dist = bench_distance(ref, hyp);
+        cer[mode] = 100.0 * dist / strlen(ref);
+        free(hyp);
+        hyp = NULL;
+    }
+    wpm = decoder_speed(&dec);
+    /* the modes take turns and each keeps its best, so the ratio is not one mode's bad luck */
+    for (trial = 0; trial < 41; trial++)
+        for (mode = 0; mode < 2; mode++) {
+            decoder_reset(&dec, mode, NULL);
+            t0 = mono_time();
+            bench_decode(&dec, ev, n);
+            dt = mono_time() - t0;
+            best[mode] = trial && best[mode] < dt ? best[mode] : dt;
+        }
+    printf("  fixed    CER %5.2f%%, %6.1f M spans/s\n", cer[0], n / best[0] / 1e6);
+    printf("  adaptive CER %5.2f%%, %6.1f M spans/s, ends at %d WPM (keyed %d)\n",
+           cer[1], n / best[1] / 1e6, wpm, speeds[ns - 1].wpm);
+    printf("  adaptive costs %.2fx the fixed per span\n", best[1] / best[0]);
+    bad = cer[1] > 2.0 || abs(wpm - speeds[ns - 1].wpm) > 1;
+    free(text);
+    free(ref);
+    free(ev);
+    return bad ? -1 : 0;
+}
+
+/*
+ *   Decoder replay: one text keyed by a set of fists, each changing one
+ *   thing from a clean 20 WPM, decoded on the virtual clock by the fixed
+ *   decoder set for the fist's speed and by the adaptive one. Shows the
+ *   character error rate, spans per second and how much faster than the
+ *   keying took that is. --trace replays one fist of your own instead.
+ */
+static int bench_replay(void)
+{
+    static const struct bench_trace set[] = {
+        { 20, 30, 0, 50, 0 }, { 20, 30, 10, 50, 0 }, { 20, 30, 25, 50, 0 },
+        { 30, 30, 10, 50, 0 }, { 45, 30, 10, 50, 0 }, { 20, 40, 10, 50, 0 },
+        { 20, 30, 10, 35, 0 }, { 20, 30, 10, 65, 0 }, { 20, 30, 10, 50, 50 },
+        { 20, 30, 10, 50, -40 },
+    };
+    const struct bench_trace *tr = bench_trace_opt.wpm ? &bench_trace_opt : set;
+    const int count = bench_trace_opt.wpm ? 1 : sizeof(set) / sizeof(set[0]);
+    const int groups = 500, reps = 20, events = groups * 64;
+    int saved[3] = { val_dida, val_char, val_space };
+    struct charset cs;
+    struct key_span *ev;
+    struct decoder dec;
+    struct rng r;
+    char *text, *ref, *hyp = NULL, *q;
+    size_t hyplen = 0, len, i;
+    double cer[2], speed[2], t0, keyed = 0;
+    int64_t t;
+    int k, mode, n, dit, bad = 0;
+    FILE *out;
+    charset_parse(&cs, "alnum");
+    text = malloc(gen_bytes(&cs, groups, 5) + 1);
+    ref = malloc(gen_bytes(&cs, groups, 5) + 1);
+    ev = malloc(events * sizeof(*ev));
+    if (!text || !ref || !ev) {
+        printf("[!] No enough memory. Error code: bench replay\n");
+        return -1;
+    }
+    len = gen_groups(&cs, 0, groups, 5, groups, text);
+    text[len] = 0;
+    for (i = 0, q = ref; i < len; i++)
+        if (text[i] != '\n')
+            *q++ = text[i];
+    *q = 0;
+    printf("Decoder replay, %d groups per fist\n", groups);
+    printf("WPM  Dah  Jitter  Weight  Drift   CER fixed  adaptive   M spans/s fixed  adaptive   x real time\n");
+    for (k = 0; k < count; k++) {
+        /* the fixed decoder is set for the fist, as -w or the keyer sets it */
+        dit = 1200000 / tr[k].wpm;
+        val_dida = val_char = 2 * dit;
+        val_space = 5 * dit;
+        rng_seed(&r, 1, k);
+        t = 0;
+        n = bench_key_text(text, &tr[k], &r, ev, events, &t);
+        for (mode = 0; mode < 2; mode++) {
+            out = open_memstream(&hyp, &hyplen);
+            decoder_reset(&dec, mode, out);
+            bench_decode(&dec, ev, n);
+            fclose(out);
+            cer[mode] = 100.0 * bench_distance(ref, hyp) / strlen(ref);
+            free(hyp);
+            hyp = NULL;
+            decoder_reset(&dec, mode, NULL);
+            t0 = mono_time();
+            for (i = 0; i < (size_t)reps; i++)
+                bench_decode(&dec, ev, n);
+            speed[mode] = reps * n / (mono_time() - t0);
+            keyed = (double)t * 1e-6 * reps / (mono_time() - t0);
+        }
+        printf("%3d  %3.1f  %5d%%  %5d%%  %+4d%%   %8.2f%%  %7.2f%%   %15.1f  %8.1f   %11.0f\n",
+               tr[k].wpm, tr[k].ratio / 10.0, tr[k].jitter, tr[k].weight, tr[k].drift,
+               cer[0], cer[1], speed[0] / 1e6, speed[1] / 1e6, keyed);
+        /* a clean fist at the speed the decoder is set for decodes exactly */
+        bad |= !bench_trace_opt.wpm && k == 0 && cer[0] > 0;
+    }
+    val_dida = saved[0];
+    val_char = saved[1];
+    val_space = saved[2];
+    free(text);
+    free(ref);
+    free(ev);
+    return bad ? -1 : 0;
+}
+
+/*
+ *   Beam decoder: QSO words and callsigns, some of them unknown to the
+ *   model, keyed by the replay set of fists and decoded by the greedy
+ *   decoder and the beam with a model built for the run, fixed and
+ *   adaptive. --beam sets the width, --trace replays one fist.
+ */
+static const char *const bench_qso_words[] = {
+    "CQ", "DE", "K", "5NN", "TU", "R", "UR", "RST", "599", "73", "ES", "FB", "OM", "NAME", "QTH",
+    "HR", "TNX", "FER", "CALL", "PSE", "KN", "BK", "GM", "GA", "GE", "RIG", "ANT", "WX", "IS",
+    "AGN", "HW", "CPY", "SRI", "DR", "BT", "AR", "SK", "VY", "GUD", "OP", "HI", "ABT", "QSO",
+    "QSL", "QRZ", "QRL", "QRM", "QRN", "QSB", "QRP", "PWR", "W", "DIPOLE", "YAGI", "VERT",
+    "TEMP", "C", "SUNNY", "CLOUDY", "RAIN", "SNOW", "HPE", "CUL", "GL", "AND", "THE", "MY",
+    "NICE", "TO", "MEET", "YOU", "BEST", "REGARDS", "TEST", "UP", "QRS", "WKD", "BAND", "NW",
+};
+
+static void bench_callsign(struct rng *r, char *call)
+{
+    int i, n = 0;
+    for (i = 1 + rng_next(r) % 2; i > 0; i--)
+        call[n++] = 'A' + rng_next(r) % 26;
+    call[n++] = '0' + rng_next(r) % 10;
+    for (i = 1 + rng_next(r) % 3; i > 0; i--)
+        call[n++] = 'A' + rng_next(r) % 26;
+    call[n] = 0;
+}
+
+static int bench_beam(void)
 {
-    char access_KB[32], full_INPUT[64];
-    int fd = -1, ret = -1;
-    struct input_event ev;
-    sprintf(full_INPUT,"%s%d",INPUT_KEYBOARD,EVENTnum);
-    if((fd = open(full_INPUT, O_RDONLY)) < 0) {
-        sprintf(access_KB,"%s%s","sudo chmod +r ",full_INPUT);
-        printf("LinuxCW needs sudo to access your keyboard input.\n");
-        system(access_KB);
-        if((fd = open(full_INPUT, O_RDONLY)) < 0) {
-        printf("[!] cannot access keyboard, error:%d\n", errno);
-        return 0;}
-        printf("Validated!\n");
+    static const struct bench_trace set[] = {
+        { 20, 30, 0, 50, 0 }, { 20, 30, 10, 50, 0 }, { 20, 30, 25, 50, 0 },
+        { 20, 30, 40, 50, 0 }, { 30, 30, 10, 50, 0 }, { 20, 40, 10, 50, 0 },
+        { 20, 30, 25, 35, 0 }, { 20, 30, 10, 50, 50 },
+    };
+    const struct bench_trace *tr = bench_trace_opt.wpm ? &bench_trace_opt : set;
+    const int count = bench_trace_opt.wpm ? 1 : sizeof(set) / sizeof(set[0]);
+    const int nw = sizeof(bench_qso_words) / sizeof(bench_qso_words[0]);
+    const int calls = 300, words = 600, reps = 5, events = words * 64;
+    int saved[3] = { val_dida, val_char, val_space };
+    char list_path[] = "/tmp/linuxcw-words-XXXXXX", lm_file[] = "/tmp/linuxcw-lm-XXXXXX";
+    char (*call)[8], *ref, *hyp = NULL, *q;
+    struct key_span *ev;
+    struct decoder dec;
+    struct beam *b;
+    struct lm model = { NULL, 0, NULL, NULL, 0, 0 };
+    struct rng r;
+    size_t hyplen = 0;
+    double cer[4], speed[4], t0, zipf = 0, x;
+    int64_t t;
+    int i, k, mode, n, dit, fd, bad = -1, width = beam_width ? beam_width : 16;
+    FILE *f;
+    call = malloc(calls * sizeof(*call));
+    ref = malloc(words * 8 + 1);
+    ev = malloc(events * sizeof(*ev));
+    b = malloc(sizeof(*b));
+    if (!call || !ref || !ev || !b) {
+        printf("[!] No enough memory. Error code: bench beam\n");
+        goto out;
     }
-    KeyEventAccess = 1;
-    sleep(1);
-    while(1) {
-        memset(&ev, 0, sizeof(struct input_event));
-
-        ret = read(fd, &ev, sizeof(struct input_event));
-        if (ret != sizeof(struct input_event)) {
-            printf("read error, ret: %d\n", ret);
-            break;
-        }
-        pthread_mutex_lock(&mutex);
-        if (ev.type == EV_KEY) {
-            if(!OnWav && (ev.code!=0x1C) && (ev.code!=0x01)){OnWav = 1;gettimeofday(&keyUp_time,NULL);}
-            if(ev.value == 0 && OnWav){                
-                OnWav = 0;
-                WordLen++;
-                TriNum*=3;
-                BinNum*=2;
-                gettimeofday(&keyDown_time,NULL);
-                if(1000000*(keyDown_time.tv_sec-keyUp_time.tv_sec)+(keyDown_time.tv_usec-keyUp_time.tv_usec)<val_dida){
-                    TriNum+=1;
-                    BinNum++;
-                }else{
-                    TriNum+=2;
+    /* the words in Zipf's proportions, then callsigns heard once or twice */
+    rng_seed(&r, 2, 0);
+    if ((fd = mkstemp(list_path)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+        printf("[!] Unable to write a word list: %s\n", strerror(errno));
+        goto out;
+    }
+    for (i = 0; i < nw; i++) {
+        fprintf(f, "%s %d\n", bench_qso_words[i], 1000 / (i + 1));
+        zipf += 1.0 / (i + 1);
+    }
+    for (i = 0; i < calls; i++) {
+        bench_callsign(&r, call[i]);
+        fprintf(f, "%s %d\n", call[i], 1 + (int)(rng_next(&r) % 2));
+    }
+    fclose(f);
+    if ((fd = mkstemp(lm_file)) >= 0)
+        close(fd);
+    if (fd < 0 || lm_build(list_path, lm_file) < 0 || lm_open(lm_file, &model) < 0)
+        goto out;
+    /* a tenth of the words are callsigns, half of those never heard before */
+    for (i = 0, q = ref; i < words; i++) {
+        x = (rng_next(&r) >> 11) * 0x1.0p-53;
+        if (x < 0.05)
+            bench_callsign(&r, q);
+        else if (x < 0.1)
+            strcpy(q, call[rng_next(&r) % calls]);
+        else {
+            for (k = 0, x = (x - 0.1) / 0.9 * zipf; k < nw - 1 && (x -= 1.0 / (k + 1)) > 0; k++)
+                ;
+            strcpy(q, bench_qso_words[k]);
+        }
+        q += strlen(q);
+        *q++ = ' ';
+    }
+    *q = 0;
+    printf("Beam decoder, %d words, %d of %d hypotheses\n", words, width, BEAM_MAX);
+    printf("WPM  Dah  Jitter  Weight  Drift   CER greedy  adaptive  beam  adaptive   M spans/s greedy  adaptive  beam  adaptive\n");
+    for (bad = k = 0; k < count; k++) {
+        dit = 1200000 / tr[k].wpm;
+        val_dida = val_char = 2 * dit;
+        val_space = 5 * dit;
+        rng_seed(&r, 1, k);
+        t = 0;
+        n = bench_key_text(ref, &tr[k], &r, ev, events, &t);
+        for (mode = 0; mode < 4; mode++) {
+            f = open_memstream(&hyp, &hyplen);
+            decoder_reset(&dec, mode & 1, f);
+            if (mode & 2) {
+                beam_init(b, width, &model);
+                dec.beam = b;
+            }
+            bench_decode(&dec, ev, n);
+            fclose(f);
+            cer[mode] = 100.0 * bench_distance(ref, hyp) / strlen(ref);
+            free(hyp);
+            hyp = NULL;
+            t0 = mono_time();
+            for (i = 0; i < reps; i++) {
+                decoder_reset(&dec, mode & 1, NULL);
+                if (mode & 2) {
+                    beam_init(b, width, &model);
+                    dec.beam = b;
                 }
+                bench_decode(&dec, ev, n);
             }
+            speed[mode] = reps * n / (mono_time() - t0);
         }
-        pthread_mutex_unlock(&mutex);
+        printf("%3d  %3.1f  %5d%%  %5d%%  %+4d%%   %9.2f%%  %7.2f%%  %4.2f%%  %7.2f%%   %15.2f  %8.2f  %4.2f  %8.2f\n",
+               tr[k].wpm, tr[k].ratio / 10.0, tr[k].jitter, tr[k].weight, tr[k].drift,
+               cer[0], cer[1], cer[2], cer[3], speed[0] / 1e6, speed[1] / 1e6, speed[2] / 1e6, speed[3] / 1e6);
+        /* the clean fist comes through the model untouched, unknown callsigns too */
+        bad |= !bench_trace_opt.wpm && k == 0 && cer[2] > 0;
     }
-    close(fd);
-    return 0;
+out:
+    val_dida = saved[0];
+    val_char = saved[1];
+    val_space = saved[2];
+    lm_close(&model);
+    if (list_path[19] != 'X')
+        unlink(list_path);
+    if (lm_file[16] != 'X')
+        unlink(lm_file);
+    free(call);
+    free(ref);
+    free(ev);
+    free(b);
+    return bad ? -1 : 0;
 }
 
-void * PrintDaemon()
+/* render text as mono float at the current rate and tone */
+static float *bench_render(const char *text, size_t *len)
 {
-    long AFK_time;
-    int AFK_level = 1, Bracket = 0;
-    while(!m_Interrupt){
-        pthread_mutex_lock(&mutex);
-        AFK_level=WordLen?0:AFK_level;
-        if(!OnWav && !AFK_level){
-            gettimeofday(&current_time,NULL);
-            AFK_time = 1000000*(current_time.tv_sec-keyDown_time.tv_sec)+(current_time.tv_usec-keyDown_time.tv_usec);
-            if(WordLen && AFK_time>val_char){
-                if(WordLen<5){
-                    putchar(TriMorse[TriNum]);
-                }else if(WordLen==5){
-                    putchar(PntaCode[BinNum]);
-                }else if(WordLen==6){
-                    if(BinNum==18){
-                        putchar(HexaCode[BinNum+Bracket]);
-                        Bracket=(Bracket==0)?1:0;
-                    }else{
-                        putchar(HexaCode[BinNum]);
-                    }
-                }else{
-                    printf(" correction-> ");
-                }
-                WordLen=0;TriNum=0;BinNum=0;
+    struct player pl = { { 0, 0, "" }, 0, 0 };
+    struct cw_encoder enc = { { 0 }, 0, 0 };
+    size_t size = 0, frames;
+    float *pcm = NULL;
+    format = SND_PCM_FORMAT_FLOAT;
+    channels = 1;
+    synth_select();
+    if (elem_cache_update(&elem_cache) < 0)
+        return NULL;
+    timeline_reset(&timeline);
+    for (*len = 0; *text; text++) {
+        encoder_feed(&enc, &timeline, (unsigned char)*text);
+        frames = timeline_frames(&timeline, &pl);
+        if (*len + frames > size) {
+            size = (*len + frames) * 2;
+            if ((pcm = realloc(pcm, size * sizeof(float) + 16)) == NULL)
+                return NULL;
+        }
+        player_fill(&pl, &timeline, &elem_cache, (unsigned char *)(pcm + *len), frames);
+        *len += frames;
+    }
+    return pcm;
+}
+
+static int bench_listen(void)
+{
+    static const struct { double hz, noise; int autodetect; } cases[] = {
+        { 750, 0, 0 }, { 750, 2.0, 0 }, { 780, 2.0, 0 }, { 1030, 2.0, 1 },
+    };
+    snd_pcm_format_t saved_format = format;
+    unsigned int saved_channels = channels, saved_rate = rate;
+    double saved_freq = freq, t0, secs;
+    struct tone_detector td;
+    struct decoder dec;
+    struct charset cs;
+    struct rng r;
+    char *text, *ref, *hyp = NULL, *q;
+    size_t hyplen = 0, len, i;
+    float *pcm;
+    FILE *out;
+    int c, bad = 0;
+    long dist;
+    charset_parse(&cs, "alnum");
+    rate = 48000;
+    text = malloc(gen_bytes(&cs, 100, 5) + 1);
+    ref = malloc(gen_bytes(&cs, 100, 5) + 1);
+    if (!text || !ref)
+        return -1;
+    text[gen_groups(&cs, 0, 100, 5, 10, text)] = 0;
+    for (i = 0, q = ref; text[i]; i++)
+        if (text[i] != '\n')
+            *q++ = text[i];
+    *q = 0;
+    printf("Listen decoder at %u Hz, 100 groups, set for %.0f Hz:\n", rate, saved_freq);
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        freq = cases[c].hz;
+        if ((pcm = bench_render(text, &len)) == NULL) {
+            printf("[!] No enough memory. Error code: bench listen\n");
+            return -1;
+        }
+        /* white noise, sum of four uniforms, [noise] rms against a 0.7 rms tone */
+        rng_seed(&r, 2, c);
+        for (i = 0; cases[c].noise > 0 && i < len; i++) {
+            uint64_t x = rng_next(&r);
+            pcm[i] += cases[c].noise * 0.866 * ((int)(x & 0xffff) + (int)(x >> 16 & 0xffff) +
+                          (int)(x >> 32 & 0xffff) + (int)(x >> 48) - 131070) / 65535.0;
+        }
+        freq = saved_freq;
+        out = open_memstream(&hyp, &hyplen);
+        decoder_reset(&dec, 0, out);
+        t0 = mono_time();
+        tone_init(&td, &dec, rate, cases[c].autodetect);
+        for (i = 0; i < len; i += AUDIO_CHUNK)
+            tone_feed(&td, pcm + i, len - i < AUDIO_CHUNK ? len - i : AUDIO_CHUNK, rate);
+        tone_finish(&td, rate);
+        secs = mono_time() - t0;
+        fclose(out);
+        dist = bench_distance(ref, hyp);
+        printf("  %4.0f Hz%s noise %.1f: CER %5.2f%%, tone at %4.0f Hz, %6.0fx real time\n",
+               cases[c].hz, cases[c].autodetect ? " auto" : "     ", cases[c].noise,
+               100.0 * dist / strlen(ref), td.hz[td.tone], (double)len / rate / secs);
+        bad += 100.0 * dist / strlen(ref) > 2.0;
+        free(hyp);
+        hyp = NULL;
+        free(pcm);
+    }
+    format = saved_format;
+    channels = saved_channels;
+    rate = saved_rate;
+    free(text);
+    free(ref);
+    return bad ? -1 : 0;
+}
+
+static int bench_skim(void)
+{
+    enum { BENCH_SIGS = 32, BENCH_GROUPS = 12 };
+    const int saved[4] = { usec_DI, usec_DA, usec_SGap, usec_BGap };
+    snd_pcm_format_t saved_format = format;
+    unsigned int saved_channels = channels, saved_rate = rate;
+    double saved_freq = freq, hz[BENCH_SIGS], t0, c0, wall, cpu, audio, cer = 0;
+    uint64_t saved_seed = gen_seed;
+    char *text[BENCH_SIGS], *heard[BENCH_SIGS] = { NULL }, *q, *out = NULL, *line;
+    size_t outlen = 0, hlen[BENCH_SIGS] = { 0 };
+    FILE *print = open_memstream(&out, &outlen);
+    struct skimmer *sk = malloc(sizeof(*sk));
+    struct charset cs;
+    struct rng r;
+    float *mix = NULL, *pcm;
+    size_t len, mixlen = 0, size = 0, i, off;
+    int k, peak, found = 0, bad = 0;
+    charset_parse(&cs, "alnum");
+    rate = 48000;
+    rng_seed(&r, 3, 0);
+    /* signals 100 Hz apart, random speed, level and start */
+    for (k = 0; k < BENCH_SIGS; k++) {
+        double speed = 0.75 + (rng_next(&r) >> 11) * (0.6 / 9007199254740992.0);
+        float level = 0.25f + (rng_next(&r) >> 11) * (0.75 / 9007199254740992.0);
+        char *src = malloc(gen_bytes(&cs, BENCH_GROUPS, 5) + 1);
+        text[k] = malloc(gen_bytes(&cs, BENCH_GROUPS, 5) + 1);
+        if (src == NULL || text[k] == NULL)
+            return -1;
+        gen_seed = k + 1;
+        src[gen_groups(&cs, 0, BENCH_GROUPS, 5, BENCH_GROUPS, src)] = 0;
+        for (i = 0, q = text[k]; src[i]; i++)
+            if (src[i] != '\n')
+                *q++ = src[i];
+        *q = 0;
+        freq = hz[k] = 450 + 100 * k;
+        usec_DI = saved[0] * speed;
+        usec_DA = saved[1] * speed;
+        usec_SGap = saved[2] * speed;
+        usec_BGap = saved[3] * speed;
+        if ((pcm = bench_render(src, &len)) == NULL)
+            return -1;
+        off = rng_next(&r) % (2 * rate);
+        if (off + len > size) {
+            size = (off + len) * 2;
+            if ((mix = realloc(mix, size * sizeof(float))) == NULL)
+                return -1;
+        }
+        if (off + len > mixlen) {
+            memset(mix + mixlen, 0, (off + len - mixlen) * sizeof(float));
+            mixlen = off + len;
+        }
+        for (i = 0; i < len; i++)
+            mix[off + i] += pcm[i] * level;
+        free(pcm);
+        free(src);
+    }
+    for (i = 0; i < mixlen; i++) {
+        uint64_t x = rng_next(&r);
+        mix[i] += 0.02 * ((int)(x & 0xffff) + (int)(x >> 16 & 0xffff) - 65535) / 65535.0;
+    }
+    usec_DI = saved[0];
+    usec_DA = saved[1];
+    usec_SGap = saved[2];
+    usec_BGap = saved[3];
+    format = saved_format;
+    channels = saved_channels;
+    freq = saved_freq;
+    gen_seed = saved_seed;
+    audio = (double)mixlen / rate;
+    if (sk == NULL || skim_init(sk, rate, print) < 0) {
+        printf("[!] No enough memory. Error code: bench skim\n");
+        return -1;
+    }
+    printf("Skimmer on %d signals from %.0f to %.0f Hz, %.1f s at %u Hz, %d workers\n",
+           BENCH_SIGS, hz[0], hz[BENCH_SIGS - 1], audio, rate, sk->workers);
+    t0 = mono_time();
+    c0 = cpu_time();
+    for (i = 0; i < mixlen; i += AUDIO_CHUNK)
+        skim_feed(sk, mix + i, mixlen - i < AUDIO_CHUNK ? mixlen - i : AUDIO_CHUNK);
+    peak = sk->peak_chan;
+    skim_finish(sk);
+    wall = mono_time() - t0;
+    cpu = cpu_time() - c0;
+    fclose(print);
+    /* gather the printed words by signal, the nearest within a bin */
+    for (line = strtok(out, "\n"); line; line = strtok(NULL, "\n")) {
+        double f = atof(line);
+        k = (int)((f - hz[0]) / 100 + 0.5);
+        if (k < 0 || k >= BENCH_SIGS || fabs(f - hz[k]) > (double)rate / sk->n || !strstr(line, "Hz  "))
+            continue;
+        line = strstr(line, "Hz  ") + 4;
+        if ((heard[k] = realloc(heard[k], hlen[k] + strlen(line) + 1)) == NULL)
+            return -1;
+        strcpy(heard[k] + hlen[k], line);
+        hlen[k] += strlen(line);
+    }
+    for (k = 0; k < BENCH_SIGS; k++) {
+        found += heard[k] != NULL;
+        cer += heard[k] ? (double)bench_distance(text[k], heard[k]) / strlen(text[k]) : 1;
+    }
+    bad = found < BENCH_SIGS || cer / BENCH_SIGS > 0.05;
+    printf("  %d of %d signals found, mean CER %.2f%%, up to %d channels at once\n", found, BENCH_SIGS, 100 * cer / BENCH_SIGS, peak);
+    printf("  %.0fx real time; %.0f channel-seconds of audio per CPU second\n", audio / wall, found * audio / cpu);
+    free(out);
+    for (k = 0; k < BENCH_SIGS; k++)
+        free(heard[k]);
+    for (k = 0; k < BENCH_SIGS; k++)
+        free(text[k]);
+    free(sk);
+    free(mix);
+    rate = saved_rate;
+    return bad ? -1 : 0;
+}
+
+/*
+ *   Server pool: many short sessions over a pool of several workers,
+ *   ticked back to back, so the set of sessions changes from one tick
+ *   to the next.  Each is fed a word and its decoded copy checked.
+ */
+static int bench_serve(void)
+{
+    enum { BENCH_SESSIONS = 2000, BENCH_LIVE = 64 };
+    static const char *words[] = { "E", "T", "EE", "TE", "IT", "ME" };
+    const int saved_sessions = serve_sessions, saved_workers = serve_workers;
+    struct server *sv = malloc(sizeof(*sv));
+    struct serve_session *s;
+    unsigned char buf[1 << 16];
+    char heard[BENCH_LIVE][16];
+    int peer[BENCH_LIVE], word[BENCH_LIVE], pair[2];
+    int epfd = epoll_create1(EPOLL_CLOEXEC), opened = 0, ended = 0, wrong = 0;
+    unsigned long ticks = 0;
+    size_t have, len, at;
+    ssize_t n;
+    double t0;
+    int i;
+    serve_sessions = BENCH_LIVE;
+    serve_workers = 4;
+    synth_select();
+    if (elem_cache_update(&elem_cache) < 0 || sv == NULL || epfd < 0 || serve_init(sv) < 0) {
+        printf("[!] No enough memory. Error code: bench serve\n");
+        return -1;
+    }
+    printf("Server pool, %d sessions of one word, %d at once, %d workers\n", BENCH_SESSIONS, BENCH_LIVE, sv->workers);
+    t0 = mono_time();
+    while (ended < BENCH_SESSIONS) {
+        /* one new session a tick, so they start and end staggered */
+        if (opened < BENCH_SESSIONS && sv->nfree && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0) {
+            i = sv->free_slot[--sv->nfree];
+            serve_open(sv, i, pair[0]);
+            s = serve_slot(sv, i);
+            word[i] = opened++ % (sizeof(words) / sizeof(words[0]));
+            len = strlen(words[word[i]]);
+            memcpy(s->inbox, words[word[i]], len);
+            s->in_head = len;
+            s->eof = 1;
+            peer[i] = pair[1];
+            heard[i][0] = 0;
+        }
+        for (i = sv->ntasks = 0; i < sv->slots; i++) {
+            s = serve_slot(sv, i);
+            if (s->fd >= 0 && !s->closing)
+                sv->task[sv->ntasks++] = i;
+        }
+        serve_run(sv);
+        ticks++;
+        for (i = 0; i < sv->slots; i++) {
+            s = serve_slot(sv, i);
+            if (s->fd < 0)
+                continue;
+            /* the client side: whole frames, as the session sent them */
+            for (have = 0; (n = recv(peer[i], buf + have, sizeof(buf) - have, MSG_DONTWAIT)) > 0; have += n)
+                ;
+            for (at = 0; at + SERVE_HEADER <= have; at += SERVE_HEADER + len) {
+                len = buf[at + 1] | buf[at + 2] << 8 | buf[at + 3] << 16;
+                if (buf[at] == 'T')
+                    strncat(heard[i], (char *)buf + at + SERVE_HEADER, len < sizeof(heard[i]) - 1 - strlen(heard[i]) ? len : sizeof(heard[i]) - 1 - strlen(heard[i]));
+            }
+            if (s->closing) {
+                load_squeeze(heard[i], heard[i]);
+                wrong += strcmp(heard[i], words[word[i]]) != 0;
+                serve_close(sv, i, epfd);
+                close(peer[i]);
+                ended++;
             }
-            if(AFK_time>val_space){
-                putchar(' ');AFK_level=1;
+        }
+    }
+    printf("  %lu ticks in %.2f s, %d of %d sessions decoded their word\n", ticks, mono_time() - t0, ended - wrong, ended);
+    serve_free(sv);
+    free(sv);
+    close(epfd);
+    serve_sessions = saved_sessions;
+    serve_workers = saved_workers;
+    return wrong ? -1 : 0;
+}
+
+/*
+ *   Pile-up: the noise statistics, one station keyed clean enough to
+ *   decode, and the cost of the mix as stations are added
+ */
+static int bench_pileup(void)
+{
+    static const int counts[] = { 1, 16, 128, 512 };
+    const float saved_noise = pileup_noise, saved_qsb = pileup_qsb, saved_qrn = pileup_qrn;
+    const int saved_val[3] = { val_dida, val_char, val_space };
+    float buf[SYNTH_BLOCK] __attribute__ ((aligned (16)));
+    unsigned int saved_rate = rate;
+    double saved_freq = freq, sum = 0, sq = 0, quad = 0, var, kurt, tail, cpu, share = 0;
+    uint64_t saved_seed = gen_seed;
+    struct charset saved_cs = gen_charset;
+    struct tone_detector td;
+    struct decoder dec;
+    char *hyp = NULL;
+    size_t hyplen = 0, frames, i, beyond = 0;
+    float *pcm;
+    FILE *out;
+    int c, k, bad = 0;
+    rate = 48000;
+    freq = 750;
+    gen_seed = 11;
+    charset_parse(&gen_charset, "alnum");
+    /* band noise alone */
+    pileup_noise = 0.1f;
+    pileup_qsb = pileup_qrn = 0;
+    if (pileup_init(&pileup, 0, rate, 5, 1, 0, NULL) < 0)
+        return -1;
+    for (frames = 0; frames < 100 * rate; frames += SYNTH_BLOCK) {
+        pileup_render(&pileup, buf, SYNTH_BLOCK);
+        for (k = 0; k < SYNTH_BLOCK; k++) {
+            sum += buf[k];
+            sq += (double)buf[k] * buf[k];
+            quad += (double)buf[k] * buf[k] * buf[k] * buf[k];
+            beyond += fabsf(buf[k]) > 0.4f;
+        }
+    }
+    pileup_free(&pileup);
+    var = sq / frames - (sum / frames) * (sum / frames);
+    kurt = quad / frames / (var * var);
+    tail = (double)beyond / frames;
+    printf("Pile-up at %u Hz\n  noise 0.1: RMS %.4f, mean %+.5f, kurtosis %.3f (Gaussian 3), beyond 4 sigma %.2e (Gaussian 6.33e-05)\n",
+           rate, sqrt(var), sum / frames, kurt, tail);
+    bad += fabs(sqrt(var) - 0.1) > 0.002 || fabs(kurt - 3) > 0.03 || fabs(tail / 6.33e-5 - 1) > 0.25;
+    /* one station, clean, through the tone detector set for its speed */
+    pileup_noise = 0;
+    if (pileup_init(&pileup, 1, rate, 5, 40, 0, NULL) < 0)
+        return -1;
+    if ((pcm = malloc((size_t)600 * rate * sizeof(float))) == NULL)
+        return -1;
+    for (frames = 0; frames < (size_t)600 * rate - SYNTH_BLOCK && pileup_render(&pileup, pcm + frames, SYNTH_BLOCK); frames += SYNTH_BLOCK)
+        ;
+    /* PARIS: split dit and dah at two units, gaps at two and five */
+    val_dida = val_char = 2 * 1200000 / pileup.st[0].wpm;
+    val_space = 5 * 1200000 / pileup.st[0].wpm;
+    out = open_memstream(&hyp, &hyplen);
+    decoder_reset(&dec, 0, out);
+    tone_init(&td, &dec, rate, 1);
+    for (i = 0; i < frames; i += AUDIO_CHUNK)
+        tone_feed(&td, pcm + i, frames - i < AUDIO_CHUNK ? frames - i : AUDIO_CHUNK, rate);
+    tone_finish(&td, rate);
+    fclose(out);
+    printf("  1 station at %.0f Hz, %d WPM, %d%% jitter: decoded with CER %.2f%%\n", pileup.st[0].hz, pileup.st[0].wpm,
+           pileup.st[0].jitter, 100.0 * bench_distance(pileup.st[0].text, hyp) / pileup.st[0].tlen);
+    bad += 100.0 * bench_distance(pileup.st[0].text, hyp) / pileup.st[0].tlen > 5.0;
+    free(hyp);
+    free(pcm);
+    pileup_free(&pileup);
+    val_dida = saved_val[0];
+    val_char = saved_val[1];
+    val_space = saved_val[2];
+    /* the full band: noise, QSB and QRN on top of every station */
+    pileup_noise = 0.05f;
+    pileup_qsb = 0.5f;
+    pileup_qrn = 2;
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        if (pileup_init(&pileup, counts[c], rate, 5, 1000, 1, NULL) < 0)
+            return -1;
+        cpu = cpu_time();
+        for (frames = 0; frames < 30 * rate; frames += SYNTH_BLOCK)
+            pileup_render(&pileup, buf, SYNTH_BLOCK);
+        cpu = cpu_time() - cpu;
+        pileup_free(&pileup);
+        printf("  %4d stations: %7.1fx real time, %5.2f%% of one core\n", counts[c],
+               (double)frames / rate / cpu, 100 * cpu * rate / frames);
+        if (counts[c] == 128)
+            share = 100 * cpu * rate / frames;
+    }
+    bad += share > 25;
+    pileup_noise = saved_noise;
+    pileup_qsb = saved_qsb;
+    pileup_qrn = saved_qrn;
+    gen_charset = saved_cs;
+    gen_seed = saved_seed;
+    freq = saved_freq;
+    rate = saved_rate;
+    return bad ? -1 : 0;
+}
+
+/*
+ *   Key to sidetone latency, end to end: a uinput key device stands in
+ *   for the keyboard, KeyDaemon_CW reads it as usual and the tone loop
+ *   plays into an snd-aloop card, whose capture side is timestamped on
+ *   the monotonic clock.  A scripted text is keyed for each buffer and
+ *   period setting and transfer method; each key down is matched to the
+ *   next tone onset, each tone length to how long the key was held.
+ */
+#define LATENCY_WPM 30
+#define LATENCY_TEXT "PARIS PARIS PARIS"
+#define LATENCY_CHUNK 32            /* frames captured at a time */
+#define LATENCY_LEVEL 0.05f         /* tone present, part of full scale */
+#define LATENCY_HOLD 0.002          /* silence that ends a tone, s */
+
+struct latency_capture {
+    struct audio_source src;
+    volatile int stop;
+    double *on, *off;               /* tone edges, mono_time() */
+    int count, max;
+};
+
+static const char *loopback_card = "Loopback";    /* --loopback */
+static const struct bench_trace latency_fist = { LATENCY_WPM, 30, 0, 50, 0 };
+
+static void *latency_listen(void *arg)
+{
+    struct latency_capture *lc = arg;
+    unsigned char *raw = malloc(LATENCY_CHUNK * lc->src.bytes * lc->src.channels);
+    float pcm[LATENCY_CHUNK];
+    snd_pcm_sframes_t avail;
+    double now, t, last = 0;
+    long n, i;
+    int mark = 0;
+    while (raw && !lc->stop && lc->count < lc->max && (n = audio_read(&lc->src, raw, pcm, LATENCY_CHUNK)) > 0) {
+        /* frames still queued behind this chunk were captured after it */
+        now = mono_time();
+        avail = snd_pcm_avail(lc->src.handle);
+        avail = avail < 0 ? 0 : avail;
+        for (i = 0; i < n && lc->count < lc->max; i++) {
+            t = now - (double)(n - i + avail) / lc->src.rate;
+            if (fabsf(pcm[i]) > LATENCY_LEVEL) {
+                if (!mark)
+                    lc->on[lc->count] = t;
+                mark = 1;
+                last = t;
+            } else if (mark && t - last > LATENCY_HOLD) {
+                lc->off[lc->count++] = last;
+                mark = 0;
             }
         }
-        pthread_mutex_unlock(&mutex);
-        usleep(5000);
     }
+    free(raw);
     return 0;
 }
 
-int SoundDaemon_mod(int method)
-{    
-    snd_pcm_t *handle;
-    int err;
+static void *latency_sound(void *arg)
+{
+    *(int *)arg = SoundDaemon_mod(0);
+    return 0;
+}
+
+static int latency_key(int fd, int value)
+{
+    struct input_event ev[2];
+    memset(ev, 0, sizeof(ev));
+    ev[0].type = EV_KEY;
+    ev[0].code = KEY_RIGHTCTRL;     /* types nothing wherever else it lands */
+    ev[0].value = value;
+    ev[1].type = EV_SYN;
+    ev[1].code = SYN_REPORT;
+    return write(fd, ev, sizeof(ev)) == sizeof(ev) ? 0 : -1;
+}
+
+/* the event number the kernel gave the device called name, -1 if none yet */
+static int latency_find(const char *name)
+{
+    char path[64], found[UINPUT_MAX_NAME_SIZE];
+    int i, fd, match;
+    for (i = 0; i < 256; i++) {
+        sprintf(path, "%s%d", INPUT_KEYBOARD, i);
+        if ((fd = open(path, O_RDONLY)) < 0)
+            continue;
+        match = ioctl(fd, EVIOCGNAME(sizeof(found)), found) > 0 && !strcmp(found, name);
+        close(fd);
+        if (match)
+            return i;
+    }
+    return -1;
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* key the script once and match presses to tone edges; the table row, or -1 */
+static int latency_run(int ufd, const struct key_span *script, int count, char *row)
+{
+    struct latency_capture lc;
     snd_pcm_hw_params_t *hwparams;
-    snd_pcm_sw_params_t *swparams;
-    signed short *samples;
-    unsigned int chn;
-    snd_pcm_channel_area_t *areas;
+    struct timespec due;
+    struct key_span ev;
+    pthread_t cap_pid, snd_pid;
+    double *press, *lat, err[2] = { 0, 0 }, worst[2] = { 0, 0 }, held;
+    unsigned int play_buffer = buffer_time, play_period = period_time;
+    char card[64];
+    int i, j, k, rc = 0, marks = 0, n[2] = { 0, 0 }, dah;
+    int64_t t;
     snd_pcm_hw_params_alloca(&hwparams);
-    snd_pcm_sw_params_alloca(&swparams);
-    
-    if ((err = snd_output_stdio_attach(&output, stdout, 0)) < 0) {
-        printf("[!] Output failed: %s\n", snd_strerror(err));
+    memset(&lc, 0, sizeof(lc));
+    sprintf(card, "hw:%s,1,0", loopback_card);
+    if (snd_pcm_open(&lc.src.handle, card, SND_PCM_STREAM_CAPTURE, 0) < 0)
         return -1;
-    }
-    if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-        printf("[!] Playback open error: %s\n", snd_strerror(err));
+    buffer_time = 100000;
+    period_time = 1000;
+    rc = set_hwparams(lc.src.handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED);
+    buffer_time = play_buffer;
+    period_time = play_period;
+    if (rc < 0) {
+        snd_pcm_close(lc.src.handle);
         return -1;
     }
-    
-    if ((err = set_hwparams(handle, hwparams, transfer_methods[method].access)) < 0) {
-        printf("[!] Setting of hwparams failed: %s\n", snd_strerror(err));
+    lc.src.rate = rate;
+    lc.src.channels = channels;
+    lc.src.bytes = snd_pcm_format_physical_width(format) / 8;
+    lc.src.is_float = format == SND_PCM_FORMAT_FLOAT_LE;
+    lc.max = count;
+    lc.on = malloc(count * sizeof(double));
+    lc.off = malloc(count * sizeof(double));
+    press = malloc(count * sizeof(double));
+    lat = malloc(count * sizeof(double));
+    if (lc.on == NULL || lc.off == NULL || press == NULL || lat == NULL) {
+        printf("[!] No enough memory. Error code: latency\n");
+        snd_pcm_close(lc.src.handle);
+        free(lc.on);
+        free(lc.off);
+        free(press);
+        free(lat);
         return -1;
     }
-    if ((err = set_swparams(handle, swparams)) < 0) {
-        printf("[!] Setting of swparams failed: %s\n", snd_strerror(err));
-        return -1;
+    pthread_create(&cap_pid, NULL, latency_listen, &lc);
+    pthread_create(&snd_pid, NULL, latency_sound, &rc);
+    usleep(300000);
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    t = due.tv_sec * 1000000LL + due.tv_nsec / 1000;
+    for (i = 0; i < count; i++) {
+        if (script[i].mark) {
+            latency_key(ufd, 1);
+            press[marks++] = mono_time();
+        }
+        t += script[i].usec;
+        due.tv_sec = t / 1000000;
+        due.tv_nsec = t % 1000000 * 1000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+        if (script[i].mark)
+            latency_key(ufd, 0);
     }
-    samples = malloc((period_size * channels * snd_pcm_format_physical_width(format)) / 8);
-    if (samples == NULL) {
-        printf("[!] No enough memory. Error code: samples\n");
+    usleep(100000 + buffer_time);
+    m_Interrupt = 1;
+    key_wake();
+    pthread_join(snd_pid, NULL);
+    lc.stop = 1;
+    pthread_join(cap_pid, NULL);
+    snd_pcm_close(lc.src.handle);
+    m_Interrupt = 0;
+    while (key_ring_pop(&key_ring, &ev) == 0)
+        ;
+    /* tone k answers press k if it starts before the next press; a capture chunk early is within the clock's reach */
+    for (i = j = k = 0; i < count; i++) {
+        if (!script[i].mark)
+            continue;
+        while (j < lc.count && lc.on[j] < press[k] - (double)LATENCY_CHUNK / rate)
+            j++;
+        if (j < lc.count && (k + 1 == marks || lc.on[j] < press[k + 1])) {
+            lat[k] = (lc.on[j] - press[k]) * 1000;
+            dah = script[i].usec > 2 * 1200000 / LATENCY_WPM;
+            held = (lc.off[j] - lc.on[j]) * 1000 - script[i].usec / 1000.0;
+            err[dah] += held;
+            worst[dah] = fabs(held) > fabs(worst[dah]) ? held : worst[dah];
+            n[dah]++;
+            j++;
+        } else
+            lat[k] = 1e9;   /* missed, sorts last */
+        k++;
+    }
+    qsort(lat, marks, sizeof(double), latency_cmp);
+    sprintf(row, "%6.2f %6.2f %7.2f   %+6.2f %+6.2f   %+6.2f %+6.2f  %6d %5u",
+            lat[(marks - 1) / 2], lat[(marks - 1) * 99 / 100], lat[marks - 1],
+            n[0] ? err[0] / n[0] : 0, worst[0], n[1] ? err[1] / n[1] : 0, worst[1], marks - n[0] - n[1], xrun_count);
+    rc = marks - n[0] - n[1] || lat[(marks - 1) * 99 / 100] > buffer_time / 1000.0 + 10 ? 1 : rc < 0 ? -1 : 0;
+    free(lc.on);
+    free(lc.off);
+    free(press);
+    free(lat);
+    return rc;
+}
+
+static int bench_latency(void)
+{
+    static const unsigned int sweep[][2] = { { 2000, 500 }, { 5000, 1000 }, { 20000, 5000 } };
+    static const char key_name[] = "LinuxCW latency key";
+    struct uinput_setup setup;
+    struct key_span script[512];
+    struct rng r;
+    snd_pcm_t *probe;
+    pthread_t key_pid;
+    char card[64], rows[2 * 3][128];
+    const unsigned int saved_rate = rate, saved_buffer = buffer_time, saved_period = period_time;
+    const char *saved_device = device, *saved_method = transfer_name;
+    int ufd, count, c, m, i, bad = 0, saved_event = key_device[0], saved_devices = key_devices;
+    int64_t t = 0;
+    sprintf(card, "hw:%s,1,0", loopback_card);
+    if (snd_pcm_open(&probe, card, SND_PCM_STREAM_CAPTURE, 0) < 0) {
+        printf("Key to sidetone latency: no %s card (modprobe snd-aloop), skipped.\n", loopback_card);
+        return 0;
+    }
+    snd_pcm_close(probe);
+    if ((ufd = open("/dev/uinput", O_WRONLY | O_NONBLOCK)) < 0) {
+        printf("Key to sidetone latency: no access to /dev/uinput (modprobe uinput, run as root), skipped.\n");
+        return 0;
+    }
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    strcpy(setup.name, key_name);
+    if (ioctl(ufd, UI_SET_EVBIT, EV_KEY) < 0 || ioctl(ufd, UI_SET_KEYBIT, KEY_RIGHTCTRL) < 0 ||
+        ioctl(ufd, UI_DEV_SETUP, &setup) < 0 || ioctl(ufd, UI_DEV_CREATE) < 0) {
+        printf("[!] Unable to create the uinput key: %s\n", strerror(errno));
+        close(ufd);
         return -1;
     }
-    if ((areas = calloc(channels, sizeof(snd_pcm_channel_area_t))) == NULL) {
-        printf("[!] No enough memory. Error code: areas\n");
+    key_devices = 1;
+    for (i = 0; i < 40 && (key_device[0] = latency_find(key_name)) < 0; i++)
+        usleep(50000);
+    if (key_device[0] < 0) {
+        printf("[!] The uinput key did not show up under %s*\n", INPUT_KEYBOARD);
+        ioctl(ufd, UI_DEV_DESTROY);
+        close(ufd);
+        key_device[0] = saved_event;
+        key_devices = saved_devices;
         return -1;
     }
-    for (chn = 0; chn < channels; chn++) {
-        areas[chn].addr = samples;
-        areas[chn].first = chn * snd_pcm_format_physical_width(format);
-        areas[chn].step = channels * snd_pcm_format_physical_width(format);
+    rng_seed(&r, 1, 0);
+    count = bench_key_text(LATENCY_TEXT, &latency_fist, &r, script, 512, &t);
+    if (key_wake_fd < 0)
+        key_wake_fd = eventfd(0, EFD_NONBLOCK);
+    KeyEventAccess = 0;
+    pthread_create(&key_pid, NULL, KeyDaemon_CW, NULL);
+    for (i = 0; i < 30 && !KeyEventAccess; i++)
+        usleep(100000);
+    usleep(1200000);    /* KeyDaemon_CW settles for a second before reading */
+    rate = 48000;
+    sprintf(card, "hw:%s,0,0", loopback_card);
+    device = card;
+    for (m = 0; transfer_methods[m].name && KeyEventAccess; m += TRANSFER_MODES) {
+        transfer_name = transfer_methods[m].name;
+        for (c = 0; c < sizeof(sweep) / sizeof(sweep[0]); c++) {
+            buffer_time = sweep[c][0];
+            period_time = sweep[c][1];
+            i = latency_run(ufd, script, count, rows[m / TRANSFER_MODES * 3 + c]);
+            if (i < 0)
+                strcpy(rows[m / TRANSFER_MODES * 3 + c], "failed");
+            bad += i != 0;
+        }
     }
-    err = transfer_methods[method].transfer_loop(handle, samples, areas);
-    if (err < 0){
-        printf("[!] Transfer failed: %s\n", snd_strerror(err));
+    ioctl(ufd, UI_DEV_DESTROY);
+    close(ufd);
+    pthread_join(key_pid, NULL);
+    printf("Key to sidetone latency at %u Hz through %s, %s at %d WPM, in ms\n", rate, loopback_card, LATENCY_TEXT, LATENCY_WPM);
+    printf("  method buffer period    p50    p99     max   dit err  worst   dah err  worst  missed xruns\n");
+    for (m = 0; transfer_methods[m].name && KeyEventAccess; m += TRANSFER_MODES)
+        for (c = 0; c < sizeof(sweep) / sizeof(sweep[0]); c++)
+            printf("  %-6s %6.1f %6.1f %s\n", transfer_methods[m].name, sweep[c][0] / 1000.0,
+                   sweep[c][1] / 1000.0, rows[m / TRANSFER_MODES * 3 + c]);
+    if (!KeyEventAccess) {
+        printf("[!] KeyDaemon_CW could not open the uinput key\n");
+        bad++;
     }
-    free(areas);
-    free(samples);
-    snd_pcm_close(handle);printf("[-] SoundDaemon closed.\n");
-    return 0;
+    key_device[0] = saved_event;
+    key_devices = saved_devices;
+    device = (char *)saved_device;
+    transfer_name = saved_method;
+    buffer_time = saved_buffer;
+    period_time = saved_period;
+    rate = saved_rate;
+    return bad ? -1 : 0;
 }
 
-void * getEnter()
+static int bench_run(const char *name)
 {
-    //inspect key value
-    while(1){
-        switch (getchar())
-        {
-            case 3:
-              pthread_mutex_lock(&mutex);OnWav = 0;m_Interrupt = 1;pthread_mutex_unlock(&mutex);printf("[!] Manually interrupted by Ctrl-C.\n");return 0;
-            case 0x1B:
-              pthread_mutex_lock(&mutex);OnWav = 0;m_Interrupt = 1;pthread_mutex_unlock(&mutex);return 0;
-            case '\n':
-              putchar('\n');break;
-        }
+    int all = !strcmp(name, "all"), err = 0, found = 0;
+    if (all || !strcmp(name, "synth")) {
+        err |= bench_synth();
+        found = 1;
     }
-    return 0;
+    if (all || !strcmp(name, "timing")) {
+        err |= bench_timing();
+        found = 1;
+    }
+    if (all || !strcmp(name, "codebook")) {
+        err |= bench_codebook();
+        found = 1;
+    }
+    if (all || !strcmp(name, "decoder")) {
+        err |= bench_decoder();
+        found = 1;
+    }
+    if (all || !strcmp(name, "replay")) {
+        err |= bench_replay();
+        found = 1;
+    }
+    if (all || !strcmp(name, "beam")) {
+        err |= bench_beam();
+        found = 1;
+    }
+    if (all || !strcmp(name, "listen")) {
+        err |= bench_listen();
+        found = 1;
+    }
+    if (all || !strcmp(name, "skim")) {
+        err |= bench_skim();
+        found = 1;
+    }
+    if (all || !strcmp(name, "serve")) {
+        err |= bench_serve();
+        found = 1;
+    }
+    if (all || !strcmp(name, "pileup")) {
+        err |= bench_pileup();
+        found = 1;
+    }
+    if (all || !strcmp(name, "latency")) {
+        err |= bench_latency();
+        found = 1;
+    }
+    if (!found) {
+        printf("[!] Unknown benchmark '%s' (synth, timing, codebook, decoder, replay, beam, listen, skim, serve, pileup, latency, all)\n", name);
+        return -1;
+    }
+    return err;
 }
 
 int usage_print(char* pName)
@@ -700,20 +7688,80 @@ int usage_print(char* pName)
     printf("                       which means 5 characters per block,\n");
     printf("                       3 blocks per line, 4 total lines.\n");
     printf("  --randmod, -m [num]  E.g. [num]=F23 play CW in 15 x 2 x 3,\n");
-    printf("                       more common setting could be 814.\n\n");
+    printf("                       more common setting could be 814.\n");
+    printf("  --layout [CxBxL]     Same as -m in decimal, e.g. 5x10x200.\n");
+    printf("  --charset [SET]      Draw from default, letters, digits, alnum, punct,\n");
+    printf("                       prosigns, cyrillic or the listed characters.\n");
+    printf("  --seed [N]           Repeat the random text of seed [N].\n");
+    printf("  --export [FILE]      Write the random text to [FILE] (- for stdout),\n");
+    printf("  --groups [N]         [N] groups in total, generated on all CPUs.\n\n");
     printf("Default [Num] will be set to 3 when unspecified.\n");
     printf("  --event, -e [Num]    Specified input device as\n");
-    printf("                       /dev/input/event[Num]\n");
-    printf("  --device, -d, -D [Num]   Same as --event, -e.\n\n");
+    printf("                       /dev/input/event[Num], or several as 3,5,...\n");
+    printf("  --device, -d, -D [Num]   Same as --event, -e.\n");
+    printf("  --iambic [A|B]       Key paddles through an iambic keyer in mode A\n");
+    printf("                       or B at [speed], timed on the sample clock.\n");
+    printf("  --paddle [DIT,DAH]   Key codes of the paddles (default 29,97: left and\n");
+    printf("                       right Ctrl); other keys stay straight keys.\n\n");
     printf("Default [SR] will be set to 44100 when unspecified.\n");
-    printf("  --rate, -r [SR]      Set audio sample rate to [SR]Hz.\n\n");
+    printf("  --rate, -r [SR]      Set audio sample rate to [SR]Hz.\n");
+    printf("  --method [NAME]      Transfer method: write (default) or mmap, which\n");
+    printf("                       renders in place and falls back to write.\n");
+    printf("  --rt [PRIO[,KEY]]    Run the audio thread at SCHED_FIFO [PRIO] and the\n");
+    printf("                       key thread at [KEY] (one above), memory locked.\n");
+    printf("  --cpu [CPU[,KEY]]    Pin the audio thread to [CPU], the key thread to [KEY].\n");
+    printf("  --epoll              Key, decode and play on one event loop; with --rt\n");
+    printf("                       the audio keeps a thread of its own.\n");
+    printf("  --control [SOCK]     Take wpm, spacing, tone and volume changes as\n");
+    printf("                       lines of NAME [[+|-]VALUE] on Unix socket [SOCK].\n");
+    printf("  --beam [N]           Decode keyed and heard CW by beam search over [N]\n");
+    printf("                       readings (16 with --lm) instead of one at a time.\n");
+    printf("  --lm [FILE]          Score the beam with the language model in [FILE].\n");
+    printf("  --lm-build [LIST]    Build --lm [FILE] from lines of WORD [COUNT] and exit.\n");
+    printf("  --record [FILE]      Log every key transition of the session to [FILE].\n");
+    printf("  --replay [FILE]      Key a logged session again at its own pace.\n");
+    printf("  --replay-fast [FILE] Decode a logged session as fast as it goes.\n");
+    printf("  --stats              Print per thread counters and timings at exit.\n");
+    printf("  --metrics [FILE]     Keep them in [FILE] in Prometheus text format.\n\n");
     printf("Default [TF] will be set to 750 when unspecified.\n\n");
     printf("  --frequency, -f [TF] Set tone frequency to [TF]Hz.\n\n");
+    printf("  --alphabet, -a [AB]  Decode keyed letters as latin or cyrillic.\n\n");
     printf("Use keyboard or any devices as input when [FILE] unspecified.\n");
-    printf("  --input, -i [FILE]   Read text file [FILE] as Morse code.\n\n");
+    printf("  --input, -i [FILE]   Read text file [FILE] as Morse code.\n");
+    printf("                       [FILE] may be a pipe or FIFO, - reads standard input.\n");
+    printf("  --echo [MODE]        Show the text as it sounds (sync), only at the end\n");
+    printf("                       (hide) or a number of seconds behind it.\n\n");
+    printf("Render instead of playing, one thread per CPU; with several [FILE]s\n");
+    printf("given after the options, [PATH] is a directory of [FILE].wav.\n");
+    printf("  --output, -o [PATH]  Write the Morse code of [FILE] as WAV to [PATH].\n");
+    printf("  --raw                Write headerless PCM instead of WAV.\n\n");
     printf("Default [speed] and [sspeed] will be set to 15 when unspecified.\n\n");
     printf("  --wpm, -w [speed]    Change the reading or preferred typing speed.\n");
-    printf("  --space, -s [sspeed] Change ONLY the speed of the space between words.\n\n");
+    printf("  --space, -s [sspeed] Change ONLY the speed of the space between words.\n");
+    printf("  --adaptive           Follow the typing speed instead of [speed].\n");
+    printf("  --listen [SRC]       Decode CW audio from a capture device or WAV file.\n");
+    printf("  --auto-tone          Find the tone instead of using --freq.\n");
+    printf("  --skim [SRC]         Decode every CW signal in the passband of [SRC].\n\n");
+    printf("Simulate a pile-up, played live or rendered with --output:\n");
+    printf("  --pileup [N]         [N] stations calling at once around [TF],\n");
+    printf("                       each keying [chars]x[blocks]x[lines] groups.\n");
+    printf("  --noise [LEVEL]      White Gaussian band noise, RMS as a part of full scale.\n");
+    printf("  --qsb [DEPTH]        Fade each station by up to [DEPTH] (0 to 1).\n");
+    printf("  --qrn [RATE]         [RATE] static crashes per second.\n\n");
+    printf("  --bench [NAME]       Run benchmark NAME (synth, timing,\n");
+    printf("                       codebook, decoder, replay, beam, listen, skim, serve,\n");
+    printf("                       pileup, latency, all) and exit.\n");
+    printf("  --trace [WPM[,JIT[,WGT[,DRIFT[,DAH]]]]]  Replay a fist of [WPM] with [JIT]%%\n");
+    printf("                       jitter, [WGT]%% weight, [DRIFT]%% speed change and\n");
+    printf("                       [DAH] tenths dah ratio (10,50,0,30) instead of the set.\n");
+    printf("  --loopback [CARD]    snd-aloop card the latency bench plays through.\n\n");
+    printf("Key for many trainees from one process, or load test such a server:\n");
+    printf("  --serve [SOCK]       Key the text each client sends to Unix socket [SOCK],\n");
+    printf("                       streaming back PCM and the decoded copy.\n");
+    printf("  --load [SOCK]        Load test the server on [SOCK] with rounds of 1, 4,\n");
+    printf("                       16... sessions keying -i [FILE], -R or PARIS.\n");
+    printf("  --sessions [N]       Most sessions served or loaded at once (256).\n");
+    printf("  --workers [N]        Server worker threads (one per online CPU).\n\n");
     printf("For beginners, the following settings are good for improving your hearing:\n");
     printf("    %s -R -s 5\n", pName);
     printf("    %s -m F14 -s 8\n", pName);
@@ -736,15 +7784,59 @@ int main(int argc, char *argv[])
         {"wpm", 1, NULL, 'w'},
         {"space", 1, NULL, 's'},
         {"randmod",1,NULL,'m'},
+        {"alphabet",1,NULL,'a'},
+        {"output",1,NULL,'o'},
+        {"adaptive",0,NULL,'A'},
+        {"listen",1,NULL,'l'},
+        {"auto-tone",0,NULL,'T'},
+        {"skim",1,NULL,'K'},
+        {"pileup",1,NULL,'U'},
+        {"noise",1,NULL,'N'},
+        {"qsb",1,NULL,'Q'},
+        {"qrn",1,NULL,'Z'},
+        {"method",1,NULL,'M'},
+        {"layout",1,NULL,'L'},
+        {"charset",1,NULL,'C'},
+        {"seed",1,NULL,'S'},
+        {"export",1,NULL,'X'},
+        {"groups",1,NULL,'G'},
+        {"raw",0,NULL,'P'},
+        {"bench",1,NULL,'B'},
+        {"loopback",1,NULL,'Y'},
+        {"rt",1,NULL,'F'},
+        {"cpu",1,NULL,'c'},
+        {"epoll",0,NULL,'E'},
+        {"iambic",1,NULL,'I'},
+        {"paddle",1,NULL,'p'},
+        {"serve",1,NULL,'V'},
+        {"load",1,NULL,'O'},
+        {"sessions",1,NULL,'n'},
+        {"workers",1,NULL,'W'},
+        {"stats",0,NULL,'u'},
+        {"metrics",1,NULL,'x'},
+        {"trace",1,NULL,'t'},
+        {"control",1,NULL,'k'},
+        {"beam",1,NULL,'b'},
+        {"lm",1,NULL,'j'},
+        {"lm-build",1,NULL,'g'},
+        {"record",1,NULL,'z'},
+        {"replay",1,NULL,'v'},
+        {"replay-fast",1,NULL,'y'},
+        {"echo",1,NULL,'q'},
         {NULL, 0, NULL, 0}
     };
 
-    int rc, readmod = 0, wpm = 15, countpf, Copt;
+    int rc, readmod = 0, wpm = 15, spacing = 0, countpf, Copt;
     int lines_ct=4, blocks_ct=3, inblock_ct=5;
+    char *bench = NULL, *output = NULL, *export = NULL, *listen = NULL, *skim = NULL, *list;
+    char *serve = NULL, *load = NULL, *lm_list = NULL, *record = NULL;
+    int raw = 0, seeded = 0;
+    unsigned long long groups = 0;
 
     pthread_t CW_pid, SC_pid, BL_pid;
+    struct session_usage usage;
 
-    while (!((Copt = getopt_long(argc, argv, "he:D:d:r:f:i:w:s:m:R", long_option, NULL)) < 0)) {
+    while (!((Copt = getopt_long(argc, argv, "he:D:d:r:f:i:w:s:m:Ra:o:B:L:C:S:X:G:PAl:TK:U:N:Q:Z:M:Y:F:c:EI:p:V:O:n:W:ux:t:k:b:j:g:z:v:y:q:", long_option, NULL)) < 0)) {
         switch (Copt) {
         case 'h':
            usage_print(argv[0]);
@@ -752,8 +7844,26 @@ int main(int argc, char *argv[])
         case 'e':
         case 'd':
         case 'D':
-            EVENTnum = atoi(optarg);
-            EVENTnum < 0 ? 0 : EVENTnum;
+            key_devices = 0;
+            list = optarg;
+            do {
+                key_device[key_devices] = strtol(list, &list, 10);
+                key_device[key_devices] = key_device[key_devices] < 0 ? 0 : key_device[key_devices];
+                key_devices++;
+            } while (*list++ == ',' && key_devices < KEY_MAX_DEVICES);
+            break;
+        case 'I':
+            if((optarg[0] != 'A' && optarg[0] != 'B') || optarg[1]){
+                printf("[!] Unknown keyer mode '%s' (A, B)\n",optarg);return 1;
+            }
+            keyer_mode = optarg[0];
+            keyer_on = 1;
+            break;
+        case 'p':
+            if(sscanf(optarg,"%d,%d",&paddle_code[0],&paddle_code[1])!=2){
+                printf("[!] Paddles '%s' are not [DIT],[DAH] key codes\n",optarg);return 1;
+            }
+            keyer_on = 1;
             break;
         case 'r':
             rate = atoi(optarg);
@@ -770,59 +7880,353 @@ int main(int argc, char *argv[])
             readmod = 1;
             break;
         case 'R':
-            sprintf(filename,".CWtest");
-            printf("Random Mod: %d x %d x %d\n",inblock_ct,blocks_ct,lines_ct);readmod = 1;
+            filename[0] = 0;readmod = 2;
             break;
         case 'm':
-            sprintf(filename,".CWtest");
+            filename[0] = 0;
             lines_ct=optarg[2]>'9'?(optarg[2]>'Z'?10+optarg[2]-'a':10+optarg[2]-'A'):optarg[2]-'0';
             blocks_ct=optarg[1]>'9'?(optarg[1]>'Z'?10+optarg[1]-'a':10+optarg[1]-'A'):optarg[1]-'0';
             inblock_ct=optarg[0]>'9'?(optarg[0]>'Z'?10+optarg[0]-'a':10+optarg[0]-'A'):optarg[0]-'0';
             lines_ct<1?1:lines_ct;
             blocks_ct<1?1:blocks_ct;
             inblock_ct<1?1:inblock_ct;
-            printf("Random Mod: %d x %d x %d\n",inblock_ct,blocks_ct,lines_ct);readmod = 1;
+            readmod = 2;
+            break;
+        case 'L':
+            if(sscanf(optarg,"%dx%dx%d",&inblock_ct,&blocks_ct,&lines_ct)!=3 || inblock_ct<1 || blocks_ct<1 || lines_ct<1){
+                printf("[!] Layout '%s' is not [chars]x[blocks]x[lines]\n",optarg);return 1;
+            }
+            filename[0] = 0;readmod = 2;
+            break;
+        case 'C':
+            if(charset_parse(&gen_charset,optarg)<0){
+                printf("[!] Empty charset\n");return 1;
+            }
+            break;
+        case 'S':
+            gen_seed = strtoull(optarg,NULL,0);seeded = 1;
+            break;
+        case 'X':
+            export = optarg;
+            break;
+        case 'A':
+            decode_adaptive = 1;
+            break;
+        case 'l':
+            listen = optarg;
+            break;
+        case 'T':
+            tone_auto = 1;
+            break;
+        case 'K':
+            skim = optarg;
+            break;
+        case 'U':
+            pileup_count = atoi(optarg);
+            pileup_count = pileup_count < 1 ? 1 : pileup_count;
+            pileup_count = pileup_count > PILEUP_MAX ? PILEUP_MAX : pileup_count;
+            break;
+        case 'N':
+            pileup_noise = atof(optarg);
+            pileup_noise = pileup_noise < 0 ? 0 : pileup_noise > 1 ? 1 : pileup_noise;
+            break;
+        case 'Q':
+            pileup_qsb = atof(optarg);
+            pileup_qsb = pileup_qsb < 0 ? 0 : pileup_qsb > 1 ? 1 : pileup_qsb;
+            break;
+        case 'Z':
+            pileup_qrn = atof(optarg);
+            pileup_qrn = pileup_qrn < 0 ? 0 : pileup_qrn > 100 ? 100 : pileup_qrn;
+            break;
+        case 'M':
+            if(transfer_find(optarg)<0){
+                printf("[!] Unknown transfer method '%s' (write, mmap)\n",optarg);return 1;
+            }
+            transfer_name = optarg;
+            break;
+        case 'G':
+            groups = strtoull(optarg,NULL,0);
             break;
         case 'w':
             wpm = atoi(optarg);
-            wpm<5?5:wpm;
-            wpm>30?30:wpm;
-            usec_DI = wpm<15?(((15.0/wpm-1)*0.3+1)*usec_DI):(((15.0/wpm-1)*0.9+1)*usec_DI);
-            usec_DA = wpm<15?(((15.0/wpm-1)*0.3+1)*usec_DA):(((15.0/wpm-1)*0.9+1)*usec_DA);
-            usec_SGap = wpm<15?(((15.0/wpm-1)*0.2+1)*usec_SGap):(((15.0/wpm-1)*0.50+1)*usec_SGap);
-            usec_BGap = wpm<15?(((15.0/wpm-1)*2.0+1)*usec_BGap):(((15.0/wpm-1)*1.05+1)*usec_BGap);
-            val_dida = 1.5*usec_DI; val_char = 2.5*usec_SGap; val_space = 1.5*usec_BGap;//resize type interval
+            wpm = wpm < 5 ? 5 : wpm > 99 ? 99 : wpm;
+            keyer_wpm = wpm;
+            speed_set(wpm, spacing);//resize type interval
             break;
         case 's':
-            wpm = atoi(optarg);
-            wpm<5?5:wpm;
-            wpm>30?30:wpm;
-            usec_BGap = wpm<15?(((15.0/wpm-1)*2.0+1)*usec_BGap):(((15.0/wpm-1)*1.05+1)*usec_BGap);
-            val_dida = 1.5*usec_DI; val_char = 2.5*usec_SGap; val_space = 1.5*usec_BGap;
+            spacing = atoi(optarg);
+            spacing = spacing < 5 ? 5 : spacing > 99 ? 99 : spacing;
+            speed_set(wpm, spacing);
+            break;
+        case 'a':
+            if(!strcmp(optarg,"cyrillic")){
+                cw_decode = cw_decode_cyrillic;
+            }else if(strcmp(optarg,"latin")){
+                printf("[!] Unknown alphabet '%s' (latin, cyrillic)\n",optarg);return 1;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'P':
+            raw = 1;
+            break;
+        case 'B':
+            bench = optarg;
+            break;
+        case 'Y':
+            loopback_card = optarg;
+            break;
+        case 'E':
+            runtime_epoll = 1;
+            break;
+        case 'F':
+            if((rc = sscanf(optarg,"%d,%d",&rt_audio.prio,&rt_key.prio))<1 || rt_audio.prio<1 || rt_audio.prio>98){
+                printf("[!] Real-time priority '%s' is not [AUDIO][,KEY] in 1..98\n",optarg);return 1;
+            }
+            rt_key.prio = rc == 2 ? rt_key.prio : rt_audio.prio + 1;
+            rt_key.prio = rt_key.prio < 1 ? 1 : rt_key.prio > 99 ? 99 : rt_key.prio;
+            break;
+        case 'c':
+            if((rc = sscanf(optarg,"%d,%d",&rt_audio.cpu,&rt_key.cpu))<1 || rt_audio.cpu<0 || rt_audio.cpu>=CPU_SETSIZE){
+                printf("[!] CPU list '%s' is not [AUDIO][,KEY]\n",optarg);return 1;
+            }
+            rt_key.cpu = rc == 2 && rt_key.cpu < CPU_SETSIZE ? rt_key.cpu : rt_audio.cpu;
+            break;
+        case 'V':
+            serve = optarg;
+            break;
+        case 'u':
+            stats_summary = 1;
+            break;
+        case 't':
+            if(sscanf(optarg,"%d,%d,%d,%d,%d",&bench_trace_opt.wpm,&bench_trace_opt.jitter,&bench_trace_opt.weight,
+                      &bench_trace_opt.drift,&bench_trace_opt.ratio)<1 || bench_trace_opt.wpm<5 || bench_trace_opt.wpm>99 ||
+               bench_trace_opt.jitter<0 || bench_trace_opt.jitter>50 || bench_trace_opt.weight<25 || bench_trace_opt.weight>75 ||
+               bench_trace_opt.drift<-50 || bench_trace_opt.drift>200 || bench_trace_opt.ratio<20 || bench_trace_opt.ratio>60){
+                printf("[!] Trace '%s' is not [WPM 5..99][,JITTER 0..50][,WEIGHT 25..75][,DRIFT -50..200][,DAH 20..60]\n",optarg);return 1;
+            }
+            if(!bench){
+                bench = "replay";
+            }
             break;
+        case 'x':
+            stats_path = optarg;
+            break;
+        case 'O':
+            load = optarg;
+            break;
+        case 'n':
+            serve_sessions = atoi(optarg);
+            serve_sessions = serve_sessions < 1 ? 1 : serve_sessions;
+            serve_sessions = serve_sessions > SERVE_MAX_SESSIONS ? SERVE_MAX_SESSIONS : serve_sessions;
+            break;
+        case 'W':
+            serve_workers = atoi(optarg);
+            serve_workers = serve_workers < 1 ? 1 : serve_workers;
+            serve_workers = serve_workers > SERVE_MAX_WORKERS ? SERVE_MAX_WORKERS : serve_workers;
+            break;
+        case 'k':
+            control_path = optarg;
+            break;
+        case 'b':
+            beam_width = atoi(optarg);
+            beam_width = beam_width < 1 ? 1 : beam_width > BEAM_MAX ? BEAM_MAX : beam_width;
+            break;
+        case 'j':
+            lm_path = optarg;
+            break;
+        case 'g':
+            lm_list = optarg;
+            break;
+        case 'z':
+            record = optarg;
+            break;
+        case 'y':
+            replay_fast = 1;
+            replay_path = optarg;
+            break;
+        case 'v':
+            replay_path = optarg;
+            break;
+        case 'q':
+            if(!strcmp(optarg,"hide")){
+                echo_lag = ECHO_HIDE;
+            }else if(!strcmp(optarg,"sync")){
+                echo_lag = 0;
+            }else if((echo_lag = atof(optarg)) <= 0){
+                printf("[!] --echo takes sync, hide or a delay in seconds, not '%s'\n",optarg);return 1;
+            }
+            break;
+        }
+    }
+    if(replay_path){
+        /* replay with the keyer and speed it was recorded with */
+        if(key_log_open(replay_path, &key_log) < 0){
+            return 1;
         }
+        wpm = keyer_wpm = key_log.hdr->wpm;
+        keyer_on = key_log.hdr->keyer != 0;
+        keyer_mode = keyer_on ? key_log.hdr->keyer : keyer_mode;
+        speed_set(wpm, spacing);
     }
+    live_conf.wpm = wpm;
+    live_conf.spacing = spacing;
+    live_conf.freq = freq;
 
-    for(countpf=3;countpf>0;countpf--){printf("CW is coming in %d sec, please get ready...\n",countpf);sleep(1);}
+    if(bench){
+        return bench_run(bench) < 0 ? 1 : 0;
+    }
+    if(lm_list){
+        if(!lm_path){
+            printf("[!] --lm-build needs --lm [FILE] to write the model to.\n");return 1;
+        }
+        return lm_build(lm_list, lm_path) < 0 ? 1 : 0;
+    }
+    if(lm_path){
+        if(lm_open(lm_path, &lm) < 0){
+            return 1;
+        }
+        beam_width = beam_width ? beam_width : 16;
+        printf("[+] Language model %s: %u words.\n", lm_path, lm.words);
+    }
+    if(stats_summary || stats_path){
+        stats_start();
+    }
 
-    if(readmod){
-        if(generate_cwtest(lines_ct,blocks_ct,inblock_ct)){
-            printf("Unable to create .CWtest in the fold.\n");return 0;
+    if(!gen_charset.count){
+        charset_parse(&gen_charset,"default");
+    }
+    if(!seeded){
+        gen_seed = ((uint64_t)time(NULL) << 20) ^ getpid();
+    }
+    if(listen){
+        return ListenDaemon(listen) < 0 ? 1 : 0;
+    }
+    if(replay_fast){
+        return ReplayFast() < 0 ? 1 : 0;
+    }
+    if(skim){
+        return SkimDaemon(skim) < 0 ? 1 : 0;
+    }
+    if(export){
+        return generate_export(export, groups ? groups : (uint64_t)lines_ct*blocks_ct, inblock_ct, blocks_ct) < 0 ? 1 : 0;
+    }
+    if(pileup_count){
+        if(output){
+            return render_pileup(output, raw, inblock_ct, lines_ct*blocks_ct) < 0 ? 1 : 0;
         }
+        if(pileup_init(&pileup, pileup_count, rate, inblock_ct, lines_ct*blocks_ct, 1, stdout) < 0){
+            return 1;
+        }
+        for(countpf=3;countpf>0;countpf--){printf("Pile-up is coming in %d sec, please get ready...\n",countpf);sleep(1);}
         if((rc = pthread_create(&BL_pid, NULL, getEnter, NULL))<0){
             printf("[!] Fail to create KeyBlocker thread.\n");
         }else{
-            printf("\n[+] KeyBlocker is on (press ENTER to start a new line)\n\nAll can be interrupted by ESC-ENTER.\n\nReading at %d-WPM:\n\n",wpm);
+            printf("\n[+] KeyBlocker is on\n\nAll can be interrupted by ESC-ENTER.\n\n%d stations calling around %.0f Hz:\n\n",pileup_count,freq);
+        }
+        SoundDaemon_mod(2);
+        pileup_free(&pileup);
+        return 0;
+    }
+    if(readmod == 2){
+        if(generate_cwtest(lines_ct,blocks_ct,inblock_ct)){
+            printf("[!] No enough memory. Error code: practice text\n");return 1;
+        }
+        printf("Random Mod: %d x %d x %d, seed %llu\n",inblock_ct,blocks_ct,lines_ct,(unsigned long long)gen_seed);
+    }
+    if(serve){
+        return ServeDaemon(serve) < 0 ? 1 : 0;
+    }
+    if(load){
+        char text[LOAD_TEXT] = "PARIS PARIS";
+        size_t len = strlen(text);
+        FILE *fin = readmod == 1 ? fopen(filename,"r") : NULL;
+        if(readmod == 2){
+            len = practice_len < sizeof(text) ? practice_len : sizeof(text);
+            memcpy(text, practice_text, len);
+        }else if(readmod == 1){
+            if(fin == NULL){
+                printf("Unable to read file.\n");return 1;
+            }
+            len = fread(text, 1, sizeof(text), fin);
+            fclose(fin);
+        }
+        return LoadDaemon(load, text, len) < 0 ? 1 : 0;
+    }
+
+    if(output){
+        char **inputs = calloc(argc + 1, sizeof(char *));
+        int count = 0;
+        if(inputs == NULL){
+            printf("[!] No enough memory. Error code: inputs\n");return 1;
+        }
+        if(readmod){
+            inputs[count++] = readmod == 2 ? NULL : filename;
+        }
+        while(optind < argc){
+            inputs[count++] = argv[optind++];
+        }
+        if(count < 1){
+            printf("[!] Nothing to render, give -i [FILE] or files after the options.\n");return 1;
+        }
+        return render_batch(inputs, count, output, raw) < 0 ? 1 : 0;
+    }
+
+    live_on = 1;
+    if(control_path && control_start(control_path) < 0){
+        return 1;
+    }
+    if(readmod == 1 && (text_fd = text_open(filename)) < 0){
+        printf("Unable to read file.\n");return 1;
+    }
+    for(countpf=3;countpf>0;countpf--){printf("CW is coming in %d sec, please get ready...\n",countpf);sleep(1);}
+
+    if(readmod){
+        if(text_fd == STDIN_FILENO){
+            printf("\n[+] Text comes from standard input, it ends with the input or Ctrl-C.\n\nReading at %d-WPM:\n\n",wpm);
+        }else if((rc = pthread_create(&BL_pid, NULL, getEnter, NULL))<0){
+            printf("[!] Fail to create KeyBlocker thread.\n");
+        }else{
+            printf("\n[+] KeyBlocker is on (press ENTER to start a new line)\n\nAll can be interrupted by ESC-ENTER.\n" LIVE_HELP "\nReading at %d-WPM:\n\n",wpm);
         }
         SoundDaemon_mod(1);
         return 0;
     }
-    pthread_mutex_init(&mutex,NULL);//initiate lock for global interchange.
+    if(keyer_on){
+        /* the keyer sends 1:3 at keyer_wpm, split dit and dah at two units, gaps at two and five */
+        val_dida = val_char = 2 * 1200000 / keyer_wpm;
+        val_space = 5 * 1200000 / keyer_wpm;
+        printf("[+] Iambic keyer in mode %c at %d WPM, paddles on keys %d and %d.\n",keyer_mode,keyer_wpm,paddle_code[0],paddle_code[1]);
+    }
+    if(record && record_start(record, wpm) < 0){
+        return 1;
+    }
+    if(replay_path && runtime_epoll){
+        printf("[!] --replay keys through threads, --epoll is left off.\n");
+        runtime_epoll = 0;
+    }
+    session_mark(&usage);
+    if(runtime_epoll){
+        system(INPUT_NODISP);
+        printf("\n[+] Event loop is on (press ENTER to start a new line)\n\nAll can be interrupted by ESC-ENTER.\n" LIVE_HELP "\nYour scripts:\n\n");
+        if((rc = EventDaemon())<0){
+            printf("[!] EventDaemon quit with errors.\n");
+        }
+        system(INPUT_NORMAL);
+        session_report(&usage);
+        if(key_ring.dropped){
+            printf("[!] %u key events dropped.\n",key_ring.dropped);
+        }
+        return 0;
+    }
+    key_wake_fd = eventfd(0, EFD_NONBLOCK);//wakes the idle sound thread on key down.
+    decode_wake_fd = eventfd(0, EFD_NONBLOCK);//wakes the decoder on key events.
 
     system(INPUT_NODISP);
 
 
-    if((rc = pthread_create(&CW_pid, NULL, KeyDaemon_CW, NULL))<0){
+    if((rc = pthread_create(&CW_pid, NULL, replay_path ? ReplayDaemon : KeyDaemon_CW, NULL))<0){
         printf("[!] Fail to create KeyDaemon thread.\n");
     }
     while(!KeyEventAccess){sleep(0.5);}
@@ -832,14 +8236,19 @@ int main(int argc, char *argv[])
     if((rc = pthread_create(&BL_pid, NULL, getEnter, NULL))<0){
         printf("[!] Fail to create KeyBlocker thread.\n");
     }else{
-        printf("\n[+] KeyBlocker is on (press ENTER to start a new line)\n\nAll can be interrupted by ESC-ENTER.\n\nYour scripts:\n\n");
+        printf("\n[+] KeyBlocker is on (press ENTER to start a new line)\n\nAll can be interrupted by ESC-ENTER.\n" LIVE_HELP "\nYour scripts:\n\n");
     }
     if((rc = SoundDaemon_mod(0))<0){
         printf("[!] SoundDaemon quit with errors.\n");
     }
     system(INPUT_NORMAL);
     pthread_join(SC_pid,NULL);printf("[-] PrintDaemon closed.\n");
-    pthread_join(BL_pid,NULL);printf("[-] KeyBlocker closed.\n");
-    pthread_mutex_destroy(&mutex);
+    if(!replay_path){
+        pthread_join(BL_pid,NULL);printf("[-] KeyBlocker closed.\n");
+    }
+    session_report(&usage);
+    if(key_ring.dropped){
+        printf("[!] %u key events dropped.\n",key_ring.dropped);
+    }
     return 0;
 }